@@ -21,6 +21,34 @@
 
     Numbers for direction and orderType are defined below.
 
+    Any command may be preceded by a request id, e.g.
+
+    #1234 ORDER CES134127 5 100 5000 1 3
+
+    in which case the response is preceded by a line holding just that id
+    (#1234) so that the frontend can have many commands in flight and match
+    up the responses. Without an id, the response is sent bare.
+
+    An id ending in ~ (e.g. #1234~) asks for the command to be traced. The
+    response is then followed, not necessarily at once, by a line
+
+    %1234 <parse_ns> <match_ns> <serialise_ns>
+
+    saying how long we spent splitting up the command, handling it, and
+    formatting what it produced (on the output thread; without one, the
+    formatting is counted as matching and serialise_ns is 0).
+
+    One backend can host many books. Run with a venue and symbol, it starts
+    with that as book 0. Run with no arguments, it starts with no books, and
+    the frontend creates them with
+
+    @<book_id> __NEWBOOK__ <venue> <symbol>
+
+    after which any command can be sent to that book by putting @<book_id>
+    before it (after the request id, if any). Book ids, like account ids,
+    should be low, non-negative integers. Commands without a book id go to
+    book 0. WebSocket messages on stderr carry the venue and symbol anyway.
+
     Other commands:
 
     QUOTE
@@ -29,18 +57,99 @@
     STATUS <id>
     STATUSALL <account_id>
 
+    DUMP <directory>
+    DUMPSTATUS
+    SNAPSHOT
+    SNAPSHOTSTATUS
+
     __SCORES__
     __DEBUG_MEMORY__
+    __STATS__ [RESET]
+    __MEMORY__
+    __CONFLATE__ <min_interval_ms> <every_n_commands>
     __ACC_FROM_ID__ <id>
 
     This last is not a direct response to a user query, but can be used by the
     frontend for authentication purposes (i.e. is the user entitled to cancel
     this order?)
 
+    __CONFLATE__ turns on ticker conflation. Instead of sending a ticker after
+    every change to the book, we mark the quote dirty and send at most one
+    ticker per interval (or per N commands, whichever comes first). A dirty
+    quote is always flushed before we block waiting for input, so the latest
+    state always goes out eventually. Send zeros to turn conflation off.
+
+    DUMP writes the book's whole history to a new CSV file in the directory
+    (POSIX only). It returns at once; the writing is done by a forked child
+    process. DUMPSTATUS reports on the progress of all the book's dumps.
+
+    Run with -workers N (POSIX only), the backend shares its books among N
+    threads, book <book_id> belonging to thread <book_id> % N. The main thread
+    just reads commands and hands them over. Each response is still written
+    in one piece, but responses for different books can come back in a
+    different order than the commands were sent, so use request ids.
+
+    On POSIX, a separate output thread does all the writing to the frontend,
+    and formats the WebSocket messages and single-order responses, so the
+    matching never waits on either. This changes nothing about the output.
+
+    Run with -shm (POSIX only), the backend talks to the frontend through
+    shared memory instead of stdin / stdout / stderr, though the bytes are
+    exactly the same. See init_shm() for what the frontend must set up.
+
+    Run with -journal <directory> (POSIX only), every book keeps a journal of
+    its ORDERs and CANCELs in that directory, and a book that already has one
+    is rebuilt from it when created (the __NEWBOOK__ response then says how
+    many commands were replayed). Accounts are matched by name to the ints in
+    <directory>/accounts, the frontend's "name int" list, if there is one.
+    See open_journal().
+
+    With -journal, SNAPSHOT writes the book to a binary snapshot in the same
+    directory (by a forked child, like DUMP), and the journal is then cut
+    down to what came after it, so that a restart doesn't mean replaying
+    everything ever. With -snapshotevery N, this happens by itself every N
+    journaled commands. SNAPSHOTSTATUS reports on the latest one.
+
+    __STATS__ reports how long each type of command has taken the backend
+    (a histogram of times, summarised as percentiles), and how much matching
+    work has been done. With RESET, everything is zeroed after reporting.
+
+    __MEMORY__ reports (as JSON) how much heap the book is using for each type
+    of thing, and the most it has ever used; __DEBUG_MEMORY__ includes this.
+
+    __AFFINITY__ <cpu>,<cpu>,... (Linux only) pins every thread of the backend
+    to those CPUs. Like __NEWBOOK__, it needs no book. The frontend uses it to
+    give busy books cores of their own (see -affinity).
+
+    Run with -archive N (POSIX only), closed orders at least N orders old are
+    moved out of the heap into a memory-mapped file, which STATUS and
+    STATUSALL read from as needed. See archive_order().
+
+    Run with -virtualclock <unix_seconds>, the clock starts at that time and
+    never looks at the real time, so the same commands always give the same
+    output, however fast they come. Each timestamp is a microsecond after the
+    one before, and -clockstep N adds N more microseconds before each command.
+    A command can also move the clock forward with a token after the book id:
+
+    #1234 @0 $1420070400123456 ORDER CES134127 5 100 5000 1 3
+
+    i.e. Unix microseconds, which the next timestamp will be (unless that would
+    take the clock backwards). Without -virtualclock, the token is ignored.
+    ORDERBOOK_BINARY responses are then followed by a line with the time.
+
+    Compiled with DISORDERBOOK_ENGINE (and DISORDERBOOK_NO_MAIN), this file
+    is a library instead, which the frontend links in (see -inprocess) and
+    calls directly. See engine_new() and friends near the end.
+
     */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+    #define _GNU_SOURCE             // For cpu_set_t and pthread_setaffinity_np()
+#endif
+
 #include <assert.h>
 #include <inttypes.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -48,8 +157,22 @@
 #include <time.h>
 
 // On Windows, need this so we can use _setmode so we don't send \r\n
+// (Worker threads are POSIX-only; on Windows there is only ever the main thread.)
 #if defined(_WIN32)
     #include <fcntl.h>
+    #include <io.h>
+    #include <windows.h>
+    #define strtok_r strtok_s
+#else
+    #include <errno.h>
+    #include <poll.h>
+    #include <pthread.h>
+    #include <sched.h>
+    #include <stdatomic.h>
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/wait.h>
+    #include <unistd.h>
 #endif
 
 #define BUY 1       // Don't change these now, they are also used in the frontend
@@ -61,16 +184,82 @@
 #define IOC 4
 
 #define MAXSTRING 2048
+#define INPUTBUFFERSIZE 65536
 #define SMALLSTRING 64
 #define MAXTOKENS 64                // Well-behaved frontend will never send this many
 
 #define MAXORDERS 2000000000        // Not going all the way to MAX_INT, because various numbers might go above this
 #define MAXACCOUNTS 5000
+#define MAXBOOKS 5000
+#define MAXWORKERS 64
+#define RINGSIZE 1024               // Commands waiting for each worker thread; must be a power of 2
+#define SPINS_BEFORE_SLEEP 2000
+#define OUTRINGSIZE 1024            // Records waiting for the output thread, per worker; must be a power of 2
+
+#define OUT_RESPONSE_BLOB 1         // Types of record for the output thread
+#define OUT_EVENT_BLOB 2
+#define OUT_ORDER 3
+#define OUT_EXECUTION 4
+#define OUT_TICKER 5
+#define OUT_ORDERBOOK 6
+#define OUT_ACCOUNT_ORDERS 7
+#define OUT_SCORES 8
+#define OUT_TRACE 9                 // The %<id> line for a traced command (see finish_trace())
+
+#define SHM_RING_SIZE (1 << 20)     // These must match the frontend (disorderBook_shm.go)
+#define SHM_HEADER_SIZE 256
+#define SHM_TAIL 0                  // Offsets within each ring's header (separate cache lines)
+#define SHM_HEAD 64
+#define SHM_SLEEPING 128
+#define SHM_SPINS 20000             // How long a reader busy-polls before sleeping on its doorbell
 
 #define TOO_MANY_ORDERS 1
 #define SILLY_VALUE 2
 #define TOO_HIGH_ACCOUNT 3
 
+#define DUMP_RUNNING 0
+#define DUMP_DONE 1
+#define DUMP_FAILED 2
+#define DUMPBUFFERSIZE 65536
+
+#define JOURNAL_MAGIC "DBJRNL2"     // Bump the number if the header or record layout ever changes
+#define JOURNAL_ORDER 1
+#define JOURNAL_CANCEL 2
+#define JOURNAL_SYNC_MS 10          // Under constant load, a worker still syncs its journals this often
+#define JOURNALREADSIZE (1 << 20)
+#define SNAPSHOT_MAGIC "DBSNAP1"
+#define SNAPSHOT_END "DBSNEND"
+#define CHECKSUM_START 2166136261u     // See checksum_bytes()
+#define SNAPSHOT_CHECK_MS 10        // How often a worker looks to see whether a snapshot's child is done
+
+#define ARCHIVE_TS_LEN 32           // Timestamps are 27 characters
+#define ARCHIVESEGMENTSIZE (16 << 20)   // The archive is mapped in pieces this big, which never move
+#define ARCHIVEBATCH 1024           // Orders are archived at least this many at a time
+
+#define STATS_ORDER 0               // Types of command timed for __STATS__
+#define STATS_CANCEL 1
+#define STATS_STATUS 2
+#define STATS_STATUSALL 3
+#define STATS_ORDERBOOK_BINARY 4
+#define STATS_QUOTE 5
+#define STATS_OTHER 6
+#define STATS_TYPES 7
+#define STATS_NONE -1               // Not timed (__STATS__ itself)
+#define HISTOGRAM_SUBBUCKETS 8      // Each power of 2 (of nanoseconds) is split into this many buckets,
+#define HISTOGRAM_SUBBITS 3         // so a time is known to within 12.5%
+#define HISTOGRAM_BUCKETS 256       // Enough for 2^34 ns (17 seconds); anything longer goes in the last
+
+#define MEM_BOOK 0                  // Types of thing counted by count_memory()
+#define MEM_ORDERS 1
+#define MEM_ORDERNODES 2
+#define MEM_LEVELS 3
+#define MEM_FILLS 4
+#define MEM_FILLNODES 5
+#define MEM_ACCOUNTS 6
+#define MEM_TIMESTAMPS 7
+#define MEM_DIRECTORIES 8           // The growable arrays that index the rest
+#define MEM_TYPES 9
+
 
 #define EXECUTION_TEMPLATE_1 "{\n\
   \"ok\": true,\n\
@@ -96,6 +285,8 @@ typedef struct Fill_struct {
     int price;
     int qty;
     char * ts;
+    int id;                         // Fills are numbered from 0 in each book (only snapshots need this)
+    int refs;                       // Number of orders with this fill (normally 2) that are still in the heap
 } FILL;
 
 typedef struct FillNode_struct {
@@ -106,7 +297,8 @@ typedef struct FillNode_struct {
 
 typedef struct Account_struct {
     char name[SMALLSTRING];
-    struct Order_struct ** orders;
+    int id;
+    int * orders;                   // Ids, not pointers, as old orders can be archived (see -archive)
     int arraylen;
     int count;
     int posmin;
@@ -125,6 +317,7 @@ typedef struct Order_struct {
     struct Account_struct * account;
     char * ts;
     struct FillNode_struct * firstfillnode;
+    int fillcount;
     int totalFilled;
     int open;
 } ORDER;
@@ -135,11 +328,22 @@ typedef struct OrderNode_struct {
     struct OrderNode_struct * next;
 } ORDERNODE;
 
+typedef struct LevelBytes_struct {         // One level's part of the binary orderbook (see get_level_bytes()). Never
+    #if defined(_WIN32)                     // changed once made, so snapshots share it: the level holds one reference,
+        int refs;                           // and each BOOK_SNAPSHOT that includes it holds another.
+    #else
+        atomic_int refs;
+    #endif
+    int len;
+    unsigned char data[];
+} LEVEL_BYTES;
+
 typedef struct Level_struct {
     struct Level_struct * prev;
     struct Level_struct * next;
     int price;
     struct OrderNode_struct * firstordernode;
+    LEVEL_BYTES * bytes;                    // NULL until asked for, and again whenever the level changes
 } LEVEL;
 
 typedef struct OrderPtrAndError_struct {
@@ -173,1410 +377,5719 @@ typedef struct DebugInfo_struct {
     int reallocs_of_account_order_list;
 } DEBUG_INFO;
 
+typedef struct MemoryInfo_struct {  // Live heap use by type of thing (see count_memory())
+    int64_t objects[MEM_TYPES];
+    int64_t bytes[MEM_TYPES];
+    int64_t peakobjects[MEM_TYPES];
+    int64_t peakbytes[MEM_TYPES];
+    int64_t totalbytes;
+    int64_t peaktotalbytes;
+} MEMORY_INFO;
+
+typedef struct Stats_struct {       // See __STATS__
+    int64_t histogram[STATS_TYPES][HISTOGRAM_BUCKETS];     // See histogram_bucket()
+    int64_t commands[STATS_TYPES];
+    int64_t totalns[STATS_TYPES];
+    int64_t maxns[STATS_TYPES];
+
+    int64_t fills;
+    int64_t levelswalked;           // By incoming orders looking for something to cross with
+    int64_t orderswalked;
+    int64_t tickers;
+
+    int64_t sincens;                // When these started being collected
+} STATS;
+
+typedef struct OutBuf_struct {      // Growable buffer; output is built in one of these, then written out whole
+    char * data;
+    size_t len;
+    size_t cap;
+} OUTBUF;
+
+typedef struct ArchivedFill_struct {
+    int32_t id;
+    int32_t price;
+    int32_t qty;
+    char ts[ARCHIVE_TS_LEN];
+} ARCHIVED_FILL;
+
+typedef struct ArchivedOrder_struct {       // A closed order that has been moved out of the heap into the book's
+    struct Account_struct * account;        // archive (see -archive). Never changes once written, so the output
+    int32_t id;                             // thread can read it at leisure.
+    int32_t direction;
+    int32_t originalQty;
+    int32_t qty;
+    int32_t price;
+    int32_t orderType;
+    int32_t totalFilled;
+    int32_t fillcount;
+    char ts[ARCHIVE_TS_LEN];
+    ARCHIVED_FILL fills[];
+} ARCHIVED_ORDER;
+
+typedef struct OrderSnapshot_struct {       // The parts of an order that can change after an event. Fills are
+    struct Order_struct * order;            // only ever appended, so the first fillcount of them never change.
+    ARCHIVED_ORDER * archived;              // Set instead of order if the order was archived
+    int price;                              // Market orders get set to 0 once they've run
+    int qty;
+    int totalFilled;
+    int open;
+    int fillcount;
+} ORDER_SNAPSHOT;
 
-// ---------------------------------- GLOBALS -----------------------------------------------
-
+typedef struct ScoreSnapshot_struct {
+    struct Account_struct * account;        // Just for the name, which never changes
+    int cents;
+    int shares;
+    int posmin;
+    int posmax;
+} SCORE_SNAPSHOT;
 
-char Venue[SMALLSTRING];
-char Symbol[SMALLSTRING];
-char * StartTime = NULL;
+typedef struct BookSnapshot_struct {        // The binary orderbook (see write_book_snapshot()) as of some version of
+    #if defined(_WIN32)                     // the book. Never changed once made, so it can be shared; the book holds one
+        int refs;                           // reference, as does each response that is still waiting to be written.
+    #else
+        atomic_int refs;
+    #endif
+    int version;
+    LEVEL_BYTES ** levels;                  // The bid levels, best first, then the ask levels
+    int bidlevels;
+    int asklevels;
+} BOOK_SNAPSHOT;
+
+typedef struct OutRecord_struct {   // Something for the output thread to format and write. Compact, so
+    int type;                       // the matching doesn't wait on formatting. Only the fields that
+    struct Book_struct * book;      // the type needs are set.
+    ORDER_SNAPSHOT standing;        // OUT_ORDER uses this one only
+    ORDER_SNAPSHOT incoming;
+    int quantity;
+    int price;
+    char * ts;
+    QUOTE quote;
+    void * snapshot;                // BOOK_SNAPSHOT, or an array of count ORDER_SNAPSHOTs or SCORE_SNAPSHOTs
+    int count;
+    OUTBUF blob;                    // Already formatted; the output thread frees it
+    int traced;                     // Set by publish_out_record() if the command is being traced
+} OUTRECORD;
+
+#if !defined(_WIN32)
+    typedef struct DumpProgress_struct {    // Shared between the backend and a dump's child process
+        _Atomic int64_t ordersdone;
+    } DUMP_PROGRESS;
+
+    typedef struct Dump_struct {
+        char filename[MAXSTRING];
+        pid_t pid;
+        int state;                          // DUMP_RUNNING, DUMP_DONE, DUMP_FAILED
+        int64_t orders;
+        int64_t ordersdone;                 // Copied from the shared progress once the child has finished
+        DUMP_PROGRESS * progress;
+    } DUMP;
+
+    typedef struct DumpFile_struct {        // Buffered writing for the child, which mustn't malloc() or use stdio
+        int fd;
+        int failed;
+        size_t len;
+        uint32_t checksum;                  // Of everything through dump_write() (snapshots use this)
+        char data[DUMPBUFFERSIZE];
+    } DUMPFILE;
+
+    typedef struct JournalHeader_struct {   // Start of every journal file
+        char magic[8];                      // JOURNAL_MAGIC
+        char venue[SMALLSTRING];
+        char symbol[SMALLSTRING];
+        char starttime[SMALLSTRING];
+        int64_t firstrecord;                // Records before this one were dropped once a snapshot had them
+    } JOURNAL_HEADER;
+
+    typedef struct JournalRecord_struct {   // One ORDER or CANCEL, in native byte order. An ORDER that
+        int64_t clocksecond;                // creates an account is followed by namelen bytes of name.
+        int32_t clockmicro;                 // The clock as the command started (see new_timestamp())
+        int32_t type;                       // JOURNAL_ORDER or JOURNAL_CANCEL
+        int32_t id;                         // Account id for an ORDER, order id for a CANCEL
+        int32_t qty;
+        int32_t price;
+        int32_t direction;
+        int32_t orderType;
+        int32_t namelen;
+    } JOURNAL_RECORD;
+
+    // A snapshot is the header, then the accounts, every fill, every order (with the ids of its fills),
+    // then each side of the book: a count of levels, and for each level its price, the number of orders
+    // and their ids in time priority. Then SNAPSHOT_END, and a checksum of everything before it
+    // (see checksum_bytes()). All in native byte order.
+
+    typedef struct SnapshotHeader_struct {
+        char magic[8];                      // SNAPSHOT_MAGIC
+        char venue[SMALLSTRING];
+        char symbol[SMALLSTRING];
+        char starttime[SMALLSTRING];
+        int64_t commands;                   // Journal records that the snapshot covers
+        int32_t nextid;
+        int32_t accounts;
+        int32_t orders;
+        int32_t fills;
+        QUOTE quote;
+        DEBUG_INFO debuginfo;
+    } SNAPSHOT_HEADER;
+
+    typedef struct SnapshotAccount_struct {
+        int32_t id;
+        int32_t posmin;
+        int32_t posmax;
+        int32_t shares;
+        int32_t cents;
+        char name[SMALLSTRING];
+    } SNAPSHOT_ACCOUNT;
+
+    typedef struct SnapshotFill_struct {    // Followed by tslen bytes of timestamp
+        int32_t id;
+        int32_t price;
+        int32_t qty;
+        int32_t tslen;
+    } SNAPSHOT_FILL;
+
+    typedef struct SnapshotOrder_struct {   // Followed by tslen bytes of timestamp, then fillcount fill ids
+        int32_t id;
+        int32_t account;
+        int32_t direction;
+        int32_t originalQty;
+        int32_t qty;
+        int32_t price;
+        int32_t orderType;
+        int32_t totalFilled;
+        int32_t open;
+        int32_t fillcount;
+        int32_t tslen;
+    } SNAPSHOT_ORDER;
+
+    typedef struct FileReader_struct {      // Buffered reading of journals and snapshots
+        int fd;
+        char * buf;
+        size_t start;
+        size_t end;
+        int eof;                    // 1 at the end of the file, -1 after a read error
+        uint32_t checksum;          // Of everything read so far
+    } FILEREADER;
+
+    typedef struct AccountMap_struct {      // While a book is loaded: how its stored account ints map to the frontend's
+        int present;                // 0 if there's no accounts file, when the stored ints are used as they are
+        char (* names)[SMALLSTRING];        // The frontend's accounts, by int
+        int count;
+        int * remap;                // Indexed by stored int: the int it has now, or -1
+        int changed;                // Set if any account moved
+    } ACCOUNTMAP;
+#endif
 
-LEVEL * FirstBidLevel = NULL;
-LEVEL * FirstAskLevel = NULL;
+typedef struct Book_struct {        // Everything about a single book. One backend can host many books.
+    char venue[SMALLSTRING];
+    char symbol[SMALLSTRING];
+    char * starttime;
+
+    struct Level_struct * firstbidlevel;
+    struct Level_struct * firstasklevel;
+
+    struct Order_struct ** allorders;
+    int currentorderarraylen;
+    int highestknownorder;
+    int nextid;
+
+    struct Account_struct ** allaccounts;   // The array of all accounts gets realloc'd as needed,
+    int currentaccountarraylen;             // but it should probably simply have a fixed size.
+
+    QUOTE quote;
+
+    DEBUG_INFO debuginfo;
+    MEMORY_INFO memory;
+    STATS stats;
+
+    int tickerintervalms;                   // Ticker conflation settings; both 0 means a ticker
+    int tickereveryn;                       // is sent after every change to the book.
+    int tickerdirty;
+    int commandssinceticker;
+    int64_t lasttickerms;
+
+    int version;                            // Goes up whenever the book itself changes
+    BOOK_SNAPSHOT * snapshot;               // Latest binary orderbook, made when someone asks for it
+
+    #if !defined(_WIN32)
+        struct Dump_struct * dumps;         // Every DUMP ever started on this book
+        int dumpcount;
+
+        int journalfd;                      // -1 unless journaling (see -journal)
+        OUTBUF journal;                     // Records not yet written to it
+        int journalreplayed;                // Commands replayed from it at startup
+        int journalnames;                   // Name the account in every ORDER record (see open_journal())
+        int64_t journalseq;                 // Records ever journaled, counting any dropped after a snapshot
+        int64_t journalbytes;               // Size of the journal, counting records not yet written
+
+        pid_t snapshotpid;                  // Child writing a snapshot, if there is one running
+        int snapshotstate;                  // DUMP_RUNNING, DUMP_DONE or DUMP_FAILED; -1 before the first
+        int64_t snapshotseq;                // Journal records covered by the latest snapshot on disk
+        int64_t snapshotstartseq;           // ...and by the one most recently started
+        int64_t snapshotoffset;             // Where that one's records end in the journal
+        int64_t lastsnapshotcheckms;
+
+        int archivefd;                      // -1 until something is archived (see -archive); -2 if that failed
+        char ** archivesegments;            // Where each piece of the archive is mapped
+        int archivesegmentcount;
+        int64_t archivebytes;               // Used so far, counting the unused end of each full segment
+        int64_t * archived;                 // Indexed by order id: 1 + where the order is in the archive, or 0
+        int archivedlen;
+        int archivedcount;
+        int archivecursor;                  // Every order below this is archived, or listed in stillopen
+        int * stillopen;                    // Old orders that were still open when last looked at
+        int stillopencount;
+        int stillopencap;
+        struct Order_struct ** retired;     // Archived orders that the output thread may still be formatting;
+        int retiredcount;                   // they are freed once it has got as far as retiredtail
+        int retiredcap;
+        size_t retiredtail;
+    #endif
 
-ORDER ** AllOrders = NULL;
-int CurrentOrderArrayLen = 0;
-int HighestKnownOrder = -1;
+    int replaying;                          // Set while rebuilding the book from its journal; no output
 
-ACCOUNT ** AllAccounts = NULL;      // The array of all accounts gets realloc'd as needed,
-int CurrentAccountArrayLen = 0;     // but it should probably simply have a fixed size.
+    int64_t clocksecond;                    // The book's clock (see new_timestamp()); -1 until first used
+    int clockmicro;
+    int clockpinned;
 
-QUOTE Quote = {0, 0, 0, 0, -1, -1, -1, -1, "", ""};
+    struct Worker_struct * worker;          // The thread that owns the book. Only it ever touches the book.
+} BOOK;
 
-DEBUG_INFO DebugInfo = {0};         // Think global is auto-zeroed anyway, but whatever
+typedef struct Worker_struct {      // Without -workers, there is just one of these (the main thread)
+    int index;
 
+    OUTBUF out;                     // Responses (for stdout) and WebSocket messages (for stderr) are
+    OUTBUF events;                  // built up here, then written out once each command is done.
 
-// ------------------------------------------------------------------------------------------
+    struct Book_struct ** books;    // The books this worker owns
+    int bookcount;
 
+    int dirtybooks;                 // Number of its books with a conflated ticker waiting to go out
+    int64_t lasttickersweepms;
 
-void end_message (FILE * outfile)
-{
-    fprintf(outfile, "\nEND\n");
-    fflush(outfile);
-    return;
-}
+    int stattype;                   // Type of the command just handled (STATS_ORDER etc)
 
+    int traced;                     // Set if the command being handled asked to be traced
+    int traceid;
+    int64_t traceparsed;            // When its tokens were ready
+    int64_t traceformatns;          // Output thread only: time spent formatting its records so far
 
-void check_ptr_or_quit (void * ptr)
-{
-    if (ptr == NULL)
-    {
-        printf("{\"ok\": false, \"error\": \"Out of memory! Quitting\"}");
-        end_message(stdout);
-        assert(ptr);
-    }
-    return;
-}
+    int dirtyjournals;              // Number of its books with journal records not yet written
+    int64_t lastjournalsyncms;
 
+    #if !defined(_WIN32)
+        char (* ring)[MAXSTRING];   // Commands from the main thread: single producer, single consumer
+        atomic_size_t head;         // Next slot to read, only written by the worker
+        atomic_size_t tail;         // Next slot to write, only written by the main thread
+        atomic_int sleeping;
+        pthread_t thread;
+        pthread_mutex_t mutex;      // Only used for sleeping / waking, never on the fast path
+        pthread_cond_t cond;
 
-LEVEL * init_level (int price, ORDERNODE * ordernode, LEVEL * prev, LEVEL * next)
-{
-    LEVEL * ret;
+        OUTRECORD * outring;        // Records for the output thread: single producer, single consumer
+        atomic_size_t outhead;      // Only written by the output thread
+        atomic_size_t outtail;      // Only written by the worker
+    #endif
+} WORKER;
+
+#if !defined(_WIN32)
+    typedef struct ShmRing_struct {     // One direction of the shared memory transport (see -shm)
+        _Atomic uint64_t * tail;        // Bytes ever written, only written by the producer
+        _Atomic uint64_t * head;        // Bytes ever read, only written by the consumer
+        _Atomic uint32_t * sleeping;    // Set by the consumer before it blocks on the doorbell
+        char * data;
+        int doorbell;                   // Pipe: we read it if we consume, write it if we produce
+    } SHMRING;
+#endif
 
-    DebugInfo.inits_of_level++;
 
-    ret = malloc(sizeof(LEVEL));
-    check_ptr_or_quit(ret);
+// ---------------------------------- GLOBALS -----------------------------------------------
 
-    ret->price = price;
-    ret->firstordernode = ordernode;
-    ret->prev = prev;
-    ret->next = next;
 
-    return ret;
-}
+BOOK * AllBooks[MAXBOOKS];          // Indexed by book id, which the frontend chooses. Like account ids,
+                                    // these should be low, non-negative integers. Fixed size so that it
+                                    // never moves under the worker threads; each slot has one owner.
 
+char * MemoryTypeNames[MEM_TYPES] = {"book", "orders", "ordernodes", "levels", "fills", "fillnodes", "accounts", "timestamps", "directories"};
 
-FILL * init_fill (int price, int qty, char * ts)
-{
-    FILL * ret;
+WORKER * Workers = NULL;
+int WorkerCount = 1;                // Book n is owned by worker n % WorkerCount
 
-    DebugInfo.inits_of_fill++;
+#if !defined(_WIN32)
+    pthread_mutex_t OutputMutex = PTHREAD_MUTEX_INITIALIZER;   // Workers take turns writing whole messages
 
-    ret = malloc(sizeof(FILL));
-    check_ptr_or_quit(ret);
+    int OutputThread = 0;           // If set, workers never write anything themselves (see output_main())
+    pthread_t OutputThreadId;
+    pthread_t MainThreadId;         // Only for pin_threads()
+    pthread_mutex_t OutputWakeMutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t OutputWakeCond = PTHREAD_COND_INITIALIZER;
+    atomic_int OutputSleeping;
+    atomic_int OutputStop;
+    OUTBUF OutputResponses;         // The output thread's own buffers
+    OUTBUF OutputEvents;
+#endif
 
-    ret->price = price;
-    ret->qty = qty;
-    ret->ts = ts;
+#if !defined(_WIN32)
+    int ShmMode = 0;                // With -shm, the three rings below replace stdin, stdout and stderr
+    SHMRING CommandRing;
+    SHMRING ResponseRing;
+    SHMRING EventRing;
+#endif
 
-    return ret;
-}
+#if !defined(_WIN32)
+    char * JournalDir = NULL;       // With -journal, every book's ORDERs and CANCELs are journaled here
+    int64_t SnapshotEvery = 0;      // With -snapshotevery N, a book snapshots itself every N journal records
+    int ArchiveAfter = 0;           // With -archive N, closed orders at least N orders old are archived
+#endif
 
+int64_t VirtualClock = 0;           // With -virtualclock, where each book's clock starts (Unix seconds); 0 = real time
+int ClockStep = 0;                  // With -clockstep, microseconds added before each command
 
-FILLNODE * init_fillnode (FILL * fill, FILLNODE * prev, FILLNODE * next)
-{
-    FILLNODE * ret;
+char InputBuffer[INPUTBUFFERSIZE];  // Our own buffering of stdin, so we can tell whether
+size_t InputStart = 0;              // another command is already waiting for us.
+size_t InputEnd = 0;
 
-    DebugInfo.inits_of_fillnode++;
 
-    ret = malloc(sizeof(FILLNODE));
-    check_ptr_or_quit(ret);
+// ------------------------------------------------------------------------------------------
 
-    ret->fill = fill;
-    ret->prev = prev;
-    ret->next = next;
 
-    return ret;
+void check_ptr_or_quit (void * ptr)
+{
+    if (ptr == NULL)
+    {
+        printf("{\"ok\": false, \"error\": \"Out of memory! Quitting\"}\nEND\n");
+        fflush(stdout);
+        assert(ptr);
+    }
+    return;
 }
 
 
-ORDERNODE * init_ordernode (ORDER * order, ORDERNODE * prev, ORDERNODE * next)
+void out_reserve (OUTBUF * out, size_t n)      // Make sure there is room for n more bytes
 {
-    ORDERNODE * ret;
-
-    DebugInfo.inits_of_ordernode++;
-
-    ret = malloc(sizeof(ORDERNODE));
-    check_ptr_or_quit(ret);
+    while (out->len + n + 1 > out->cap)
+    {
+        out->cap = out->cap ? out->cap * 2 : 4096;
+        out->data = realloc(out->data, out->cap);
+        check_ptr_or_quit(out->data);
+    }
+    return;
+}
 
-    ret->order = order;
-    ret->prev = prev;
-    ret->next = next;
 
-    return ret;
+void out_write (OUTBUF * out, const void * data, size_t n)
+{
+    out_reserve(out, n);
+    memcpy(out->data + out->len, data, n);
+    out->len += n;
+    return;
 }
 
 
-int next_id (int no_iterate_flag)
+void out_printf (OUTBUF * out, const char * format, ...)
 {
-    static int id = 0;
+    va_list args;
+    int n;
 
-    if (id == MAXORDERS)         // Stop iterating
+    out_reserve(out, SMALLSTRING);
+
+    while (1)
     {
-        return MAXORDERS;
-    } else {
-        if (no_iterate_flag)
+        va_start(args, format);
+        n = vsnprintf(out->data + out->len, out->cap - out->len, format, args);
+        va_end(args);
+
+        assert(n >= 0);
+
+        if ((size_t) n < out->cap - out->len)
         {
-            return id;
-        } else {
-            return id++;
+            out->len += n;
+            return;
         }
+        out_reserve(out, n);        // Didn't fit; now it will
     }
 }
 
 
-// Various safer strcpy functions exist. I thought of dumping strlcpy() into the file but this
-// creature of my own devising does the same thing, minus the return value (which I don't need).
-
-void safe_strcpy (char * dest, char * source, size_t size)
+void end_message (OUTBUF * out)
 {
-    size_t n;
-
-    if (size == 0) return;              // size_t is unsigned, 0 is lowest possible
-    for (n = 0; n < size - 1; n++)
-    {
-        dest[n] = source[n];
-        if (dest[n] == '\0') return;    // Copied whole string
-    }
-    dest[size - 1] = '\0';              // Truncated (or copied all if size was exactly right)
+    out_printf(out, "\nEND\n");
     return;
 }
 
 
-char * new_timestamp (void)
+// Shared memory transport. The frontend maps one file holding three rings (commands to us,
+// responses and WebSocket messages from us) and passes it to us as fd 3, along with a doorbell
+// pipe for each ring as fds 4, 5 and 6. Each ring has a single producer and single consumer, and
+// carries exactly the same bytes the pipe would have. While there is traffic, neither side makes
+// any syscalls at all; a consumer only sleeps on its doorbell after busy-polling for a while, and
+// the producer only rings it (one byte) if it sees the consumer's sleeping flag.
+
+#if !defined(_WIN32)
+
+void init_shm_ring (SHMRING * ring, char * base, int doorbell)
 {
-    char * timestamp;
-    time_t t;
-    struct tm * ti;
-    static struct tm last_time = {0};
-    static int fake_micro = 0;
+    ring->tail = (_Atomic uint64_t *) (base + SHM_TAIL);
+    ring->head = (_Atomic uint64_t *) (base + SHM_HEAD);
+    ring->sleeping = (_Atomic uint32_t *) (base + SHM_SLEEPING);
+    ring->data = base + SHM_HEADER_SIZE;
+    ring->doorbell = doorbell;
+    return;
+}
 
-    timestamp = malloc(SMALLSTRING);
-    check_ptr_or_quit(timestamp);
 
-    t = time(NULL);
+void init_shm (void)
+{
+    char * base;
+    size_t ringbytes = SHM_HEADER_SIZE + SHM_RING_SIZE;
 
-    if (t != (time_t) -1)
+    base = mmap(NULL, 3 * ringbytes, PROT_READ | PROT_WRITE, MAP_SHARED, 3, 0);
+    if (base == MAP_FAILED)
     {
-        ti = gmtime(&t);
-    } else {
-        ti = NULL;
+        printf("{\"ok\": false, \"error\": \"Couldn't map shared memory. Quitting\"}\nEND\n");
+        fflush(stdout);
+        exit(1);
     }
 
-    if (ti)
-    {
-        // We fake microseconds by using the number of times the
-        // function has been called this second as "microseconds",
-        // so first check if second has rolled over...
-        if (last_time.tm_year == ti->tm_year &&
-            last_time.tm_mon  == ti->tm_mon  &&
-            last_time.tm_mday == ti->tm_mday &&
-            last_time.tm_hour == ti->tm_hour &&
-            last_time.tm_min  == ti->tm_min  &&
-            last_time.tm_sec  == ti->tm_sec)
-        {
-            fake_micro += 1;
-        } else {
-            fake_micro = 0;
-            last_time = *ti;
-        }
-        snprintf(timestamp, SMALLSTRING, "%d-%02d-%02dT%02d:%02d:%02d.%06dZ",
-                 ti->tm_year + 1900, ti->tm_mon + 1, ti->tm_mday, ti->tm_hour, ti->tm_min, ti->tm_sec, fake_micro);
-    } else {
-        snprintf(timestamp, SMALLSTRING, "Unknown");
-    }
+    init_shm_ring(&CommandRing, base, 4);
+    init_shm_ring(&ResponseRing, base + ringbytes, 5);
+    init_shm_ring(&EventRing, base + 2 * ringbytes, 6);
 
-    return timestamp;
+    ShmMode = 1;
+    return;
 }
 
 
-ORDER * init_order (ACCOUNT * account, int qty, int price, int direction, int orderType, int id)
+int shm_readable (SHMRING * ring)
 {
-    ORDER * ret;
-    int n;
+    return atomic_load_explicit(ring->tail, memory_order_acquire) != atomic_load_explicit(ring->head, memory_order_relaxed);
+}
 
-    DebugInfo.inits_of_order++;
 
-    ret = malloc(sizeof(ORDER));
-    check_ptr_or_quit(ret);
+int shm_wait (SHMRING * ring, int timeout_ms)     // 1 = data waiting, 0 = timed out, -1 = frontend has gone
+{
+    struct pollfd pfd;
+    char junk[64];
+    ssize_t got;
+    int n;
 
-    ret->direction = direction;
-    ret->originalQty = qty;
-    ret->qty = qty;
-    ret->price = price;
-    ret->orderType = orderType;
-    ret->id = id;
-    ret->account = account;
-    ret->ts = new_timestamp();
-    ret->firstfillnode = NULL;
-    ret->totalFilled = 0;
-    ret->open = 1;
+    for (n = 0; n < SHM_SPINS; n++)
+    {
+        if (shm_readable(ring)) return 1;
+    }
 
-    // Now deal with the global order storage...
+    atomic_store(ring->sleeping, 1);
 
-    while (id >= CurrentOrderArrayLen)
+    // Checked after setting the flag, so that a producer which missed the flag must
+    // have published its data before we looked. (A stale doorbell byte just means
+    // a spurious wakeup later.)
+
+    while (shm_readable(ring) == 0)
     {
-        AllOrders = realloc(AllOrders, (CurrentOrderArrayLen + 8192) * sizeof(ORDER *));
-        check_ptr_or_quit(AllOrders);
-        CurrentOrderArrayLen += 8192;
+        pfd.fd = ring->doorbell;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
 
-        // NULLify the new pointers in case gaps open up somehow - we can
-        // verify the order ID doesn't exist... (should be impossible at
-        // time of writing but it's good practice).
+        if (poll(&pfd, 1, timeout_ms) == 0) break;         // Timed out
 
-        for (n = CurrentOrderArrayLen - 8192; n < CurrentOrderArrayLen; n++)
+        got = read(ring->doorbell, junk, sizeof(junk));
+        if (got == 0)
         {
-            AllOrders[n] = NULL;
+            atomic_store(ring->sleeping, 0);
+            return -1;
         }
-
-        DebugInfo.reallocs_of_global_order_list++;
+        if (timeout_ms >= 0) break;
     }
-    AllOrders[id] = ret;
-    HighestKnownOrder = id;
 
-    return ret;
+    atomic_store(ring->sleeping, 0);
+    return shm_readable(ring);
 }
 
 
-ORDER_AND_ERROR * init_o_and_e (void)
+ssize_t shm_read (SHMRING * ring, char * dest, size_t size)     // Like read(); 0 means EOF
 {
-    ORDER_AND_ERROR * ret;
+    uint64_t head;
+    uint64_t avail;
+    size_t offset;
+    size_t n;
 
-    ret = malloc(sizeof(ORDER_AND_ERROR));
-    check_ptr_or_quit(ret);
+    while (shm_readable(ring) == 0)
+    {
+        if (shm_wait(ring, -1) < 0) return 0;
+    }
 
-    ret->order = NULL;
-    ret->error = 0;
+    head = atomic_load_explicit(ring->head, memory_order_relaxed);
+    avail = atomic_load_explicit(ring->tail, memory_order_acquire) - head;
+    offset = head & (SHM_RING_SIZE - 1);
 
-    return ret;
+    n = size;
+    if (n > avail) n = avail;
+    if (n > SHM_RING_SIZE - offset) n = SHM_RING_SIZE - offset;     // Rest will come next time
+
+    memcpy(dest, ring->data + offset, n);
+    atomic_store_explicit(ring->head, head + n, memory_order_release);
+    return (ssize_t) n;
 }
 
 
-void update_account (ACCOUNT * account, int quantity, int price, int direction)
+int shm_consumer_gone (SHMRING * ring)      // Producer only: has the frontend closed its end of our doorbell?
 {
-    // Elsewhere we rather rely on shares and cents being int32,
-    // so don't change that now. If people exceed the bounds,
-    // their extra shares and money is "lost". Fine.
+    struct pollfd pfd;
 
-    int64_t tmp64;
+    pfd.fd = ring->doorbell;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
 
-    assert(account);
+    if (poll(&pfd, 1, 0) < 0) return 0;
+    return (pfd.revents & (POLLERR | POLLHUP)) != 0;
+}
 
-    // Update shares...
 
-    tmp64 = account->shares;
+void shm_write (SHMRING * ring, const char * src, size_t len)
+{
+    struct timespec pause = {0, 50000};
+    uint64_t tail;
+    uint64_t space;
+    size_t offset;
+    size_t n;
 
-    if (direction == BUY)
+    tail = atomic_load_explicit(ring->tail, memory_order_relaxed);
+
+    while (len > 0)
     {
-        tmp64 += quantity;
-        if (tmp64 > 2147483647)
+        space = SHM_RING_SIZE - (tail - atomic_load_explicit(ring->head, memory_order_acquire));
+        if (space == 0)
         {
-            account->shares = 2147483647;
-        } else {
-            account->shares = (int) tmp64;
+            if (shm_consumer_gone(ring)) exit(1);     // Where a pipe would have given us EPIPE
+            nanosleep(&pause, NULL);    // Frontend is behind; same as a full pipe, really
+            continue;
         }
-    } else {
-        tmp64 -= quantity;
-        if (tmp64 < -2147483647)
+
+        offset = tail & (SHM_RING_SIZE - 1);
+        n = len;
+        if (n > space) n = space;
+        if (n > SHM_RING_SIZE - offset) n = SHM_RING_SIZE - offset;
+
+        memcpy(ring->data + offset, src, n);
+        tail += n;
+        atomic_store(ring->tail, tail);             // seq_cst, paired with the sleeping flag
+
+        if (atomic_exchange(ring->sleeping, 0))
         {
-            account->shares = -2147483647;
-        } else {
-            account->shares = (int) tmp64;
+            if (write(ring->doorbell, "!", 1) < 0) exit(1);     // Frontend has gone
         }
+
+        src += n;
+        len -= n;
     }
+    return;
+}
 
-    // Update cents...
+#endif
 
-    tmp64 = account->cents;
 
-    if (direction == BUY)
-    {
-        tmp64 -= (int64_t) price * (int64_t) quantity;
-        if (tmp64 < -2147483647)
-        {
-            account->cents = -2147483647;
-        } else {
-            account->cents = (int) tmp64;
-        }
-    } else {
-        tmp64 += (int64_t) price * (int64_t) quantity;
-        if (tmp64 > 2147483647)
+void write_outbuf (OUTBUF * out, FILE * outfile)
+{
+    if (out->len == 0) return;
+
+    fwrite(out->data, 1, out->len, outfile);
+    fflush(outfile);
+    out->len = 0;
+    return;
+}
+
+
+void write_output (OUTBUF * events, OUTBUF * responses)       // Actually send things to the frontend
+{
+    #if defined(_WIN32)
+        write_outbuf(events, stderr);
+        write_outbuf(responses, stdout);
+    #else
+        if (ShmMode)
         {
-            account->cents = 2147483647;
+            shm_write(&EventRing, events->data, events->len);
+            shm_write(&ResponseRing, responses->data, responses->len);
+            events->len = 0;
+            responses->len = 0;
         } else {
-            account->cents = (int) tmp64;
+            write_outbuf(events, stderr);
+            write_outbuf(responses, stdout);
         }
-    }
-
-    if (account->shares < account->posmin) account->posmin = account->shares;
-    if (account->shares > account->posmax) account->posmax = account->shares;
+    #endif
 
     return;
 }
 
 
-int64_t get_size_from_level (LEVEL * level)
+// With the output thread running, each worker passes it records through a ring buffer. To add
+// a record, fill in the slot from next_out_record(), then call publish_out_record().
+
+#if !defined(_WIN32)
+
+OUTRECORD * next_out_record (WORKER * worker)
 {
-    ORDERNODE * ordernode;
-    int64_t ret;
+    size_t tail;
 
-    if (level == NULL)
+    tail = atomic_load_explicit(&worker->outtail, memory_order_relaxed);
+
+    while (tail - atomic_load_explicit(&worker->outhead, memory_order_acquire) >= OUTRINGSIZE)
     {
-        return 0;
+        sched_yield();                  // Ring is full; the output thread (or the frontend) is behind
     }
 
-    ret = 0;
+    return &worker->outring[tail & (OUTRINGSIZE - 1)];
+}
 
-    for (ordernode = level->firstordernode; ordernode != NULL; ordernode = ordernode->next)
+
+void publish_out_record (WORKER * worker)
+{
+    size_t tail;
+
+    tail = atomic_load_explicit(&worker->outtail, memory_order_relaxed);
+    worker->outring[tail & (OUTRINGSIZE - 1)].traced = worker->traced;
+    atomic_store(&worker->outtail, tail + 1);
+
+    if (atomic_load(&OutputSleeping))
     {
-        ret += ordernode->order->qty;
+        pthread_mutex_lock(&OutputWakeMutex);
+        pthread_cond_signal(&OutputWakeCond);
+        pthread_mutex_unlock(&OutputWakeMutex);
     }
-    return ret;
+    return;
 }
 
 
-int64_t get_depth (LEVEL * level)        // Returns size of this level and all worse levels (if level exists)
+void take_outbuf (OUTBUF * dest, OUTBUF * src)      // Moves the contents (no copying), leaving src empty
 {
-    int64_t onesize;
-    int64_t ret;
+    *dest = *src;
+    src->data = NULL;
+    src->len = 0;
+    src->cap = 0;
+    return;
+}
 
-    ret = 0;
 
-    for ( ; level != NULL; level = level->next)
-    {
-        ret += get_size_from_level(level);
-    }
-    return ret;
+void publish_blob (WORKER * worker, int type, OUTBUF * buf)     // Hands the buffer's contents over to the output thread
+{
+    OUTRECORD * record;
+
+    record = next_out_record(worker);
+    record->type = type;
+    take_outbuf(&record->blob, buf);
+    publish_out_record(worker);
+    return;
 }
 
+#endif
+
 
-void print_quote (FILE * outfile)       // Just hard-codes the indent, meaning executions messages look odd. Meh.
+void emit_output (WORKER * worker)     // Send whatever the worker has built up to the frontend
 {
-    char buildup[MAXSTRING];
-    char part[MAXSTRING];
+    if (worker->out.len == 0 && worker->events.len == 0) return;
 
-    // Add all the fields that are always present...
-    snprintf(buildup, MAXSTRING, "{\n  \"ok\": true,\n  \"symbol\": \"%s\",\n  \"venue\": \"%s\",\n  \"bidSize\": %" PRId64 ",\n"
-                                 "  \"askSize\": %" PRId64 ",\n  \"bidDepth\": %" PRId64 ",\n  \"askDepth\": %" PRId64 ",\n  \"quoteTime\": \"%s\"",
-             Symbol, Venue, Quote.bidSize, Quote.askSize, Quote.bidDepth, Quote.askDepth, Quote.quoteTime);
+    #if !defined(_WIN32)
+        if (OutputThread)
+        {
+            if (worker->events.len > 0) publish_blob(worker, OUT_EVENT_BLOB, &worker->events);
+            if (worker->out.len > 0) publish_blob(worker, OUT_RESPONSE_BLOB, &worker->out);
+            return;
+        }
 
-    if (Quote.bid >= 0)         // -1 used as a null value
-    {
-        snprintf(part, MAXSTRING, ",\n  \"bid\": %d", Quote.bid);
-        strncat(buildup, part, MAXSTRING - strlen(buildup) - 1);
-    }
+        if (WorkerCount > 1) pthread_mutex_lock(&OutputMutex);
+    #endif
 
-    if (Quote.ask >= 0)         // -1 used as a null value
-    {
-        snprintf(part, MAXSTRING, ",\n  \"ask\": %d", Quote.ask);
-        strncat(buildup, part, MAXSTRING - strlen(buildup) - 1);
-    }
+    write_output(&worker->events, &worker->out);
 
-    if (Quote.lastTrade[0])     // i.e. check the timestamp of the last trade is a non-empty string
-    {
-        snprintf(part, MAXSTRING, ",\n  \"lastTrade\": \"%s\",\n  \"lastSize\": %d,\n  \"last\": %d", Quote.lastTrade, Quote.lastSize, Quote.last);
-        strncat(buildup, part, MAXSTRING - strlen(buildup) - 1);
-    }
+    #if !defined(_WIN32)
+        if (WorkerCount > 1) pthread_mutex_unlock(&OutputMutex);
+    #endif
 
-    strncat(buildup, "\n}", MAXSTRING - strlen(buildup) - 1);
+    return;
+}
+
+
+
+// Each book counts what it has on the heap (by bytes asked for, not what malloc() really uses), and
+// the most it has ever had. Only things the book keeps are counted, not short-lived buffers.
 
-    fprintf(outfile, "%s", buildup);
+void count_memory (BOOK * book, int type, int64_t objects, int64_t bytes)     // Negative when freeing
+{
+    MEMORY_INFO * memory = &book->memory;
+
+    memory->objects[type] += objects;
+    memory->bytes[type] += bytes;
+    memory->totalbytes += bytes;
 
+    if (memory->objects[type] > memory->peakobjects[type]) memory->peakobjects[type] = memory->objects[type];
+    if (memory->bytes[type] > memory->peakbytes[type]) memory->peakbytes[type] = memory->bytes[type];
+    if (memory->totalbytes > memory->peaktotalbytes) memory->peaktotalbytes = memory->totalbytes;
     return;
 }
 
 
-void print_fills (FILE * outfile, ORDER * order, char * indent1, char * indent2)
+LEVEL * init_level (BOOK * book, int price, ORDERNODE * ordernode, LEVEL * prev, LEVEL * next)
 {
-    FILLNODE * fillnode;
+    LEVEL * ret;
 
-    if (order->firstfillnode == NULL)   // Can do without this block but it's uglier
-    {
-        fprintf(outfile, "%s\"fills\": []", indent1);
-        return;
-    }
+    book->debuginfo.inits_of_level++;
+    count_memory(book, MEM_LEVELS, 1, sizeof(LEVEL));
+
+    ret = malloc(sizeof(LEVEL));
+    check_ptr_or_quit(ret);
+
+    ret->price = price;
+    ret->firstordernode = ordernode;
+    ret->prev = prev;
+    ret->next = next;
+    ret->bytes = NULL;
 
-    fprintf(outfile, "%s\"fills\": [\n", indent1);
+    return ret;
+}
 
-    fillnode = order->firstfillnode;
 
-    while (fillnode != NULL)
-    {
-        if (fillnode != order->firstfillnode) fprintf(outfile, ",\n");
-        fprintf(outfile, "%s{\"price\": %d, \"qty\": %d, \"ts\": \"%s\"}", indent2, fillnode->fill->price, fillnode->fill->qty, fillnode->fill->ts);
-        fillnode = fillnode->next;
-    }
+void release_level_bytes (LEVEL_BYTES * levelbytes)
+{
+    #if defined(_WIN32)
+        levelbytes->refs--;
+        if (levelbytes->refs > 0) return;
+    #else
+        if (atomic_fetch_sub(&levelbytes->refs, 1) > 1) return;
+    #endif
 
-    fprintf(outfile, "\n%s]", indent1);
+    free(levelbytes);
     return;
 }
 
 
-void print_order (FILE * outfile, ORDER * order)
+void level_changed (LEVEL * level)             // Called whenever a level's orders (or their qtys) change
 {
-    char orderType_to_print[SMALLSTRING];
-
-    if (order->orderType == LIMIT)
+    if (level->bytes != NULL)
     {
-        safe_strcpy(orderType_to_print, "limit", SMALLSTRING);
-    } else if (order->orderType == MARKET) {
-        safe_strcpy(orderType_to_print, "market", SMALLSTRING);
-    } else if (order->orderType == IOC) {
-        safe_strcpy(orderType_to_print, "immediate-or-cancel", SMALLSTRING);
-    } else if (order->orderType == FOK) {
-        safe_strcpy(orderType_to_print, "fill-or-kill", SMALLSTRING);
-    } else {
-        safe_strcpy(orderType_to_print, "unknown", SMALLSTRING);
+        release_level_bytes(level->bytes);
+        level->bytes = NULL;
     }
+    return;
+}
 
-    fprintf(outfile,
 
-            "{\n  \"ok\": true,\n  \"venue\": \"%s\",\n  \"symbol\": \"%s\",\n  \"direction\": \"%s\",\n  \"originalQty\": %d,\n  \"qty\": %d,"
-            "\n  \"price\": %d,\n  \"orderType\": \"%s\",\n  \"id\": %d,\n  \"account\": \"%s\",\n  \"ts\": \"%s\",\n  \"totalFilled\": %d,\n  \"open\": %s,\n",
+FILL * init_fill (BOOK * book, int price, int qty, char * ts)
+{
+    FILL * ret;
 
-            Venue, Symbol, order->direction == BUY ? "buy" : "sell", order->originalQty, order->qty,
-            order->price, orderType_to_print, order->id, order->account->name, order->ts, order->totalFilled, order->open ? "true" : "false");
+    ret = malloc(sizeof(FILL));
+    check_ptr_or_quit(ret);
 
-    print_fills(outfile, order, INDENT_2, INDENT_4);
-    fprintf(outfile, "\n}");
+    ret->price = price;
+    ret->qty = qty;
+    ret->ts = ts;
+    ret->id = book->debuginfo.inits_of_fill;
+    ret->refs = 0;
 
-    return;
+    book->debuginfo.inits_of_fill++;
+    count_memory(book, MEM_FILLS, 1, sizeof(FILL));
+    count_memory(book, MEM_TIMESTAMPS, 1, SMALLSTRING);     // The fill owns its timestamp
+
+    return ret;
 }
 
 
-void create_ticker_message (void)
+FILLNODE * init_fillnode (BOOK * book, FILL * fill, FILLNODE * prev, FILLNODE * next)
 {
-    fprintf(stderr, "TICKER %s %s %s\n", "NONE", Venue, Symbol);
+    FILLNODE * ret;
 
-    fprintf(stderr, "{\"ok\": true, \"quote\": ");
-    print_quote(stderr);
-    fprintf(stderr, "}");
+    book->debuginfo.inits_of_fillnode++;
+    count_memory(book, MEM_FILLNODES, 1, sizeof(FILLNODE));
 
-    end_message(stderr);
-    return;
+    ret = malloc(sizeof(FILLNODE));
+    check_ptr_or_quit(ret);
+
+    ret->fill = fill;
+    ret->prev = prev;
+    ret->next = next;
+
+    fill->refs++;
+
+    return ret;
 }
 
 
-void create_execution_messages(ORDER * standing, ORDER * incoming, int quantity, int price, char * ts)
+ORDERNODE * init_ordernode (BOOK * book, ORDER * order, ORDERNODE * prev, ORDERNODE * next)
 {
-    fprintf(stderr, "EXECUTION %s %s %s\n", standing->account->name, Venue, Symbol);
-    fprintf(stderr, EXECUTION_TEMPLATE_1, standing->account->name, Venue, Symbol);
-    print_order(stderr, standing);
-    fprintf(stderr, EXECUTION_TEMPLATE_2, standing->id, incoming->id, price, quantity, ts,
-            standing->open ? "false" : "true", incoming->open ? "false" : "true");
+    ORDERNODE * ret;
 
-    end_message(stderr);
+    book->debuginfo.inits_of_ordernode++;
+    count_memory(book, MEM_ORDERNODES, 1, sizeof(ORDERNODE));
 
-    fprintf(stderr, "EXECUTION %s %s %s\n", incoming->account->name, Venue, Symbol);
-    fprintf(stderr, EXECUTION_TEMPLATE_1, incoming->account->name, Venue, Symbol);
-    print_order(stderr, incoming);
-    fprintf(stderr, EXECUTION_TEMPLATE_2, standing->id, incoming->id, price, quantity, ts,
-            standing->open ? "false" : "true", incoming->open ? "false" : "true");
+    ret = malloc(sizeof(ORDERNODE));
+    check_ptr_or_quit(ret);
 
-    end_message(stderr);
-    return;
-}
+    ret->order = order;
+    ret->prev = prev;
+    ret->next = next;
 
+    return ret;
+}
 
-// The following function remakes the parts of the quote that are
-// determined by the state of the book itself (i.e. NOT "last trade" info)
 
-void remake_most_of_quote (void)
+int next_id (BOOK * book, int no_iterate_flag)
 {
-    char * ts;
-
-    Quote.bidSize = get_size_from_level(FirstBidLevel);
-    Quote.bidDepth = get_depth(FirstBidLevel);
-    Quote.askSize = get_size_from_level(FirstAskLevel);
-    Quote.askDepth = get_depth(FirstAskLevel);
-
-    if (FirstBidLevel)
+    if (book->nextid == MAXORDERS)      // Stop iterating
     {
-        Quote.bid = FirstBidLevel->price;
+        return MAXORDERS;
     } else {
-        Quote.bid = -1;
+        if (no_iterate_flag)
+        {
+            return book->nextid;
+        } else {
+            return book->nextid++;
+        }
     }
+}
 
-    if (FirstAskLevel)
-    {
-        Quote.ask = FirstAskLevel->price;
-    } else {
-        Quote.ask = -1;
-    }
 
-    ts = new_timestamp();
-    safe_strcpy(Quote.quoteTime, ts, SMALLSTRING);
-    free(ts);
+// Various safer strcpy functions exist. I thought of dumping strlcpy() into the file but this
+// creature of my own devising does the same thing, minus the return value (which I don't need).
 
-    // We can't touch last, lastSize, or lastTrade
-    // as this function is called often even when
-    // no actual fill has happened.
+void safe_strcpy (char * dest, char * source, size_t size)
+{
+    size_t n;
 
+    if (size == 0) return;              // size_t is unsigned, 0 is lowest possible
+    for (n = 0; n < size - 1; n++)
+    {
+        dest[n] = source[n];
+        if (dest[n] == '\0') return;    // Copied whole string
+    }
+    dest[size - 1] = '\0';              // Truncated (or copied all if size was exactly right)
     return;
 }
 
 
-void set_quote_lastinfo (int last, int lastSize)
-{
-    char * ts;
+// Timestamps come from the book's clock: the current second, plus a count of the timestamps
+// already made in that second, which we pass off as microseconds. While a command is being handled
+// the clock is pinned, so the second can't roll over halfway through; that way the journal only
+// needs to record the clock as each command started for replay to reproduce every timestamp.
+// Each book has a clock of its own, so its timestamps don't depend on what other books on the
+// same backend (or worker) are doing.
+//
+// A virtual clock (-virtualclock) is the same, except that the second only changes when the
+// microseconds run out, or when the clock is moved on by -clockstep or a $ token.
 
-    Quote.last = last;
-    Quote.lastSize = lastSize;
+int64_t clock_micros (BOOK * book)      // The time of the latest timestamp, in Unix microseconds
+{
+    return book->clocksecond * 1000000 + book->clockmicro;
+}
 
-    ts = new_timestamp();
-    safe_strcpy(Quote.lastTrade, ts, SMALLSTRING);
-    free(ts);
 
+void clock_set (BOOK * book, int64_t micros)        // So that micros is the time of the latest timestamp
+{
+    book->clocksecond = micros / 1000000;
+    book->clockmicro = (int) (micros % 1000000);
     return;
 }
 
 
-void cross (ORDER * standing, ORDER * incoming)
+void clock_tick (BOOK * book)
 {
-    int quantity;
-    int price;
-    char * ts;
-    FILLNODE * currentfillnode;
-    FILL * fill;
+    time_t t;
 
-    ts = new_timestamp();
+    if (book->clockpinned) return;
 
-    if (standing->qty < incoming->qty)
+    if (VirtualClock > 0)
     {
-        quantity = standing->qty;
-    } else {
-        quantity = incoming->qty;
+        if (book->clocksecond < 0)      // First use
+        {
+            book->clocksecond = VirtualClock;
+            book->clockmicro = -1;
+        }
+        return;
     }
 
-    standing->qty -= quantity;
-    standing->totalFilled += quantity;
-    incoming->qty -= quantity;
-    incoming->totalFilled += quantity;
-
-    price = standing->price;
-
-    fill = init_fill(price, quantity, ts);
-
-    // Figure out where to put the fill...
+    t = time(NULL);
 
-    if (standing->firstfillnode == NULL)
+    if ((int64_t) t != book->clocksecond)
     {
-        standing->firstfillnode = init_fillnode(fill, NULL, NULL);
-    } else {
-        currentfillnode = standing->firstfillnode;
-        while (currentfillnode->next != NULL)
-        {
-            currentfillnode = currentfillnode->next;
-        }
-        currentfillnode->next = init_fillnode(fill, currentfillnode, NULL);
+        book->clocksecond = (int64_t) t;
+        book->clockmicro = -1;          // So the next timestamp is .000000
     }
+    return;
+}
 
-    // Again for other order...
 
-    if (incoming->firstfillnode == NULL)
+void clock_pin (BOOK * book)            // Called before handling each command for the book
+{
+    clock_tick(book);
+    if (VirtualClock > 0 && ClockStep > 0)
     {
-        incoming->firstfillnode = init_fillnode(fill, NULL, NULL);
-    } else {
-        currentfillnode = incoming->firstfillnode;
-        while (currentfillnode->next != NULL)
-        {
-            currentfillnode = currentfillnode->next;
-        }
-        currentfillnode->next = init_fillnode(fill, currentfillnode, NULL);
+        clock_set(book, clock_micros(book) + ClockStep);
     }
+    book->clockpinned = 1;
+    return;
+}
 
-    if (standing->qty == 0) standing->open = 0;
-    if (incoming->qty == 0) incoming->open = 0;
 
-    // Fix the positions of the 2 accounts...
+void clock_move_to (BOOK * book, char * token)      // A $<micros> token: the next timestamp is at that time, if it's later
+{
+    int64_t micros;
 
-    if (strcmp(standing->account->name, incoming->account->name))       // Transactions with self do nothing
+    if (VirtualClock <= 0) return;
+
+    clock_tick(book);                   // In case nothing has used the book's clock yet
+
+    micros = strtoll(token + 1, NULL, 10);
+    if (micros - 1 > clock_micros(book))
     {
-        if (standing->direction == BUY)
-        {
-            update_account(standing->account, quantity, price, BUY);
-            update_account(incoming->account, quantity, price, SELL);
-        } else {
-            update_account(standing->account, quantity, price, SELL);
-            update_account(incoming->account, quantity, price, BUY);
-        }
+        clock_set(book, micros - 1);
     }
+    return;
+}
 
-    set_quote_lastinfo(price, quantity);    // The rest of the quote will be generated by the function
-                                            // execute_order() when the whole execution is finished
-
-    create_execution_messages(standing, incoming, quantity, price, ts);
 
+void clock_unpin (BOOK * book)
+{
+    book->clockpinned = 0;
     return;
 }
 
 
-void run_order (ORDER * order)
+char * new_timestamp (BOOK * book)
 {
-    LEVEL * current_level;
-    ORDERNODE * current_node;
+    char * timestamp;
+    time_t t;
+    struct tm * ti;
+    struct tm ti_storage;
 
-    if (order->direction == SELL)
+    timestamp = malloc(SMALLSTRING);
+    check_ptr_or_quit(timestamp);
+
+    clock_tick(book);
+    book->clockmicro += 1;
+
+    if (book->clockmicro > 999999 && VirtualClock > 0)
     {
-        for (current_level = FirstBidLevel; current_level != NULL; current_level = current_level->next)
-        {
-            if (current_level->price < order->price && order->orderType != MARKET) return;
+        book->clocksecond += 1;
+        book->clockmicro = 0;
+    }
 
-            for (current_node = current_level->firstordernode; current_node != NULL; current_node = current_node->next)
-            {
-                cross(current_node->order, order);
-                if (order->open == 0) return;
-            }
-        }
+    t = (time_t) book->clocksecond;
+
+    if (t != (time_t) -1)
+    {
+        #if defined(_WIN32)
+            ti = gmtime_s(&ti_storage, &t) == 0 ? &ti_storage : NULL;
+        #else
+            ti = gmtime_r(&t, &ti_storage);             // gmtime() isn't thread-safe
+        #endif
     } else {
-        for (current_level = FirstAskLevel; current_level != NULL; current_level = current_level->next)
-        {
-            if (current_level->price > order->price && order->orderType != MARKET) return;
+        ti = NULL;
+    }
 
-            for (current_node = current_level->firstordernode; current_node != NULL; current_node = current_node->next)
-            {
-                cross(current_node->order, order);
-                if (order->open == 0) return;
-            }
-        }
+    if (ti)
+    {
+        snprintf(timestamp, SMALLSTRING, "%d-%02d-%02dT%02d:%02d:%02d.%06dZ",
+                 ti->tm_year + 1900, ti->tm_mon + 1, ti->tm_mday, ti->tm_hour, ti->tm_min, ti->tm_sec, book->clockmicro);
+    } else {
+        snprintf(timestamp, SMALLSTRING, "Unknown");
     }
 
-    return;
+    return timestamp;
 }
 
 
-void cleanup_closed_bids_or_asks (LEVEL ** root_level)  // root_level is pointing to FirstBidLevel or FirstAskLevel, themselves pointers
+void print_timestamp (BOOK * book, OUTBUF * out)
 {
-    LEVEL * current_level;
-    LEVEL * old_level;
-    ORDERNODE * current_node;
-    ORDERNODE * old_node;
+    char * ts;
+    ts = new_timestamp(book);
+    out_printf(out, "%s", ts);
+    free(ts);
+    return;
+}
+
+
+ORDER * init_order (BOOK * book, ACCOUNT * account, int qty, int price, int direction, int orderType, int id, char * ts)
+{
+    ORDER * ret;
+    int n;
+
+    book->debuginfo.inits_of_order++;
+    count_memory(book, MEM_ORDERS, 1, sizeof(ORDER));
+    count_memory(book, MEM_TIMESTAMPS, 1, SMALLSTRING);     // The order owns its timestamp
+
+    ret = malloc(sizeof(ORDER));
+    check_ptr_or_quit(ret);
+
+    ret->direction = direction;
+    ret->originalQty = qty;
+    ret->qty = qty;
+    ret->price = price;
+    ret->orderType = orderType;
+    ret->id = id;
+    ret->account = account;
+    ret->ts = ts;
+    ret->firstfillnode = NULL;
+    ret->fillcount = 0;
+    ret->totalFilled = 0;
+    ret->open = 1;
+
+    // Now deal with the global order storage...
+
+    while (id >= book->currentorderarraylen)
+    {
+        book->allorders = realloc(book->allorders, (book->currentorderarraylen + 8192) * sizeof(ORDER *));
+        check_ptr_or_quit(book->allorders);
+        count_memory(book, MEM_DIRECTORIES, book->currentorderarraylen == 0, 8192 * sizeof(ORDER *));
+        book->currentorderarraylen += 8192;
+
+        // NULLify the new pointers in case gaps open up somehow - we can
+        // verify the order ID doesn't exist... (should be impossible at
+        // time of writing but it's good practice).
+
+        for (n = book->currentorderarraylen - 8192; n < book->currentorderarraylen; n++)
+        {
+            book->allorders[n] = NULL;
+        }
+
+        book->debuginfo.reallocs_of_global_order_list++;
+    }
+    book->allorders[id] = ret;
+    book->highestknownorder = id;
+
+    return ret;
+}
+
+
+ORDER_AND_ERROR * init_o_and_e (void)
+{
+    ORDER_AND_ERROR * ret;
+
+    ret = malloc(sizeof(ORDER_AND_ERROR));
+    check_ptr_or_quit(ret);
+
+    ret->order = NULL;
+    ret->error = 0;
+
+    return ret;
+}
+
+
+void update_account (ACCOUNT * account, int quantity, int price, int direction)
+{
+    // Elsewhere we rather rely on shares and cents being int32,
+    // so don't change that now. If people exceed the bounds,
+    // their extra shares and money is "lost". Fine.
+
+    int64_t tmp64;
+
+    assert(account);
+
+    // Update shares...
+
+    tmp64 = account->shares;
+
+    if (direction == BUY)
+    {
+        tmp64 += quantity;
+        if (tmp64 > 2147483647)
+        {
+            account->shares = 2147483647;
+        } else {
+            account->shares = (int) tmp64;
+        }
+    } else {
+        tmp64 -= quantity;
+        if (tmp64 < -2147483647)
+        {
+            account->shares = -2147483647;
+        } else {
+            account->shares = (int) tmp64;
+        }
+    }
+
+    // Update cents...
+
+    tmp64 = account->cents;
+
+    if (direction == BUY)
+    {
+        tmp64 -= (int64_t) price * (int64_t) quantity;
+        if (tmp64 < -2147483647)
+        {
+            account->cents = -2147483647;
+        } else {
+            account->cents = (int) tmp64;
+        }
+    } else {
+        tmp64 += (int64_t) price * (int64_t) quantity;
+        if (tmp64 > 2147483647)
+        {
+            account->cents = 2147483647;
+        } else {
+            account->cents = (int) tmp64;
+        }
+    }
+
+    if (account->shares < account->posmin) account->posmin = account->shares;
+    if (account->shares > account->posmax) account->posmax = account->shares;
+
+    return;
+}
+
+
+int64_t get_size_from_level (LEVEL * level)
+{
+    ORDERNODE * ordernode;
+    int64_t ret;
+
+    if (level == NULL)
+    {
+        return 0;
+    }
+
+    ret = 0;
+
+    for (ordernode = level->firstordernode; ordernode != NULL; ordernode = ordernode->next)
+    {
+        ret += ordernode->order->qty;
+    }
+    return ret;
+}
+
+
+int64_t get_depth (LEVEL * level)        // Returns size of this level and all worse levels (if level exists)
+{
+    int64_t onesize;
+    int64_t ret;
+
+    ret = 0;
+
+    for ( ; level != NULL; level = level->next)
+    {
+        ret += get_size_from_level(level);
+    }
+    return ret;
+}
+
+
+void print_quote (BOOK * book, QUOTE * quote, OUTBUF * out)    // Just hard-codes the indent, meaning executions messages look odd. Meh.
+{
+    char buildup[MAXSTRING];
+    char part[MAXSTRING];
+
+    // Add all the fields that are always present...
+    snprintf(buildup, MAXSTRING, "{\n  \"ok\": true,\n  \"symbol\": \"%s\",\n  \"venue\": \"%s\",\n  \"bidSize\": %" PRId64 ",\n"
+                                 "  \"askSize\": %" PRId64 ",\n  \"bidDepth\": %" PRId64 ",\n  \"askDepth\": %" PRId64 ",\n  \"quoteTime\": \"%s\"",
+             book->symbol, book->venue, quote->bidSize, quote->askSize, quote->bidDepth, quote->askDepth, quote->quoteTime);
+
+    if (quote->bid >= 0)              // -1 used as a null value
+    {
+        snprintf(part, MAXSTRING, ",\n  \"bid\": %d", quote->bid);
+        strncat(buildup, part, MAXSTRING - strlen(buildup) - 1);
+    }
+
+    if (quote->ask >= 0)              // -1 used as a null value
+    {
+        snprintf(part, MAXSTRING, ",\n  \"ask\": %d", quote->ask);
+        strncat(buildup, part, MAXSTRING - strlen(buildup) - 1);
+    }
+
+    if (quote->lastTrade[0])          // i.e. check the timestamp of the last trade is a non-empty string
+    {
+        snprintf(part, MAXSTRING, ",\n  \"lastTrade\": \"%s\",\n  \"lastSize\": %d,\n  \"last\": %d", quote->lastTrade, quote->lastSize, quote->last);
+        strncat(buildup, part, MAXSTRING - strlen(buildup) - 1);
+    }
+
+    strncat(buildup, "\n}", MAXSTRING - strlen(buildup) - 1);
+
+    out_printf(out, "%s", buildup);
+
+    return;
+}
+
+
+void print_fills (OUTBUF * out, ORDER_SNAPSHOT * snapshot, char * indent1, char * indent2)
+{
+    FILLNODE * fillnode = NULL;
+    ARCHIVED_FILL * archived;
+    int n;
+
+    if (snapshot->fillcount == 0)       // Can do without this block but it's uglier
+    {
+        out_printf(out, "%s\"fills\": []", indent1);
+        return;
+    }
+
+    out_printf(out, "%s\"fills\": [\n", indent1);
+
+    if (snapshot->order) fillnode = snapshot->order->firstfillnode;
+
+    for (n = 0; n < snapshot->fillcount; n++)   // Counted, not run to NULL, as the matching may be adding more
+    {
+        if (n > 0)
+        {
+            out_printf(out, ",\n");
+            if (fillnode) fillnode = fillnode->next;
+        }
+        if (fillnode)
+        {
+            out_printf(out, "%s{\"price\": %d, \"qty\": %d, \"ts\": \"%s\"}", indent2, fillnode->fill->price, fillnode->fill->qty, fillnode->fill->ts);
+        } else {
+            archived = &snapshot->archived->fills[n];
+            out_printf(out, "%s{\"price\": %d, \"qty\": %d, \"ts\": \"%s\"}", indent2, archived->price, archived->qty, archived->ts);
+        }
+    }
+
+    out_printf(out, "\n%s]", indent1);
+    return;
+}
+
+
+void snapshot_order (ORDER * order, ORDER_SNAPSHOT * snapshot)
+{
+    snapshot->order = order;
+    snapshot->archived = NULL;
+    snapshot->price = order->price;
+    snapshot->qty = order->qty;
+    snapshot->totalFilled = order->totalFilled;
+    snapshot->open = order->open;
+    snapshot->fillcount = order->fillcount;
+    return;
+}
+
+
+#if !defined(_WIN32)
+
+ARCHIVED_ORDER * archived_order (BOOK * book, int id)     // NULL unless the order is archived (see -archive)
+{
+    int64_t where;
+
+    if (id < 0 || id >= book->archivedlen || book->archived[id] == 0)
+    {
+        return NULL;
+    }
+
+    where = book->archived[id] - 1;
+    return (ARCHIVED_ORDER *) (book->archivesegments[where / ARCHIVESEGMENTSIZE] + where % ARCHIVESEGMENTSIZE);
+}
+
+#endif
+
+
+void snapshot_order_by_id (BOOK * book, int id, ORDER_SNAPSHOT * snapshot)     // The order must exist, but may be archived
+{
+    #if !defined(_WIN32)
+        ARCHIVED_ORDER * archived;
+
+        if (book->allorders[id] == NULL)
+        {
+            archived = archived_order(book, id);
+            assert(archived);
+
+            snapshot->order = NULL;
+            snapshot->archived = archived;
+            snapshot->price = archived->price;
+            snapshot->qty = archived->qty;
+            snapshot->totalFilled = archived->totalFilled;
+            snapshot->open = 0;
+            snapshot->fillcount = archived->fillcount;
+            return;
+        }
+    #endif
+
+    snapshot_order(book->allorders[id], snapshot);
+    return;
+}
+
+
+int order_exists (BOOK * book, int id)
+{
+    if (id < 0 || id > book->highestknownorder) return 0;
+    if (book->allorders[id] != NULL) return 1;
+
+    #if !defined(_WIN32)
+        if (archived_order(book, id) != NULL) return 1;
+    #endif
+
+    return 0;
+}
+
+
+char * order_type_name (int orderType)
+{
+    if (orderType == LIMIT)
+    {
+        return "limit";
+    } else if (orderType == MARKET) {
+        return "market";
+    } else if (orderType == IOC) {
+        return "immediate-or-cancel";
+    } else if (orderType == FOK) {
+        return "fill-or-kill";
+    } else {
+        return "unknown";
+    }
+}
+
+
+void print_order_snapshot (BOOK * book, OUTBUF * out, ORDER_SNAPSHOT * snapshot)
+{
+    int direction;
+    int originalQty;
+    int orderType;
+    int id;
+    char * account_name;
+    char * ts;
+
+    // The parts that never change are read from wherever the order is...
+
+    if (snapshot->order)
+    {
+        direction = snapshot->order->direction;
+        originalQty = snapshot->order->originalQty;
+        orderType = snapshot->order->orderType;
+        id = snapshot->order->id;
+        account_name = snapshot->order->account->name;
+        ts = snapshot->order->ts;
+    } else {
+        direction = snapshot->archived->direction;
+        originalQty = snapshot->archived->originalQty;
+        orderType = snapshot->archived->orderType;
+        id = snapshot->archived->id;
+        account_name = snapshot->archived->account->name;
+        ts = snapshot->archived->ts;
+    }
+
+    out_printf(out,
+
+            "{\n  \"ok\": true,\n  \"venue\": \"%s\",\n  \"symbol\": \"%s\",\n  \"direction\": \"%s\",\n  \"originalQty\": %d,\n  \"qty\": %d,"
+            "\n  \"price\": %d,\n  \"orderType\": \"%s\",\n  \"id\": %d,\n  \"account\": \"%s\",\n  \"ts\": \"%s\",\n  \"totalFilled\": %d,\n  \"open\": %s,\n",
+
+            book->venue, book->symbol, direction == BUY ? "buy" : "sell", originalQty, snapshot->qty,
+            snapshot->price, order_type_name(orderType), id, account_name, ts, snapshot->totalFilled, snapshot->open ? "true" : "false");
+
+    print_fills(out, snapshot, INDENT_2, INDENT_4);
+    out_printf(out, "\n}");
+
+    return;
+}
+
+
+void respond_with_order (WORKER * worker, BOOK * book, int id)     // Includes the end_message()
+{
+    ORDER_SNAPSHOT snapshot;
+
+    #if !defined(_WIN32)
+        OUTRECORD * record;
+
+        if (OutputThread)
+        {
+            record = next_out_record(worker);
+            record->type = OUT_ORDER;
+            record->book = book;
+            snapshot_order_by_id(book, id, &record->standing);
+            take_outbuf(&record->blob, &worker->out);      // Anything already in the buffer (e.g. the request id) goes
+                                                            // first, in the same record so nothing can come between.
+            publish_out_record(worker);
+            return;
+        }
+    #endif
+
+    snapshot_order_by_id(book, id, &snapshot);
+    print_order_snapshot(book, &worker->out, &snapshot);
+    end_message(&worker->out);
+    return;
+}
+
+
+void write_ticker_message (BOOK * book, QUOTE * quote, OUTBUF * events)
+{
+    out_printf(events, "TICKER %s %s %s\n", "NONE", book->venue, book->symbol);
+
+    out_printf(events, "{\"ok\": true, \"quote\": ");
+    print_quote(book, quote, events);
+    out_printf(events, "}");
+
+    end_message(events);
+    return;
+}
+
+
+void write_execution_messages (BOOK * book, ORDER_SNAPSHOT * standing, ORDER_SNAPSHOT * incoming, int quantity, int price, char * ts, OUTBUF * events)
+{
+    ACCOUNT * s_account = standing->order->account;
+    ACCOUNT * i_account = incoming->order->account;
+
+    out_printf(events, "EXECUTION %s %s %s\n", s_account->name, book->venue, book->symbol);
+    out_printf(events, EXECUTION_TEMPLATE_1, s_account->name, book->venue, book->symbol);
+    print_order_snapshot(book, events, standing);
+    out_printf(events, EXECUTION_TEMPLATE_2, standing->order->id, incoming->order->id, price, quantity, ts,
+            standing->open ? "false" : "true", incoming->open ? "false" : "true");
+
+    end_message(events);
+
+    out_printf(events, "EXECUTION %s %s %s\n", i_account->name, book->venue, book->symbol);
+    out_printf(events, EXECUTION_TEMPLATE_1, i_account->name, book->venue, book->symbol);
+    print_order_snapshot(book, events, incoming);
+    out_printf(events, EXECUTION_TEMPLATE_2, standing->order->id, incoming->order->id, price, quantity, ts,
+            standing->open ? "false" : "true", incoming->open ? "false" : "true");
+
+    end_message(events);
+    return;
+}
+
+
+// The create_*() functions are called by the matching. With the output thread running, they
+// just snapshot what they need into a record, and leave the formatting to the output thread.
+
+void create_ticker_message (BOOK * book)
+{
+    #if !defined(_WIN32)
+        OUTRECORD * record;
+    #endif
+
+    book->stats.tickers++;
+
+    #if !defined(_WIN32)
+        if (OutputThread)
+        {
+            record = next_out_record(book->worker);
+            record->type = OUT_TICKER;
+            record->book = book;
+            record->quote = book->quote;
+            publish_out_record(book->worker);
+            return;
+        }
+    #endif
+
+    write_ticker_message(book, &book->quote, &book->worker->events);
+    return;
+}
+
+
+void create_execution_messages (BOOK * book, ORDER * standing, ORDER * incoming, int quantity, int price, char * ts)
+{
+    ORDER_SNAPSHOT standing_snapshot;
+    ORDER_SNAPSHOT incoming_snapshot;
+
+    #if !defined(_WIN32)
+        OUTRECORD * record;
+    #endif
+
+    if (book->replaying) return;
+
+    #if !defined(_WIN32)
+        if (OutputThread)
+        {
+            record = next_out_record(book->worker);
+            record->type = OUT_EXECUTION;
+            record->book = book;
+            snapshot_order(standing, &record->standing);
+            snapshot_order(incoming, &record->incoming);
+            record->quantity = quantity;
+            record->price = price;
+            record->ts = ts;            // Belongs to the fill, which outlives the record (see maybe_archive())
+            publish_out_record(book->worker);
+            return;
+        }
+    #endif
+
+    snapshot_order(standing, &standing_snapshot);
+    snapshot_order(incoming, &incoming_snapshot);
+    write_execution_messages(book, &standing_snapshot, &incoming_snapshot, quantity, price, ts, &book->worker->events);
+    return;
+}
+
+
+int64_t monotonic_ms (void)
+{
+    #if defined(_WIN32)
+        return (int64_t) GetTickCount64();
+    #else
+        struct timespec tp;
+        clock_gettime(CLOCK_MONOTONIC, &tp);
+        return (int64_t) tp.tv_sec * 1000 + tp.tv_nsec / 1000000;
+    #endif
+}
+
+
+int64_t monotonic_ns (void)
+{
+    #if defined(_WIN32)
+        LARGE_INTEGER count;
+        LARGE_INTEGER frequency;
+        QueryPerformanceCounter(&count);
+        QueryPerformanceFrequency(&frequency);
+        return (int64_t) ((double) count.QuadPart * 1000000000.0 / (double) frequency.QuadPart);
+    #else
+        struct timespec tp;
+        clock_gettime(CLOCK_MONOTONIC, &tp);
+        return (int64_t) tp.tv_sec * 1000000000 + tp.tv_nsec;
+    #endif
+}
+
+
+// Command timing (see __STATS__). The histograms are log-linear, like HDR histograms: times under
+// 8 ns get a bucket each, and above that each power of 2 is split into 8 equal buckets. Recording
+// a time is just a few shifts and increments.
+
+int histogram_bucket (int64_t ns)
+{
+    int msb;
+    int bucket;
+
+    if (ns < HISTOGRAM_SUBBUCKETS) return ns < 0 ? 0 : (int) ns;
+
+    #if defined(__GNUC__)
+        msb = 63 - __builtin_clzll((unsigned long long) ns);
+    #else
+        msb = 0;
+        while ((ns >> msb) > 1) msb++;
+    #endif
+
+    bucket = (msb - HISTOGRAM_SUBBITS + 1) * HISTOGRAM_SUBBUCKETS + (int) ((ns >> (msb - HISTOGRAM_SUBBITS)) & (HISTOGRAM_SUBBUCKETS - 1));
+
+    return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+
+int64_t histogram_bucket_top (int bucket)       // Highest time that lands in the bucket
+{
+    int shift;
+
+    if (bucket < HISTOGRAM_SUBBUCKETS) return bucket;
+
+    shift = bucket / HISTOGRAM_SUBBUCKETS - 1;
+    return ((int64_t) (HISTOGRAM_SUBBUCKETS + bucket % HISTOGRAM_SUBBUCKETS + 1) << shift) - 1;
+}
+
+
+int64_t histogram_percentile (int64_t * histogram, int64_t count, int64_t max, double p)
+{
+    int64_t wanted;
+    int64_t seen = 0;
+    int n;
+
+    wanted = (int64_t) (p * count + 0.999999);         // At least this many times are no higher than the answer
+    if (wanted < 1) wanted = 1;
+
+    for (n = 0; n < HISTOGRAM_BUCKETS; n++)
+    {
+        seen += histogram[n];
+        if (seen >= wanted) return histogram_bucket_top(n) < max ? histogram_bucket_top(n) : max;
+    }
+    return max;
+}
+
+
+void finish_trace (WORKER * worker, int64_t started)     // After each command; does nothing unless it was traced
+{
+    int64_t now;
+
+    #if !defined(_WIN32)
+        OUTBUF line = {NULL, 0, 0};
+    #endif
+
+    if (worker->traced == 0) return;
+
+    now = monotonic_ns();
+
+    #if !defined(_WIN32)
+        if (OutputThread)
+        {
+            // The output thread adds up how long it spends on this command's records, and
+            // finishes the line with that once it reaches this one...
+
+            emit_output(worker);
+            out_printf(&line, "%%%d %" PRId64 " %" PRId64, worker->traceid, worker->traceparsed - started, now - worker->traceparsed);
+            publish_blob(worker, OUT_TRACE, &line);
+            worker->traced = 0;
+            return;
+        }
+    #endif
+
+    out_printf(&worker->out, "%%%d %" PRId64 " %" PRId64 " 0\n", worker->traceid, worker->traceparsed - started, now - worker->traceparsed);
+    worker->traced = 0;
+    return;
+}
+
+
+void record_command (BOOK * book, int type, int64_t ns)
+{
+    if (type == STATS_NONE) return;
+
+    book->stats.commands[type]++;
+    book->stats.totalns[type] += ns;
+    if (ns > book->stats.maxns[type]) book->stats.maxns[type] = ns;
+    book->stats.histogram[type][histogram_bucket(ns)]++;
+    return;
+}
+
+
+void reset_stats (BOOK * book)
+{
+    memset(&book->stats, 0, sizeof(STATS));
+    book->stats.sincens = monotonic_ns();
+    return;
+}
+
+
+void print_stats (BOOK * book, OUTBUF * out)
+{
+    char * names[STATS_TYPES] = {"ORDER", "CANCEL", "STATUS", "STATUSALL", "ORDERBOOK_BINARY", "QUOTE", "OTHER"};
+    STATS * stats = &book->stats;
+    int64_t count;
+    int type;
+
+    out_printf(out, "{\n  \"ok\": true,\n  \"venue\": \"%s\",\n  \"symbol\": \"%s\",\n  \"seconds\": %.3f,\n"
+                    "  \"fills\": %" PRId64 ",\n  \"levelsWalked\": %" PRId64 ",\n  \"ordersWalked\": %" PRId64 ",\n  \"tickers\": %" PRId64 ",\n"
+                    "  \"commands\": {",
+               book->venue, book->symbol, (monotonic_ns() - stats->sincens) / 1e9,
+               stats->fills, stats->levelswalked, stats->orderswalked, stats->tickers);
+
+    for (type = 0; type < STATS_TYPES; type++)
+    {
+        count = stats->commands[type];
+
+        out_printf(out, "%s\n    \"%s\": {\"count\": %" PRId64, type ? "," : "", names[type], count);
+        if (count > 0)
+        {
+            out_printf(out, ", \"meanUs\": %.3f, \"p50Us\": %.3f, \"p90Us\": %.3f, \"p99Us\": %.3f, \"p999Us\": %.3f, \"maxUs\": %.3f",
+                       stats->totalns[type] / 1000.0 / count,
+                       histogram_percentile(stats->histogram[type], count, stats->maxns[type], 0.5) / 1000.0,
+                       histogram_percentile(stats->histogram[type], count, stats->maxns[type], 0.9) / 1000.0,
+                       histogram_percentile(stats->histogram[type], count, stats->maxns[type], 0.99) / 1000.0,
+                       histogram_percentile(stats->histogram[type], count, stats->maxns[type], 0.999) / 1000.0,
+                       stats->maxns[type] / 1000.0);
+        }
+        out_printf(out, "}");
+    }
+
+    out_printf(out, "\n  }\n}");
+    return;
+}
+
+
+// The following function remakes the parts of the quote that are
+// determined by the state of the book itself (i.e. NOT "last trade" info)
+
+void remake_most_of_quote (BOOK * book)
+{
+    char * ts;
+
+    book->quote.bidSize = get_size_from_level(book->firstbidlevel);
+    book->quote.bidDepth = get_depth(book->firstbidlevel);
+    book->quote.askSize = get_size_from_level(book->firstasklevel);
+    book->quote.askDepth = get_depth(book->firstasklevel);
+
+    if (book->firstbidlevel)
+    {
+        book->quote.bid = book->firstbidlevel->price;
+    } else {
+        book->quote.bid = -1;
+    }
+
+    if (book->firstasklevel)
+    {
+        book->quote.ask = book->firstasklevel->price;
+    } else {
+        book->quote.ask = -1;
+    }
+
+    ts = new_timestamp(book);
+    safe_strcpy(book->quote.quoteTime, ts, SMALLSTRING);
+    free(ts);
+
+    // We can't touch last, lastSize, or lastTrade
+    // as this function is called often even when
+    // no actual fill has happened.
+
+    return;
+}
+
+
+void set_quote_lastinfo (BOOK * book, int last, int lastSize)
+{
+    char * ts;
+
+    book->quote.last = last;
+    book->quote.lastSize = lastSize;
+
+    ts = new_timestamp(book);
+    safe_strcpy(book->quote.lastTrade, ts, SMALLSTRING);
+    free(ts);
+
+    return;
+}
+
+
+void flush_ticker (BOOK * book)
+{
+    if (book->tickerdirty == 0) return;
+
+    remake_most_of_quote(book);
+    create_ticker_message(book);
+
+    book->tickerdirty = 0;
+    book->worker->dirtybooks--;
+    book->commandssinceticker = 0;
+    book->lasttickerms = monotonic_ms();
+    return;
+}
+
+
+void book_changed (BOOK * book)                // Called whenever the book changes in a way that needs a ticker
+{
+    book->version++;                            // Any snapshot of the book is now out of date
+
+    if (book->replaying) return;                // The quote is remade once replay is done
+
+    if (book->tickerdirty == 0)
+    {
+        book->tickerdirty = 1;
+        book->worker->dirtybooks++;
+    }
+
+    if (book->tickerintervalms <= 0 && book->tickereveryn <= 0)
+    {
+        flush_ticker(book);             // No conflation, send it now
+    }
+    return;
+}
+
+
+void maybe_flush_ticker (BOOK * book)          // Called after every command to the book when conflating
+{
+    if (book->tickerdirty == 0) return;
+
+    book->commandssinceticker++;
+
+    if (book->tickereveryn > 0 && book->commandssinceticker >= book->tickereveryn)
+    {
+        flush_ticker(book);
+    } else if (book->tickerintervalms > 0 && monotonic_ms() - book->lasttickerms >= book->tickerintervalms) {
+        flush_ticker(book);
+    }
+    return;
+}
+
+
+void flush_due_tickers (WORKER * worker, int force)     // Flushes the worker's dirty books whose interval is up (or all)
+{
+    int n;
+    int64_t now;
+    BOOK * book;
+
+    if (worker->dirtybooks == 0) return;
+
+    now = monotonic_ms();
+
+    if (force == 0 && now == worker->lasttickersweepms) return;    // Don't sweep the books more than once a ms
+    worker->lasttickersweepms = now;
+
+    for (n = 0; n < worker->bookcount; n++)
+    {
+        book = worker->books[n];
+        if (book->tickerdirty)
+        {
+            if (force || now - book->lasttickerms >= book->tickerintervalms)
+            {
+                flush_ticker(book);
+            }
+        }
+    }
+    return;
+}
+
+
+int ms_until_next_ticker (WORKER * worker)     // How long it can block before one of its dirty books is due a ticker
+{
+    int n;
+    int64_t now;
+    int64_t remaining;
+    int64_t ret = 1000;
+    BOOK * book;
+
+    now = monotonic_ms();
+
+    for (n = 0; n < worker->bookcount; n++)
+    {
+        book = worker->books[n];
+        if (book->tickerdirty)
+        {
+            remaining = book->tickerintervalms - (now - book->lasttickerms);
+            if (remaining < ret) ret = remaining;
+        }
+    }
+
+    if (ret < 0) ret = 0;
+    return (int) ret;
+}
+
+
+void cross (BOOK * book, ORDER * standing, ORDER * incoming)
+{
+    int quantity;
+    int price;
+    char * ts;
+    FILLNODE * currentfillnode;
+    FILL * fill;
+
+    ts = new_timestamp(book);
+
+    if (standing->qty < incoming->qty)
+    {
+        quantity = standing->qty;
+    } else {
+        quantity = incoming->qty;
+    }
+
+    standing->qty -= quantity;
+    standing->totalFilled += quantity;
+    incoming->qty -= quantity;
+    incoming->totalFilled += quantity;
+
+    price = standing->price;
+
+    fill = init_fill(book, price, quantity, ts);
+    book->stats.fills++;
+
+    // Figure out where to put the fill...
+
+    if (standing->firstfillnode == NULL)
+    {
+        standing->firstfillnode = init_fillnode(book, fill, NULL, NULL);
+    } else {
+        currentfillnode = standing->firstfillnode;
+        while (currentfillnode->next != NULL)
+        {
+            currentfillnode = currentfillnode->next;
+        }
+        currentfillnode->next = init_fillnode(book, fill, currentfillnode, NULL);
+    }
+    standing->fillcount++;
+
+    // Again for other order...
+
+    if (incoming->firstfillnode == NULL)
+    {
+        incoming->firstfillnode = init_fillnode(book, fill, NULL, NULL);
+    } else {
+        currentfillnode = incoming->firstfillnode;
+        while (currentfillnode->next != NULL)
+        {
+            currentfillnode = currentfillnode->next;
+        }
+        currentfillnode->next = init_fillnode(book, fill, currentfillnode, NULL);
+    }
+    incoming->fillcount++;
+
+    if (standing->qty == 0) standing->open = 0;
+    if (incoming->qty == 0) incoming->open = 0;
+
+    // Fix the positions of the 2 accounts...
+
+    if (strcmp(standing->account->name, incoming->account->name))       // Transactions with self do nothing
+    {
+        if (standing->direction == BUY)
+        {
+            update_account(standing->account, quantity, price, BUY);
+            update_account(incoming->account, quantity, price, SELL);
+        } else {
+            update_account(standing->account, quantity, price, SELL);
+            update_account(incoming->account, quantity, price, BUY);
+        }
+    }
+
+    set_quote_lastinfo(book, price, quantity);      // The rest of the quote will be generated by the function
+                                                    // execute_order() when the whole execution is finished
+
+    create_execution_messages(book, standing, incoming, quantity, price, ts);
+
+    return;
+}
+
+
+void run_order (BOOK * book, ORDER * order)
+{
+    LEVEL * current_level;
+    ORDERNODE * current_node;
+
+    if (order->direction == SELL)
+    {
+        for (current_level = book->firstbidlevel; current_level != NULL; current_level = current_level->next)
+        {
+            if (current_level->price < order->price && order->orderType != MARKET) return;
+            book->stats.levelswalked++;
+            level_changed(current_level);               // Its first order at least is about to be filled
+
+            for (current_node = current_level->firstordernode; current_node != NULL; current_node = current_node->next)
+            {
+                book->stats.orderswalked++;
+                cross(book, current_node->order, order);
+                if (order->open == 0) return;
+            }
+        }
+    } else {
+        for (current_level = book->firstasklevel; current_level != NULL; current_level = current_level->next)
+        {
+            if (current_level->price > order->price && order->orderType != MARKET) return;
+            book->stats.levelswalked++;
+            level_changed(current_level);
+
+            for (current_node = current_level->firstordernode; current_node != NULL; current_node = current_node->next)
+            {
+                book->stats.orderswalked++;
+                cross(book, current_node->order, order);
+                if (order->open == 0) return;
+            }
+        }
+    }
+
+    return;
+}
+
+
+void cleanup_closed_bids_or_asks (BOOK * book, LEVEL ** root_level)    // root_level is pointing to firstbidlevel or firstasklevel, themselves pointers
+{
+    LEVEL * current_level;
+    LEVEL * old_level;
+    ORDERNODE * current_node;
+    ORDERNODE * old_node;
 
     if (*root_level == NULL) return;
 
-    current_level = *root_level;                        // Due to the double indirection, current_level still a pointer to a LEVEL
-    current_node = current_level->firstordernode;
-    assert(current_node != NULL);
+    current_level = *root_level;                        // Due to the double indirection, current_level still a pointer to a LEVEL
+    current_node = current_level->firstordernode;
+    assert(current_node != NULL);
+
+    while (1)
+    {
+        if (current_node->order->open)                  // We found the very first (highest priority) open order
+        {
+            current_level->firstordernode = current_node;
+            current_level->prev = NULL;
+            current_node->prev = NULL;
+            *root_level = current_level;                // Remembering that current_level is a pointer, so
+            return;                                     // firstbidlevel or firstasklevel ends up pointing to the level
+        }
+
+        if (current_node->next != NULL)
+        {
+            old_node = current_node;
+            current_node = current_node->next;
+            free(old_node);
+            count_memory(book, MEM_ORDERNODES, -1, -(int64_t) sizeof(ORDERNODE));
+        } else {
+            old_node = current_node;
+            old_level = current_level;
+            current_level = current_level->next;
+            level_changed(old_level);
+            free(old_node);
+            free(old_level);
+            count_memory(book, MEM_ORDERNODES, -1, -(int64_t) sizeof(ORDERNODE));
+            count_memory(book, MEM_LEVELS, -1, -(int64_t) sizeof(LEVEL));
+            if (current_level != NULL)
+            {
+                current_node = current_level->firstordernode;
+                assert(current_node != NULL);
+            } else {
+                *root_level = NULL;
+                return;
+            }
+        }
+    }
+
+    return;
+}
+
+
+void insert_ask (BOOK * book, ORDER * order)
+{
+    ORDERNODE * ordernode;
+    ORDERNODE * current_node;
+    LEVEL * prev_level = NULL;
+    LEVEL * level;
+    LEVEL * newlevel;
+
+    ordernode = init_ordernode(book, order, NULL, NULL);      // Fix ->prev later
+
+    if (book->firstasklevel == NULL)
+    {
+        book->firstasklevel = init_level(book, order->price, ordernode, NULL, NULL);
+        return;
+    } else {
+        level = book->firstasklevel;
+    }
+
+    while (1)
+    {
+        if (order->price < level->price)
+        {
+            // Create new level...
+
+            newlevel = init_level(book, order->price, ordernode, prev_level, level);
+            level->prev = newlevel;
+            if (prev_level)
+            {
+                prev_level->next = newlevel;
+            } else {
+                book->firstasklevel = newlevel;
+            }
+            return;
+
+        } else if (order->price == level->price) {
+
+            break;
+
+        } else {
+
+            // Iterate...
+
+            prev_level = level;
+            if (level->next != NULL)
+            {
+                level = level->next;
+            } else {
+                level->next = init_level(book, order->price, ordernode, prev_level, NULL);
+                return;
+            }
+        }
+    }
+
+    // So we should be on the right level now
+
+    assert(level->price == order->price);
+
+    current_node = level->firstordernode;
+    assert(current_node != NULL);
+
+    while (current_node->next != NULL)
+    {
+        current_node = current_node->next;
+    }
+
+    current_node->next = ordernode;
+    ordernode->prev = current_node;
+    level_changed(level);
+
+    return;
+}
+
+
+void insert_bid (BOOK * book, ORDER * order)
+{
+    ORDERNODE * ordernode;
+    ORDERNODE * current_node;
+    LEVEL * prev_level = NULL;
+    LEVEL * level;
+    LEVEL * newlevel;
+
+    ordernode = init_ordernode(book, order, NULL, NULL);      // Fix ->prev later
+
+    if (book->firstbidlevel == NULL)
+    {
+        book->firstbidlevel = init_level(book, order->price, ordernode, NULL, NULL);
+        return;
+    } else {
+        level = book->firstbidlevel;
+    }
+
+    while (1)
+    {
+        if (order->price > level->price)
+        {
+            // Create new level...
+
+            newlevel = init_level(book, order->price, ordernode, prev_level, level);
+            level->prev = newlevel;
+            if (prev_level)
+            {
+                prev_level->next = newlevel;
+            } else {
+                book->firstbidlevel = newlevel;
+            }
+            return;
+
+        } else if (order->price == level->price) {
+
+            break;
+
+        } else {
+
+            // Iterate...
+
+            prev_level = level;
+            if (level->next != NULL)
+            {
+                level = level->next;
+            } else {
+                level->next = init_level(book, order->price, ordernode, prev_level, NULL);
+                return;
+            }
+        }
+    }
+
+    // So we should be on the right level now
+
+    assert(level->price == order->price);
+
+    current_node = level->firstordernode;
+    assert(current_node != NULL);
+
+    while (current_node->next != NULL)
+    {
+        current_node = current_node->next;
+    }
+
+    current_node->next = ordernode;
+    ordernode->prev = current_node;
+    level_changed(level);
+
+    return;
+}
+
+
+int fok_can_buy (BOOK * book, int qty, int price)
+{
+    // Must use subtraction only. Adding could overflow.
+
+    LEVEL * level;
+    ORDERNODE * ordernode;
+
+    for (level = book->firstasklevel; level != NULL && level->price <= price; level = level->next)
+    {
+        for (ordernode = level->firstordernode; ordernode != NULL; ordernode = ordernode->next)
+        {
+            qty -= ordernode->order->qty;
+            if (qty <= 0) return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+int fok_can_sell (BOOK * book, int qty, int price)
+{
+    // Must use subtraction only. Adding could overflow.
+
+    LEVEL * level;
+    ORDERNODE * ordernode;
+
+    for (level = book->firstbidlevel; level != NULL && level->price >= price; level = level->next)
+    {
+        for (ordernode = level->firstordernode; ordernode != NULL; ordernode = ordernode->next)
+        {
+            qty -= ordernode->order->qty;
+            if (qty <= 0) return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+BOOK * init_book (WORKER * worker, int book_id, char * venue, char * symbol)     // The worker is the one that will own the book
+{
+    BOOK * ret;
+
+    ret = calloc(1, sizeof(BOOK));
+    check_ptr_or_quit(ret);
+
+    safe_strcpy(ret->venue, venue, SMALLSTRING);
+    safe_strcpy(ret->symbol, symbol, SMALLSTRING);
+
+    ret->clocksecond = -1;
+    ret->starttime = new_timestamp(ret);
+    ret->highestknownorder = -1;
+
+    ret->quote.bid = -1;                // -1 used as a null value in the quote
+    ret->quote.ask = -1;
+    ret->quote.last = -1;
+    ret->quote.lastSize = -1;
+    safe_strcpy(ret->quote.quoteTime, ret->starttime, SMALLSTRING);
+
+    ret->lasttickerms = monotonic_ms();
+    ret->stats.sincens = monotonic_ns();
+
+    count_memory(ret, MEM_BOOK, 1, sizeof(BOOK));
+    count_memory(ret, MEM_TIMESTAMPS, 1, SMALLSTRING);      // starttime
+
+    #if !defined(_WIN32)
+        ret->journalfd = -1;
+        ret->snapshotstate = -1;
+        ret->archivefd = -1;
+    #endif
+
+    // Now deal with the global book storage, and the list of the owning worker's books...
+
+    assert(book_id >= 0 && book_id < MAXBOOKS);
+
+    if (worker->bookcount % 64 == 0)
+    {
+        worker->books = realloc(worker->books, (worker->bookcount + 64) * sizeof(BOOK *));
+        check_ptr_or_quit(worker->books);
+    }
+    worker->books[worker->bookcount] = ret;
+    worker->bookcount += 1;
+
+    ret->worker = worker;
+    AllBooks[book_id] = ret;
+
+    return ret;
+}
+
+
+ACCOUNT * init_account (BOOK * book, char * name, int id)
+{
+    ACCOUNT * ret;
+
+    book->debuginfo.inits_of_account++;
+    count_memory(book, MEM_ACCOUNTS, 1, sizeof(ACCOUNT));
+
+    ret = malloc(sizeof(ACCOUNT));
+    check_ptr_or_quit(ret);
+
+    safe_strcpy(ret->name, name, SMALLSTRING);
+    ret->id = id;
+
+    ret->orders = NULL;
+    ret->arraylen = 0;
+    ret->count = 0;
+
+    ret->posmin = 0;
+    ret->posmax = 0;
+    ret->shares = 0;
+    ret->cents = 0;
+
+    return ret;
+}
+
+
+ACCOUNT * account_lookup_or_create (BOOK * book, char * account_name, int account_int)
+{
+    int n;
+
+    // If account_id is too high, we will need more storage...
+
+    while (account_int >= book->currentaccountarraylen)
+    {
+        book->allaccounts = realloc(book->allaccounts, (book->currentaccountarraylen + 64) * sizeof(ACCOUNT *));
+        check_ptr_or_quit(book->allaccounts);
+        count_memory(book, MEM_DIRECTORIES, book->currentaccountarraylen == 0, 64 * sizeof(ACCOUNT *));
+        book->currentaccountarraylen += 64;
+
+        // We must NULLify our new account pointers because there can be holes in the known
+        // account IDs: e.g. known IDs are 0,1,2,3,7. So, if we're asked to lookup ID 5, we
+        // need a way to know it doesn't exist...
+
+        for (n = book->currentaccountarraylen - 64; n < book->currentaccountarraylen; n++)
+        {
+            book->allaccounts[n] = NULL;
+        }
+
+        book->debuginfo.reallocs_of_global_account_list++;
+    }
+
+    // If the account corresponsing to the account_id is NULL, create it...
+
+    if (book->allaccounts[account_int] == NULL)
+    {
+        book->allaccounts[account_int] = init_account(book, account_name, account_int);
+    }
+
+    // Done...
+
+    return book->allaccounts[account_int];
+}
+
+
+void add_order_to_account (BOOK * book, ORDER * order, ACCOUNT * accountobject)
+{
+    if (accountobject->count == accountobject->arraylen)
+    {
+        accountobject->orders = realloc(accountobject->orders, (accountobject->arraylen + 256) * sizeof(int));
+        check_ptr_or_quit(accountobject->orders);
+        count_memory(book, MEM_DIRECTORIES, accountobject->arraylen == 0, 256 * sizeof(int));
+        accountobject->arraylen += 256;
+
+        book->debuginfo.reallocs_of_account_order_list++;
+    }
+    accountobject->orders[accountobject->count] = order->id;
+    accountobject->count += 1;
+
+    return;
+}
+
+
+ORDER_AND_ERROR * execute_order (BOOK * book, char * account_name, int account_int, int qty, int price, int direction, int orderType)
+{
+    // Note: account_name will be in the stack of the calling function, not in the heap
+
+    ORDER * order;
+    ORDER_AND_ERROR * o_and_e;
+    int id;
+    ACCOUNT * accountobject;
+
+    // The o_and_e structure lets us send either an order or an error to the caller...
+
+    o_and_e = init_o_and_e();
+
+    // Check for too high an order ID, too high an account ID, or silly values...
+
+    if (next_id(book, 1) >= MAXORDERS)                // Pass the no-iterate flag to next_id(book) here
+    {                                           // i.e. don't iterate until we know order succeeds
+        o_and_e->error = TOO_MANY_ORDERS;
+        return o_and_e;
+
+    } else if (account_int >= MAXACCOUNTS)
+    {
+        o_and_e->error = TOO_HIGH_ACCOUNT;
+        return o_and_e;
+
+    } else if (price < 0 || qty < 1 || (direction != SELL && direction != BUY))
+    {
+        o_and_e->error = SILLY_VALUE;
+        return o_and_e;
+    }
+
+    // The following call gets the account object. If not already extant, it is created.
+    // If more memory is needed to store accounts up to this account_id, that happens...
+
+    accountobject = account_lookup_or_create(book, account_name, account_int);
+
+    // Create order struct, and store a pointer to it in the account...
+
+    id = next_id(book, 0);
+    order = init_order(book, accountobject, qty, price, direction, orderType, id, new_timestamp(book));
+    add_order_to_account(book, order, accountobject);
+
+    // Run the order, with checks for FOK if needed...
+
+    if (order->orderType != FOK)
+    {
+        run_order(book, order);
+    } else {
+        if (order->direction == BUY)
+        {
+            if (fok_can_buy(book, order->qty, order->price))
+            {
+                run_order(book, order);
+            }
+        } else {
+            if (fok_can_sell(book, order->qty, order->price))
+            {
+                run_order(book, order);
+            }
+        }
+    }
+
+    // Iterate through the Bids or Asks as appropriate, removing them from the book if they are now closed...
+
+    if (order->direction == SELL)
+    {
+        cleanup_closed_bids_or_asks(book, &book->firstbidlevel);
+    } else {
+        cleanup_closed_bids_or_asks(book, &book->firstasklevel);
+    }
+
+    // Market orders get set to price == 0 in official for storage / reporting
+    // (the timing doesn't matter, this could be done before running the order)
+
+    if (order->orderType == MARKET) order->price = 0;
+
+    // Place open limit orders on the book. Mark other order types as closed...
+
+    if (order->open)
+    {
+        if (order->orderType == LIMIT)
+        {
+            if (order->direction == SELL)
+            {
+                insert_ask(book, order);
+            } else {
+                insert_bid(book, order);
+            }
+        } else {
+            order->open = 0;
+            order->qty = 0;
+        }
+    }
+
+    // If something happened, fix the quote and fire a ticker WebSocket message.
+    // The definition of "something happened" is anything that changes the book:
+    //      - a limit order was placed, OR
+    //      - fills were generated
+    // Nothing else changes the book except cancels, which we aren't dealing with here.
+
+    if (order->totalFilled || order->orderType == LIMIT)
+    {
+        book_changed(book);             // the "last trade" parts of the quote are done by cross(book)
+    }
+
+    o_and_e->order = order;
+    return o_and_e;
+}
+
+
+LEVEL * find_level (BOOK * book, int price, int dir)      // Return ptr to level, or return NULL if not present
+{
+    LEVEL * level = NULL;
+
+    if (dir == BUY)
+    {
+        level = book->firstbidlevel;
+        while (level != NULL)
+        {
+            if (level->price > price)
+            {
+                level = level->next;
+            } else if (level->price == price) {
+                break;
+            } else {
+                level = NULL;
+                break;
+            }
+        }
+    } else {
+        level = book->firstasklevel;
+        while (level != NULL)
+        {
+            if (level->price < price)
+            {
+                level = level->next;
+            } else if (level->price == price) {
+                break;
+            } else {
+                level = NULL;
+                break;
+            }
+        }
+    }
+
+    return level;
+}
+
+
+ORDERNODE * find_ordernode (LEVEL * level, int id)
+{
+    ORDERNODE * ordernode;
+
+    if (level)
+    {
+        for (ordernode = level->firstordernode; ordernode != NULL; ordernode = ordernode->next)
+        {
+            if (ordernode->order->id == id)
+            {
+                return ordernode;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+void cleanup_after_cancel (BOOK * book, ORDERNODE * ordernode, LEVEL * level)       // Free the ordernode, maybe free the level, fix all links
+{
+    int dir;
+
+    assert(ordernode && level);
+
+    dir = ordernode->order->direction;                  // Needed later
+
+    level_changed(level);
+
+    if (ordernode->prev)
+    {
+        ordernode->prev->next = ordernode->next;
+    } else {
+        level->firstordernode = ordernode->next;        // Can set level->firstordernode to NULL, in which case
+    }                                                   // the level is now empty and must be destroyed in a bit
+
+    if (ordernode->next)
+    {
+        ordernode->next->prev = ordernode->prev;
+    }
+
+    free(ordernode);
+    count_memory(book, MEM_ORDERNODES, -1, -(int64_t) sizeof(ORDERNODE));
+
+    if (level->firstordernode == NULL)
+    {
+        if (level->prev)
+        {
+            level->prev->next = level->next;
+        } else {
+            if (dir == BUY)
+            {
+                book->firstbidlevel = level->next;
+            } else {
+                book->firstasklevel = level->next;
+            }
+        }
+
+        if (level->next)
+        {
+            level->next->prev = level->prev;
+        }
+
+        free(level);
+        count_memory(book, MEM_LEVELS, -1, -(int64_t) sizeof(LEVEL));
+    }
+
+    return;
+}
+
+
+LEVEL_BYTES * get_level_bytes (LEVEL * level)      // Caller gets a reference, and must release it
+{
+    /*
+    Strategy for binary printout of the orderbook. Qty is never 0, so 0 qty can be used as an in-channel flag.
+
+    Format then is:
+
+    all bids ... flag ... all asks ... flag
+    using 8 bytes per message (e.g. 1 order or 1 flag takes 8 bytes)
+
+    e.g for a book with 2 bids and 2 asks:
+
+    4bytes (qty)
+    4bytes (price)
+    4bytes (qty)
+    4bytes (price)
+    0x00000000 (zero qty: flag)
+    0x00000000 (for consistency, i.e. 8 bytes per message)
+    4bytes (qty)
+    4bytes (price)
+    4bytes (qty)
+    4bytes (price)
+    0x00000000 (zero qty: flag)
+    0x00000000 (for consistency, i.e. 8 bytes per message)
+
+    Since we must choose an endian system, we will choose BIG (go big endian or go home).
+
+    Each level's orders are kept as bytes once someone has asked for them, until the level
+    changes. A busy book mostly changes near the top, so a new snapshot only has to walk the
+    orders of the few levels that changed since the last one.
+    */
+
+    ORDERNODE * ordernode;
+    LEVEL_BYTES * levelbytes;
+    unsigned char * bytes;
+    uint32_t qty;       // the order qty and price are signed ints not exceeding 2^31-1
+    uint32_t price;     // but promotion to unsigned here seems perfectly fine
+    int count = 0;
+
+    if (level->bytes == NULL)
+    {
+        for (ordernode = level->firstordernode; ordernode != NULL; ordernode = ordernode->next)
+        {
+            count++;
+        }
+
+        levelbytes = malloc(sizeof(LEVEL_BYTES) + count * 8);
+        check_ptr_or_quit(levelbytes);
+
+        levelbytes->refs = 1;           // The level's reference
+        levelbytes->len = count * 8;
+
+        bytes = levelbytes->data;
+        for (ordernode = level->firstordernode; ordernode != NULL; ordernode = ordernode->next)
+        {
+            qty = (uint32_t) ordernode->order->qty;
+            bytes[0] = (qty & 0xFF000000) >> 24;
+            bytes[1] = (qty & 0x00FF0000) >> 16;
+            bytes[2] = (qty & 0x0000FF00) >>  8;
+            bytes[3] = (qty & 0x000000FF);
+
+            price = (uint32_t) ordernode->order->price;
+            bytes[4] = (price & 0xFF000000) >> 24;
+            bytes[5] = (price & 0x00FF0000) >> 16;
+            bytes[6] = (price & 0x0000FF00) >>  8;
+            bytes[7] = (price & 0x000000FF);
+
+            bytes += 8;
+        }
+
+        level->bytes = levelbytes;
+    }
+
+    #if defined(_WIN32)
+        level->bytes->refs++;
+    #else
+        atomic_fetch_add(&level->bytes->refs, 1);
+    #endif
+
+    return level->bytes;
+}
+
+
+void write_book_snapshot (BOOK_SNAPSHOT * snapshot, OUTBUF * out)      // The binary orderbook, as described above
+{
+    unsigned char flag[8];
+    int n;
+
+    memset(flag, 0, 8);
+
+    for (n = 0; n < snapshot->bidlevels; n++)
+    {
+        out_write(out, snapshot->levels[n]->data, snapshot->levels[n]->len);
+    }
+    out_write(out, flag, 8);
+
+    for ( ; n < snapshot->bidlevels + snapshot->asklevels; n++)
+    {
+        out_write(out, snapshot->levels[n]->data, snapshot->levels[n]->len);
+    }
+    out_write(out, flag, 8);
+
+    return;
+}
+
+
+void release_book_snapshot (BOOK_SNAPSHOT * snapshot)
+{
+    int n;
+
+    #if defined(_WIN32)
+        snapshot->refs--;
+        if (snapshot->refs > 0) return;
+    #else
+        if (atomic_fetch_sub(&snapshot->refs, 1) > 1) return;
+    #endif
+
+    for (n = 0; n < snapshot->bidlevels + snapshot->asklevels; n++)
+    {
+        release_level_bytes(snapshot->levels[n]);
+    }
+    free(snapshot->levels);
+    free(snapshot);
+    return;
+}
+
+
+BOOK_SNAPSHOT * get_book_snapshot (BOOK * book)     // Caller gets a reference, and must release it
+{
+    BOOK_SNAPSHOT * snapshot;
+    LEVEL * level;
+    int n;
+
+    // Books are mostly read far more often than they change. So only make a new snapshot
+    // if the book has changed since the last one, and only when someone actually asks.
+    // Making one costs a reference per level, plus the bytes of any level that changed.
+
+    if (book->snapshot == NULL || book->snapshot->version != book->version)
+    {
+        snapshot = calloc(1, sizeof(BOOK_SNAPSHOT));
+        check_ptr_or_quit(snapshot);
+
+        snapshot->refs = 1;             // The book's reference
+        snapshot->version = book->version;
+
+        for (level = book->firstbidlevel; level != NULL; level = level->next) snapshot->bidlevels++;
+        for (level = book->firstasklevel; level != NULL; level = level->next) snapshot->asklevels++;
+
+        snapshot->levels = malloc((snapshot->bidlevels + snapshot->asklevels + 1) * sizeof(LEVEL_BYTES *));
+        check_ptr_or_quit(snapshot->levels);
+
+        n = 0;
+        for (level = book->firstbidlevel; level != NULL; level = level->next) snapshot->levels[n++] = get_level_bytes(level);
+        for (level = book->firstasklevel; level != NULL; level = level->next) snapshot->levels[n++] = get_level_bytes(level);
+
+        if (book->snapshot != NULL) release_book_snapshot(book->snapshot);
+        book->snapshot = snapshot;
+    }
+
+    #if defined(_WIN32)
+        book->snapshot->refs++;
+    #else
+        atomic_fetch_add(&book->snapshot->refs, 1);
+    #endif
+
+    return book->snapshot;
+}
+
+
+void respond_with_book_snapshot (WORKER * worker, BOOK * book)     // No end_message() for binary
+{
+    BOOK_SNAPSHOT * snapshot;
+
+    #if !defined(_WIN32)
+        OUTRECORD * record;
+    #endif
+
+    snapshot = get_book_snapshot(book);
+
+    #if !defined(_WIN32)
+        if (OutputThread)
+        {
+            record = next_out_record(worker);
+            record->type = OUT_ORDERBOOK;
+            record->book = book;
+            record->snapshot = snapshot;
+            take_outbuf(&record->blob, &worker->out);
+            publish_out_record(worker);
+        } else {
+            write_book_snapshot(snapshot, &worker->out);
+            release_book_snapshot(snapshot);
+        }
+    #else
+        write_book_snapshot(snapshot, &worker->out);
+        release_book_snapshot(snapshot);
+    #endif
+
+    if (VirtualClock > 0)               // The frontend can't use its own clock for the "ts"
+    {
+        print_timestamp(book, &worker->out);
+        out_printf(&worker->out, "\n");
+    }
+    return;
+}
+
+
+ORDER_SNAPSHOT * snapshot_orders_of_account (BOOK * book, ACCOUNT * account)       // Caller frees
+{
+    ORDER_SNAPSHOT * ret;
+    int n;
+
+    assert(account);
+
+    ret = malloc((account->count + 1) * sizeof(ORDER_SNAPSHOT));        // +1 so never malloc(0)
+    check_ptr_or_quit(ret);
+
+    for (n = 0; n < account->count; n++)
+    {
+        snapshot_order_by_id(book, account->orders[n], &ret[n]);
+    }
+
+    return ret;
+}
+
+
+void print_orders_of_account (BOOK * book, ORDER_SNAPSHOT * snapshots, int count, OUTBUF * out)
+{
+    int flag;
+    int n;
+
+    out_printf(out, "{\"ok\": true, \"venue\": \"%s\", \"orders\": [", book->venue);
+
+    flag = 0;
+    for (n = 0; n < count; n++)
+    {
+        if (flag) out_printf(out, ", \n");
+        print_order_snapshot(book, out, &snapshots[n]);
+        flag = 1;
+    }
+
+    out_printf(out, "]}");
+
+    return;
+}
+
+
+void respond_with_orders_of_account (WORKER * worker, BOOK * book, ACCOUNT * account)     // Includes the end_message()
+{
+    ORDER_SNAPSHOT * snapshots;
+
+    #if !defined(_WIN32)
+        OUTRECORD * record;
+    #endif
+
+    // Just copying a few ints per order, so this is quick however many there are. The
+    // slow part (formatting every order and all its fills) is for the output thread.
+
+    snapshots = snapshot_orders_of_account(book, account);
+
+    #if !defined(_WIN32)
+        if (OutputThread)
+        {
+            record = next_out_record(worker);
+            record->type = OUT_ACCOUNT_ORDERS;
+            record->book = book;
+            record->snapshot = snapshots;
+            record->count = account->count;
+            take_outbuf(&record->blob, &worker->out);
+            publish_out_record(worker);
+            return;
+        }
+    #endif
+
+    print_orders_of_account(book, snapshots, account->count, &worker->out);
+    end_message(&worker->out);
+    free(snapshots);
+    return;
+}
+
+
+void cancel_order_by_id (BOOK * book, int id)
+{
+    ORDERNODE * ordernode;
+    int price;
+    int dir;
+    LEVEL * level;
+
+    assert(id >= 0 && id <= book->highestknownorder);
+
+    if (book->allorders[id] == NULL)                    // Archived, so long since closed (see -archive)
+    {
+        return;
+    }
+
+    if (book->allorders[id]->orderType != LIMIT)          // Everything else is auto-cancelled after running
+    {
+        return;
+    }
+
+    price = book->allorders[id]->price;
+    dir = book->allorders[id]->direction;
+
+    // Find the level then the ordernode, if possible...
+
+    level = find_level(book, price, dir);
+    ordernode = find_ordernode(level, id);          // This is safe even if level == NULL
+
+    // Now close the order and do the linked-list fiddling...
+
+    if (ordernode)
+    {
+        ordernode->order->open = 0;
+        ordernode->order->qty = 0;
+
+        cleanup_after_cancel(book, ordernode, level);     // Frees the node and even the level if needed; fixes links
+
+        book_changed(book);                             // Remakes all but the "last trade" info in the quote
+    }
+
+    return;
+}
+
+
+SCORE_SNAPSHOT * snapshot_scores (BOOK * book, int * count)       // Caller frees
+{
+    SCORE_SNAPSHOT * ret;
+    ACCOUNT * account;
+    int n;
+
+    ret = malloc((book->currentaccountarraylen + 1) * sizeof(SCORE_SNAPSHOT));     // +1 so never malloc(0)
+    check_ptr_or_quit(ret);
+
+    *count = 0;
+
+    for (n = 0; n < book->currentaccountarraylen; n++)
+    {
+        if (book->allaccounts[n])
+        {
+            account = book->allaccounts[n];
+
+            ret[*count].account = account;
+            ret[*count].cents = account->cents;
+            ret[*count].shares = account->shares;
+            ret[*count].posmin = account->posmin;
+            ret[*count].posmax = account->posmax;
+            *count += 1;
+        }
+    }
+
+    return ret;
+}
+
+
+void print_scores (BOOK * book, SCORE_SNAPSHOT * scores, int count, int last, char * ts, OUTBUF * out)
+{
+    int64_t nav64;
+    int n;
+
+    out_printf(out, "<html><head><title>%s %s</title></head><body><pre>%s %s\n", book->venue, book->symbol, book->venue, book->symbol);
+
+    if (last == -1)
+    {
+        out_printf(out, "No trading activity yet.</pre>");
+        return;
+    }
+
+    out_printf(out, "Current price: $%d.%02d\n\n", last / 100, last % 100);
+
+    out_printf(out, "             Account           USD $          Shares         Pos.min         Pos.max           NAV $\n");
+
+    for (n = 0; n < count; n++)
+    {
+        // The values shares and cents are both int32, as is last, so
+        // shares * last + cents is guaranteed to fit in an int64.
+
+        nav64 = (int64_t) scores[n].shares * (int64_t) last + (int64_t) scores[n].cents;
+
+        out_printf(out, "%20s %15d %15d %15d %15d %15" PRId64 "\n",
+                scores[n].account->name, scores[n].cents / 100, scores[n].shares, scores[n].posmin, scores[n].posmax, nav64 / 100);
+    }
+
+    out_printf(out, "\n  Start time: %s\nCurrent time: %s", book->starttime, ts);
+
+    out_printf(out, "</pre></body></html>");
+
+    return;
+}
+
+
+void respond_with_scores (WORKER * worker, BOOK * book)     // Includes the end_message()
+{
+    SCORE_SNAPSHOT * scores;
+    char * ts;
+    int count;
+
+    #if !defined(_WIN32)
+        OUTRECORD * record;
+    #endif
+
+    scores = snapshot_scores(book, &count);
+    ts = new_timestamp(book);
+
+    #if !defined(_WIN32)
+        if (OutputThread)
+        {
+            record = next_out_record(worker);
+            record->type = OUT_SCORES;
+            record->book = book;
+            record->snapshot = scores;
+            record->count = count;
+            record->price = book->quote.last;
+            record->ts = ts;
+            take_outbuf(&record->blob, &worker->out);
+            publish_out_record(worker);
+            return;
+        }
+    #endif
+
+    print_scores(book, scores, count, book->quote.last, ts, &worker->out);
+    end_message(&worker->out);
+    free(scores);
+    free(ts);
+    return;
+}
+
+
+// DUMP writes the book's whole history (accounts, all orders and their fills, and the
+// current book) to a CSV file, without holding up the matching. We fork(), and the child
+// writes from its copy-on-write view of memory then exits; the parent carries on at once.
+// The child only has the one thread, which is the one that owns the book, so the book is
+// consistent. It mustn't malloc() or use stdio though (other threads may have held locks
+// at the moment of the fork), hence the DUMPFILE and write().
+
+#if !defined(_WIN32)
+
+int write_all (int fd, const char * data, size_t len)     // Returns 0 on success
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len)
+    {
+        n = write(fd, data + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+
+void close_frontend_fds (void)          // In a child
+{
+    // Close our copies of the frontend's pipes (or doorbells), so that the frontend
+    // sees EOF as usual if the parent dies while the child is still writing.
+
+    close(0);
+    close(1);
+    close(2);
+    if (ShmMode)
+    {
+        close(CommandRing.doorbell);
+        close(ResponseRing.doorbell);
+        close(EventRing.doorbell);
+    }
+    return;
+}
+
+
+void dump_flush (DUMPFILE * df)
+{
+    if (df->failed == 0 && write_all(df->fd, df->data, df->len) != 0)
+    {
+        df->failed = 1;
+    }
+
+    df->len = 0;
+    return;
+}
+
+
+uint32_t checksum_bytes (uint32_t sum, const void * data, size_t n)     // FNV-1a; start with CHECKSUM_START
+{
+    const unsigned char * p = data;
+    size_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        sum = (sum ^ p[i]) * 16777619u;
+    }
+    return sum;
+}
+
+
+void dump_write (DUMPFILE * df, const void * data, size_t n)      // n must be small
+{
+    if (DUMPBUFFERSIZE - df->len < n) dump_flush(df);
+
+    df->checksum = checksum_bytes(df->checksum, data, n);
+
+    memcpy(df->data + df->len, data, n);
+    df->len += n;
+    return;
+}
+
+
+void dump_printf (DUMPFILE * df, const char * format, ...)     // Lines must be under MAXSTRING
+{
+    va_list args;
+    int n;
+
+    if (DUMPBUFFERSIZE - df->len < MAXSTRING) dump_flush(df);
+
+    va_start(args, format);
+    n = vsnprintf(df->data + df->len, MAXSTRING, format, args);
+    va_end(args);
+
+    if (n > 0) df->len += (n < MAXSTRING ? n : MAXSTRING - 1);
+    return;
+}
+
+
+int write_dump (BOOK * book, int fd, DUMP_PROGRESS * progress, char * ts)     // In the child. Returns 0 on success
+{
+    DUMPFILE df;
+    ACCOUNT * account;
+    ORDER * order;
+    ARCHIVED_ORDER * archived;
+    FILLNODE * fillnode;
+    LEVEL * level;
+    ORDERNODE * ordernode;
+    int i;
+    int n;
+
+    df.fd = fd;
+    df.failed = 0;
+    df.len = 0;
+
+    dump_printf(&df, "# disorderBook dump of %s %s, started %s, dumped %s\n", book->venue, book->symbol, book->starttime, ts);
+
+    dump_printf(&df, "# quote,bid,ask,last,lastSize,lastTrade\n");
+    dump_printf(&df, "quote,%d,%d,%d,%d,%s\n", book->quote.bid, book->quote.ask, book->quote.last, book->quote.lastSize, book->quote.lastTrade);
+
+    dump_printf(&df, "# account,id,name,cents,shares,posmin,posmax\n");
+    for (n = 0; n < book->currentaccountarraylen; n++)
+    {
+        account = book->allaccounts[n];
+        if (account)
+        {
+            dump_printf(&df, "account,%d,%s,%d,%d,%d,%d\n", n, account->name, account->cents, account->shares, account->posmin, account->posmax);
+        }
+    }
+
+    dump_printf(&df, "# order,id,account,direction,orderType,originalQty,qty,price,totalFilled,open,ts\n");
+    dump_printf(&df, "# fill,order,price,qty,ts\n");
+    for (n = 0; n <= book->highestknownorder; n++)
+    {
+        order = book->allorders[n];
+        if (order)
+        {
+            dump_printf(&df, "order,%d,%s,%s,%s,%d,%d,%d,%d,%d,%s\n", order->id, order->account->name, order->direction == BUY ? "buy" : "sell",
+                    order_type_name(order->orderType), order->originalQty, order->qty, order->price, order->totalFilled, order->open, order->ts);
+
+            for (fillnode = order->firstfillnode; fillnode != NULL; fillnode = fillnode->next)
+            {
+                dump_printf(&df, "fill,%d,%d,%d,%s\n", order->id, fillnode->fill->price, fillnode->fill->qty, fillnode->fill->ts);
+            }
+        } else if ((archived = archived_order(book, n)) != NULL) {
+            dump_printf(&df, "order,%d,%s,%s,%s,%d,%d,%d,%d,%d,%s\n", archived->id, archived->account->name, archived->direction == BUY ? "buy" : "sell",
+                    order_type_name(archived->orderType), archived->originalQty, archived->qty, archived->price, archived->totalFilled, 0, archived->ts);
+
+            for (i = 0; i < archived->fillcount; i++)
+            {
+                dump_printf(&df, "fill,%d,%d,%d,%s\n", archived->id, archived->fills[i].price, archived->fills[i].qty, archived->fills[i].ts);
+            }
+        }
+
+        if (n % 1024 == 1023) atomic_store(&progress->ordersdone, n + 1);
+    }
+    atomic_store(&progress->ordersdone, book->highestknownorder + 1);
+
+    dump_printf(&df, "# book,side,price,order,qty  (best first, then in time priority)\n");
+    for (i = 0; i < 2; i++)
+    {
+        for (level = (i == 0 ? book->firstbidlevel : book->firstasklevel); level != NULL; level = level->next)
+        {
+            for (ordernode = level->firstordernode; ordernode != NULL; ordernode = ordernode->next)
+            {
+                dump_printf(&df, "book,%s,%d,%d,%d\n", i == 0 ? "bid" : "ask", level->price, ordernode->order->id, ordernode->order->qty);
+            }
+        }
+    }
+
+    dump_flush(&df);
+
+    if (close(fd) != 0) df.failed = 1;
+    return df.failed;
+}
+
+
+void update_dumps (BOOK * book)        // Collects any finished child processes
+{
+    DUMP * dump;
+    int status;
+    int n;
+
+    for (n = 0; n < book->dumpcount; n++)
+    {
+        dump = &book->dumps[n];
+
+        if (dump->state == DUMP_RUNNING && waitpid(dump->pid, &status, WNOHANG) == dump->pid)
+        {
+            dump->state = (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? DUMP_DONE : DUMP_FAILED;
+            dump->ordersdone = atomic_load(&dump->progress->ordersdone);
+            munmap(dump->progress, sizeof(DUMP_PROGRESS));
+            dump->progress = NULL;
+        }
+    }
+    return;
+}
+
+
+void print_dump (BOOK * book, int n, OUTBUF * out)
+{
+    DUMP * dump = &book->dumps[n];
+
+    out_printf(out, "{\"dump\": %d, \"file\": \"%s\", \"state\": \"%s\", \"orders\": %" PRId64 ", \"ordersDone\": %" PRId64 "}",
+            n, dump->filename, dump->state == DUMP_RUNNING ? "running" : (dump->state == DUMP_DONE ? "done" : "failed"),
+            dump->orders, dump->progress ? atomic_load(&dump->progress->ordersdone) : dump->ordersdone);
+    return;
+}
+
+
+void start_dump (BOOK * book, char * dir, OUTBUF * out)
+{
+    DUMP * dump;
+    DUMP_PROGRESS * progress;
+    char filename[MAXSTRING];
+    char * ts;
+    int fd;
+    pid_t pid;
+
+    update_dumps(book);
+
+    snprintf(filename, MAXSTRING, "%s/%s-%s-%" PRId64 "-%d.csv", dir, book->venue, book->symbol, (int64_t) time(NULL), book->dumpcount);
+
+    // Make the file here rather than in the child, so that we can report failure directly...
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+    {
+        out_printf(out, "{\"ok\": false, \"error\": \"Couldn't create dump file %s\"}", filename);
+        return;
+    }
+
+    progress = mmap(NULL, sizeof(DUMP_PROGRESS), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (progress == MAP_FAILED)
+    {
+        close(fd);
+        unlink(filename);
+        out_printf(out, "{\"ok\": false, \"error\": \"Couldn't map memory for dump progress\"}");
+        return;
+    }
+    atomic_init(&progress->ordersdone, 0);
+
+    ts = new_timestamp(book);       // Can't do this in the child (it mallocs)
+
+    pid = fork();
+
+    if (pid == 0)
+    {
+        close_frontend_fds();
+        _exit(write_dump(book, fd, progress, ts));      // _exit(), not exit(), so as not to flush the parent's stdio
+    }
+
+    free(ts);
+    close(fd);
+
+    if (pid < 0)
+    {
+        munmap(progress, sizeof(DUMP_PROGRESS));
+        unlink(filename);
+        out_printf(out, "{\"ok\": false, \"error\": \"Couldn't fork for dump\"}");
+        return;
+    }
+
+    book->dumps = realloc(book->dumps, (book->dumpcount + 1) * sizeof(DUMP));
+    check_ptr_or_quit(book->dumps);
+
+    dump = &book->dumps[book->dumpcount];
+    safe_strcpy(dump->filename, filename, MAXSTRING);
+    dump->pid = pid;
+    dump->state = DUMP_RUNNING;
+    dump->orders = book->highestknownorder + 1;
+    dump->ordersdone = 0;
+    dump->progress = progress;
+    book->dumpcount += 1;
+
+    out_printf(out, "{\"ok\": true, \"venue\": \"%s\", \"symbol\": \"%s\", \"dump\": ", book->venue, book->symbol);
+    print_dump(book, book->dumpcount - 1, out);
+    out_printf(out, "}");
+    return;
+}
+
+
+void print_dump_status (BOOK * book, OUTBUF * out)
+{
+    int n;
+
+    update_dumps(book);
+
+    out_printf(out, "{\"ok\": true, \"venue\": \"%s\", \"symbol\": \"%s\", \"dumps\": [", book->venue, book->symbol);
+    for (n = 0; n < book->dumpcount; n++)
+    {
+        if (n > 0) out_printf(out, ", ");
+        print_dump(book, n, out);
+    }
+    out_printf(out, "]}");
+    return;
+}
+
+#endif
+
+
+// Journaling (-journal <dir>, POSIX only). Each book has a journal of its own, <dir>/<venue>-<symbol>.journal,
+// so it doesn't matter which backend or book id the book gets next time. Every ORDER and CANCEL is
+// recorded before it is run, along with the clock. That's all it takes to rebuild the book exactly,
+// since the matching is deterministic and replay puts the clock back before each command, so even
+// the timestamps come out the same.
+//
+// Records are buffered per book. The owning worker writes and fsync()s them all in one go when it
+// runs out of commands, or every JOURNAL_SYNC_MS under constant load (group commit). Responses don't
+// wait for this, so a crash can lose the last few ms of commands even though they were answered.
+//
+// So that restarts don't take longer and longer, a book can also be snapshotted to a binary file,
+// <dir>/<venue>-<symbol>.snapshot. Like DUMP, this is done by a forked child, so trading carries on.
+// Once the snapshot is safely on disk, the journal is rewritten without the records it covers.
+// At startup the book loads its snapshot, then replays just the journal records after it.
+
+#if !defined(_WIN32)
+
+void journal_quit (BOOK * book, char * what)
+{
+    printf("{\"ok\": false, \"error\": \"%s %s %s! Quitting\"}\nEND\n", what, book->venue, book->symbol);
+    fflush(stdout);
+    exit(1);
+}
+
+
+void journal_filename (BOOK * book, char * extension, char * dest)     // dest must be MAXSTRING long
+{
+    snprintf(dest, MAXSTRING, "%s/%s-%s.%s", JournalDir, book->venue, book->symbol, extension);
+    return;
+}
+
+
+void sync_dir (void)                    // Makes renames and new files in the journal directory durable
+{
+    int fd;
+
+    fd = open(JournalDir, O_RDONLY);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        close(fd);
+    }
+    return;
+}
+
+
+void journal_record (BOOK * book, JOURNAL_RECORD * record, char * name)
+{
+    record->clocksecond = book->clocksecond;        // The clock is pinned, and nothing has been timestamped
+    record->clockmicro = book->clockmicro;          // yet, so this is the clock as the command started
+
+    if (book->journal.len == 0) book->worker->dirtyjournals++;
+
+    out_write(&book->journal, record, sizeof(JOURNAL_RECORD));
+    if (record->namelen > 0) out_write(&book->journal, name, record->namelen);
+
+    book->journalseq++;
+    book->journalbytes += sizeof(JOURNAL_RECORD) + record->namelen;
+    return;
+}
+
+
+void journal_order (BOOK * book, char * account_name, int account_int, int qty, int price, int direction, int orderType)
+{
+    JOURNAL_RECORD record;
+
+    if (book->journalfd < 0) return;
+
+    memset(&record, 0, sizeof(JOURNAL_RECORD));
+    record.type = JOURNAL_ORDER;
+    record.id = account_int;
+    record.qty = qty;
+    record.price = price;
+    record.direction = direction;
+    record.orderType = orderType;
+
+    // Only the order that creates an account needs to carry the name...
+
+    if (book->journalnames || account_int < 0 || account_int >= book->currentaccountarraylen || book->allaccounts[account_int] == NULL)
+    {
+        record.namelen = (int32_t) strlen(account_name);
+    }
+
+    journal_record(book, &record, account_name);
+    return;
+}
+
+
+void journal_cancel (BOOK * book, int id)
+{
+    JOURNAL_RECORD record;
+
+    if (book->journalfd < 0) return;
+
+    memset(&record, 0, sizeof(JOURNAL_RECORD));
+    record.type = JOURNAL_CANCEL;
+    record.id = id;
+
+    journal_record(book, &record, NULL);
+    return;
+}
+
+
+void write_journal (BOOK * book)
+{
+    if (write_all(book->journalfd, book->journal.data, book->journal.len) != 0) journal_quit(book, "Couldn't write journal for");
+    if (fsync(book->journalfd) != 0) journal_quit(book, "Couldn't sync journal for");
+
+    book->journal.len = 0;
+    return;
+}
+
+
+void sync_journals (WORKER * worker)
+{
+    int n;
+
+    if (worker->dirtyjournals == 0) return;
+
+    for (n = 0; n < worker->bookcount; n++)
+    {
+        if (worker->books[n]->journal.len > 0)
+        {
+            write_journal(worker->books[n]);
+        }
+    }
+
+    worker->dirtyjournals = 0;
+    worker->lastjournalsyncms = monotonic_ms();
+    return;
+}
+
+
+void maybe_sync_journals (WORKER * worker, int idle)      // Called after every command
+{
+    if (worker->dirtyjournals == 0) return;
+
+    if (idle || monotonic_ms() - worker->lastjournalsyncms >= JOURNAL_SYNC_MS)
+    {
+        sync_journals(worker);
+    }
+    return;
+}
+
+
+int write_snapshot (BOOK * book, int fd, char * tmpname, char * filename, int64_t commands)     // In the child. Returns 0 on success
+{
+    DUMPFILE df;
+    SNAPSHOT_HEADER header;
+    SNAPSHOT_ACCOUNT sa;
+    SNAPSHOT_FILL sf;
+    SNAPSHOT_ORDER so;
+    ACCOUNT * account;
+    ORDER * order;
+    ARCHIVED_ORDER * archived;
+    FILL * fill;
+    FILLNODE * fillnode;
+    LEVEL * level;
+    ORDERNODE * ordernode;
+    unsigned char * written;
+    size_t bitmapsize;
+    int32_t n32[2];
+    uint32_t checksum;
+    int i;
+    int n;
+
+    df.fd = fd;
+    df.failed = 0;
+    df.len = 0;
+    df.checksum = CHECKSUM_START;
+
+    // Every fill belongs to two orders but is written once; this has a bit for each. It comes
+    // from mmap() because the child mustn't malloc() (see above).
+
+    bitmapsize = (size_t) book->debuginfo.inits_of_fill / 8 + 1;
+    written = mmap(NULL, bitmapsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (written == MAP_FAILED) return 1;
+
+    memset(&header, 0, sizeof(SNAPSHOT_HEADER));
+    safe_strcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    safe_strcpy(header.venue, book->venue, SMALLSTRING);
+    safe_strcpy(header.symbol, book->symbol, SMALLSTRING);
+    safe_strcpy(header.starttime, book->starttime, SMALLSTRING);
+    header.commands = commands;
+    header.nextid = book->nextid;
+    header.fills = book->debuginfo.inits_of_fill;
+    header.quote = book->quote;
+    header.debuginfo = book->debuginfo;
+
+    for (n = 0; n < book->currentaccountarraylen; n++)
+    {
+        if (book->allaccounts[n]) header.accounts++;
+    }
+    for (n = 0; n <= book->highestknownorder; n++)
+    {
+        if (order_exists(book, n)) header.orders++;
+    }
+
+    dump_write(&df, &header, sizeof(SNAPSHOT_HEADER));
+
+    for (n = 0; n < book->currentaccountarraylen; n++)
+    {
+        account = book->allaccounts[n];
+        if (account)
+        {
+            memset(&sa, 0, sizeof(SNAPSHOT_ACCOUNT));
+            sa.id = account->id;
+            sa.posmin = account->posmin;
+            sa.posmax = account->posmax;
+            sa.shares = account->shares;
+            sa.cents = account->cents;
+            safe_strcpy(sa.name, account->name, SMALLSTRING);
+            dump_write(&df, &sa, sizeof(SNAPSHOT_ACCOUNT));
+        }
+    }
+
+    for (n = 0; n <= book->highestknownorder; n++)
+    {
+        if (book->allorders[n] != NULL)
+        {
+            for (fillnode = book->allorders[n]->firstfillnode; fillnode != NULL; fillnode = fillnode->next)
+            {
+                fill = fillnode->fill;
+                if ((written[fill->id / 8] & (1 << (fill->id % 8))) == 0)
+                {
+                    written[fill->id / 8] |= (1 << (fill->id % 8));
+                    sf.id = fill->id;
+                    sf.price = fill->price;
+                    sf.qty = fill->qty;
+                    sf.tslen = (int32_t) strlen(fill->ts);
+                    dump_write(&df, &sf, sizeof(SNAPSHOT_FILL));
+                    dump_write(&df, fill->ts, sf.tslen);
+                }
+            }
+        } else if ((archived = archived_order(book, n)) != NULL) {
+            for (i = 0; i < archived->fillcount; i++)
+            {
+                sf.id = archived->fills[i].id;
+                if ((written[sf.id / 8] & (1 << (sf.id % 8))) == 0)
+                {
+                    written[sf.id / 8] |= (1 << (sf.id % 8));
+                    sf.price = archived->fills[i].price;
+                    sf.qty = archived->fills[i].qty;
+                    sf.tslen = (int32_t) strlen(archived->fills[i].ts);
+                    dump_write(&df, &sf, sizeof(SNAPSHOT_FILL));
+                    dump_write(&df, archived->fills[i].ts, sf.tslen);
+                }
+            }
+        }
+    }
+
+    munmap(written, bitmapsize);
+
+    for (n = 0; n <= book->highestknownorder; n++)
+    {
+        order = book->allorders[n];
+
+        if (order == NULL)
+        {
+            archived = archived_order(book, n);
+            if (archived == NULL) continue;
+
+            so.id = archived->id;
+            so.account = archived->account->id;
+            so.direction = archived->direction;
+            so.originalQty = archived->originalQty;
+            so.qty = archived->qty;
+            so.price = archived->price;
+            so.orderType = archived->orderType;
+            so.totalFilled = archived->totalFilled;
+            so.open = 0;
+            so.fillcount = archived->fillcount;
+            so.tslen = (int32_t) strlen(archived->ts);
+            dump_write(&df, &so, sizeof(SNAPSHOT_ORDER));
+            dump_write(&df, archived->ts, so.tslen);
+
+            for (i = 0; i < archived->fillcount; i++)
+            {
+                dump_write(&df, &archived->fills[i].id, sizeof(int32_t));
+            }
+            continue;
+        }
+
+        so.id = order->id;
+        so.account = order->account->id;
+        so.direction = order->direction;
+        so.originalQty = order->originalQty;
+        so.qty = order->qty;
+        so.price = order->price;
+        so.orderType = order->orderType;
+        so.totalFilled = order->totalFilled;
+        so.open = order->open;
+        so.fillcount = order->fillcount;
+        so.tslen = (int32_t) strlen(order->ts);
+        dump_write(&df, &so, sizeof(SNAPSHOT_ORDER));
+        dump_write(&df, order->ts, so.tslen);
+
+        for (fillnode = order->firstfillnode; fillnode != NULL; fillnode = fillnode->next)
+        {
+            dump_write(&df, &fillnode->fill->id, sizeof(int32_t));
+        }
+    }
+
+    for (i = 0; i < 2; i++)
+    {
+        n32[0] = 0;
+        for (level = (i == 0 ? book->firstbidlevel : book->firstasklevel); level != NULL; level = level->next)
+        {
+            n32[0]++;
+        }
+        dump_write(&df, n32, sizeof(int32_t));
+
+        for (level = (i == 0 ? book->firstbidlevel : book->firstasklevel); level != NULL; level = level->next)
+        {
+            n32[0] = level->price;
+            n32[1] = 0;
+            for (ordernode = level->firstordernode; ordernode != NULL; ordernode = ordernode->next)
+            {
+                n32[1]++;
+            }
+            dump_write(&df, n32, 2 * sizeof(int32_t));
+
+            for (ordernode = level->firstordernode; ordernode != NULL; ordernode = ordernode->next)
+            {
+                dump_write(&df, &ordernode->order->id, sizeof(int32_t));
+            }
+        }
+    }
+
+    dump_write(&df, SNAPSHOT_END, 8);
+    checksum = df.checksum;
+    dump_write(&df, &checksum, sizeof(uint32_t));
+    dump_flush(&df);
+
+    // Only replace the last snapshot once this one is safely on disk...
+
+    if (df.failed || fsync(fd) != 0 || close(fd) != 0 || rename(tmpname, filename) != 0)
+    {
+        return 1;
+    }
+    sync_dir();
+    return 0;
+}
+
+
+void print_snapshot_status (BOOK * book, OUTBUF * out)
+{
+    char * state;
+
+    switch (book->snapshotstate)
+    {
+        case DUMP_RUNNING: state = "running"; break;
+        case DUMP_DONE: state = "done"; break;
+        case DUMP_FAILED: state = "failed"; break;
+        default: state = "none";
+    }
+
+    out_printf(out, "{\"ok\": true, \"venue\": \"%s\", \"symbol\": \"%s\", \"snapshot\": {\"state\": \"%s\", "
+                    "\"commands\": %" PRId64 ", \"journalCommands\": %" PRId64 "}}",
+            book->venue, book->symbol, state, book->snapshotseq, book->journalseq);
+    return;
+}
+
+
+void start_snapshot (BOOK * book, OUTBUF * out)         // out is NULL for an automatic one (see -snapshotevery)
+{
+    char filename[MAXSTRING];
+    char tmpname[MAXSTRING];
+    int fd;
+    pid_t pid;
+
+    if (book->snapshotpid != 0)
+    {
+        if (out) out_printf(out, "{\"ok\": false, \"error\": \"A snapshot is already being made\"}");
+        return;
+    }
+
+    journal_filename(book, "snapshot", filename);
+    journal_filename(book, "snapshot.tmp", tmpname);
+
+    book->snapshotstartseq = book->journalseq;
+
+    fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    pid = fd < 0 ? -1 : fork();
+
+    if (pid == 0)
+    {
+        close_frontend_fds();
+        _exit(write_snapshot(book, fd, tmpname, filename, book->journalseq));
+    }
+
+    if (fd >= 0) close(fd);
+
+    if (pid < 0)
+    {
+        book->snapshotstate = DUMP_FAILED;
+        if (out) out_printf(out, "{\"ok\": false, \"error\": \"Couldn't start a snapshot\"}");
+        return;
+    }
+
+    book->snapshotpid = pid;
+    book->snapshotstate = DUMP_RUNNING;
+    book->snapshotoffset = book->journalbytes;
+
+    if (out) print_snapshot_status(book, out);
+    return;
+}
+
+
+void truncate_journal (BOOK * book)     // Rewrites the journal without the records that the latest snapshot has
+{
+    JOURNAL_HEADER header;
+    char filename[MAXSTRING];
+    char tmpname[MAXSTRING];
+    char * buf;
+    off_t offset;
+    ssize_t n;
+    int fd;
+
+    write_journal(book);                // So that the file has everything
+
+    journal_filename(book, "journal", filename);
+    journal_filename(book, "journal.tmp", tmpname);
+
+    if (pread(book->journalfd, &header, sizeof(JOURNAL_HEADER), 0) != sizeof(JOURNAL_HEADER))
+    {
+        journal_quit(book, "Couldn't read journal for");
+    }
+    header.firstrecord = book->snapshotseq;
+
+    fd = open(tmpname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write_all(fd, (char *) &header, sizeof(JOURNAL_HEADER)) != 0)
+    {
+        journal_quit(book, "Couldn't rewrite journal for");
+    }
+
+    buf = malloc(JOURNALREADSIZE);
+    check_ptr_or_quit(buf);
+
+    offset = book->snapshotoffset;
+    while ((n = pread(book->journalfd, buf, JOURNALREADSIZE, offset)) > 0)
+    {
+        if (write_all(fd, buf, n) != 0) journal_quit(book, "Couldn't rewrite journal for");
+        offset += n;
+    }
+    free(buf);
+
+    if (n < 0 || fsync(fd) != 0 || rename(tmpname, filename) != 0)
+    {
+        journal_quit(book, "Couldn't rewrite journal for");
+    }
+    sync_dir();
+
+    close(book->journalfd);
+    book->journalfd = fd;
+    book->journalbytes = sizeof(JOURNAL_HEADER) + (book->journalbytes - book->snapshotoffset);
+    return;
+}
+
+
+void update_snapshot (BOOK * book)      // Collects the snapshot's child if it has finished
+{
+    int status;
+
+    if (book->snapshotpid == 0 || waitpid(book->snapshotpid, &status, WNOHANG) != book->snapshotpid)
+    {
+        return;
+    }
+
+    book->snapshotpid = 0;
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+    {
+        book->snapshotstate = DUMP_DONE;
+        book->snapshotseq = book->snapshotstartseq;
+        truncate_journal(book);
+    } else {
+        book->snapshotstate = DUMP_FAILED;
+    }
+    return;
+}
+
+
+void maybe_snapshot (BOOK * book)       // Called after every command to the book
+{
+    int64_t now;
+
+    if (book->journalfd < 0) return;
+
+    if (book->snapshotpid != 0)
+    {
+        now = monotonic_ms();
+        if (now - book->lastsnapshotcheckms >= SNAPSHOT_CHECK_MS)
+        {
+            book->lastsnapshotcheckms = now;
+            update_snapshot(book);
+        }
+        return;
+    }
+
+    if (SnapshotEvery > 0 && book->journalseq - book->snapshotstartseq >= SnapshotEvery)
+    {
+        start_snapshot(book, NULL);
+    }
+    return;
+}
+
+
+void init_reader (FILEREADER * reader, int fd)
+{
+    reader->fd = fd;
+    reader->buf = malloc(JOURNALREADSIZE);
+    check_ptr_or_quit(reader->buf);
+    reader->start = 0;
+    reader->end = 0;
+    reader->eof = 0;
+    reader->checksum = CHECKSUM_START;
+    return;
+}
+
+
+int read_bytes (FILEREADER * reader, void * dest, size_t n)      // Returns 0 if the file ends (or fails) first. n must be small
+{
+    ssize_t got;
+
+    while (reader->end - reader->start < n && reader->eof == 0)
+    {
+        memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+
+        got = read(reader->fd, reader->buf + reader->end, JOURNALREADSIZE - reader->end);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0) reader->eof = -1;
+        if (got == 0) reader->eof = 1;
+        if (got > 0) reader->end += got;
+    }
+
+    if (reader->end - reader->start < n) return 0;
+
+    memcpy(dest, reader->buf + reader->start, n);
+    reader->start += n;
+    reader->checksum = checksum_bytes(reader->checksum, dest, n);
+    return 1;
+}
+
+
+void load_account_map (ACCOUNTMAP * map)
+{
+    FILE * f;
+    char filename[MAXSTRING];
+    char line[MAXSTRING];
+    char name[SMALLSTRING];
+    int n;
+
+    // The frontend keeps JournalDir/accounts, a "name int" line for each account, with the ints
+    // running 0, 1, 2... and it's the only writer. Anything after the last good line is ignored.
+
+    memset(map, 0, sizeof(ACCOUNTMAP));
+
+    map->remap = malloc(MAXACCOUNTS * sizeof(int));
+    check_ptr_or_quit(map->remap);
+    for (n = 0; n < MAXACCOUNTS; n++)
+    {
+        map->remap[n] = -1;
+    }
+
+    snprintf(filename, MAXSTRING, "%s/accounts", JournalDir);
+
+    f = fopen(filename, "r");
+    if (f == NULL) return;
+
+    map->present = 1;
+    map->names = malloc(MAXACCOUNTS * SMALLSTRING);
+    check_ptr_or_quit(map->names);
+
+    while (map->count < MAXACCOUNTS && fgets(line, MAXSTRING, f) != NULL)
+    {
+        if (strchr(line, '\n') == NULL || sscanf(line, "%63s %d", name, &n) != 2 || n != map->count) break;
+        safe_strcpy(map->names[map->count], name, SMALLSTRING);
+        map->count++;
+    }
+
+    fclose(f);
+    return;
+}
+
+
+void free_account_map (ACCOUNTMAP * map)
+{
+    free(map->names);
+    free(map->remap);
+    return;
+}
+
+
+int map_account (BOOK * book, ACCOUNTMAP * map, char * name, int stored)   // Returns the int the account has now
+{
+    int n;
+
+    if (map->present == 0 || stored < 0 || stored >= MAXACCOUNTS) return stored;
+
+    // Usually the same as last time...
+
+    n = map->remap[stored];
+    if (n >= 0 && n < book->currentaccountarraylen && book->allaccounts[n] != NULL && strcmp(book->allaccounts[n]->name, name) == 0)
+    {
+        return n;
+    }
+
+    // The frontend's int for it; or, for a name it doesn't know (a journal from before the
+    // accounts file), the same account if it's already loaded, or else a free int from the
+    // top, well away from any the frontend will hand out.
+
+    for (n = 0; n < map->count; n++)
+    {
+        if (strcmp(map->names[n], name) == 0) break;
+    }
+
+    if (n == map->count)
+    {
+        for (n = 0; n < book->currentaccountarraylen; n++)
+        {
+            if (book->allaccounts[n] != NULL && strcmp(book->allaccounts[n]->name, name) == 0) break;
+        }
+        if (n == book->currentaccountarraylen)
+        {
+            for (n = MAXACCOUNTS - 1; n > map->count; n--)
+            {
+                if (n >= book->currentaccountarraylen || book->allaccounts[n] == NULL) break;
+            }
+        }
+    }
+
+    if (n != stored) map->changed = 1;
+    map->remap[stored] = n;
+    return n;
+}
+
+
+int load_snapshot (BOOK * book, ACCOUNTMAP * map)       // Returns 0 if there isn't one
+{
+    SNAPSHOT_HEADER header;
+    SNAPSHOT_ACCOUNT sa;
+    SNAPSHOT_FILL sf;
+    SNAPSHOT_ORDER so;
+    FILEREADER reader;
+    ACCOUNT * account;
+    ORDER * order;
+    FILL ** fills;
+    FILLNODE * fillnode;
+    LEVEL * level;
+    LEVEL * prev_level;
+    ORDERNODE * ordernode;
+    char filename[MAXSTRING];
+    char end[8];
+    char * ts;
+    int32_t n32[2];
+    int32_t id;
+    uint32_t checksum;
+    uint32_t expected;
+    int i;
+    int j;
+    int n;
+    int fd;
+
+    journal_filename(book, "snapshot", filename);
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        if (errno == ENOENT) return 0;
+        journal_quit(book, "Couldn't open snapshot for");
+    }
+
+    init_reader(&reader, fd);
+
+    if (read_bytes(&reader, &header, sizeof(SNAPSHOT_HEADER)) == 0) journal_quit(book, "Bad snapshot for");
+
+    header.magic[sizeof(header.magic) - 1] = '\0';
+    header.venue[SMALLSTRING - 1] = '\0';
+    header.symbol[SMALLSTRING - 1] = '\0';
+    header.starttime[SMALLSTRING - 1] = '\0';
+
+    if (strcmp(header.magic, SNAPSHOT_MAGIC) || strcmp(header.venue, book->venue) || strcmp(header.symbol, book->symbol) || header.fills < 0)
+    {
+        journal_quit(book, "Bad snapshot for");
+    }
+
+    // Accounts...
+
+    for (n = 0; n < header.accounts; n++)
+    {
+        if (read_bytes(&reader, &sa, sizeof(SNAPSHOT_ACCOUNT)) == 0 || sa.id < 0 || sa.id >= MAXACCOUNTS) journal_quit(book, "Bad snapshot for");
+
+        sa.name[SMALLSTRING - 1] = '\0';
+        account = account_lookup_or_create(book, sa.name, map_account(book, map, sa.name, sa.id));
+        account->posmin = sa.posmin;
+        account->posmax = sa.posmax;
+        account->shares = sa.shares;
+        account->cents = sa.cents;
+    }
+
+    // Fills, which the orders refer to by id...
+
+    fills = calloc((size_t) header.fills + 1, sizeof(FILL *));
+    check_ptr_or_quit(fills);
+
+    for (n = 0; n < header.fills; n++)
+    {
+        if (read_bytes(&reader, &sf, sizeof(SNAPSHOT_FILL)) == 0 || sf.id < 0 || sf.id >= header.fills || fills[sf.id] != NULL
+                || sf.tslen < 0 || sf.tslen >= SMALLSTRING)
+        {
+            journal_quit(book, "Bad snapshot for");
+        }
+
+        ts = malloc(SMALLSTRING);
+        check_ptr_or_quit(ts);
+        if (read_bytes(&reader, ts, sf.tslen) == 0) journal_quit(book, "Bad snapshot for");
+        ts[sf.tslen] = '\0';
+
+        fills[sf.id] = init_fill(book, sf.price, sf.qty, ts);
+        fills[sf.id]->id = sf.id;
+    }
+
+    // Orders, in id order, so they go into their accounts in the right order too...
+
+    for (n = 0; n < header.orders; n++)
+    {
+        if (read_bytes(&reader, &so, sizeof(SNAPSHOT_ORDER)) == 0 || so.id <= book->highestknownorder || so.id >= MAXORDERS
+                || so.account < 0 || so.account >= MAXACCOUNTS) journal_quit(book, "Bad snapshot for");
+
+        if (map->present) so.account = map->remap[so.account];
+
+        if (so.account < 0 || so.account >= book->currentaccountarraylen || book->allaccounts[so.account] == NULL
+                || so.tslen < 0 || so.tslen >= SMALLSTRING || so.fillcount < 0)
+        {
+            journal_quit(book, "Bad snapshot for");
+        }
+
+        ts = malloc(SMALLSTRING);
+        check_ptr_or_quit(ts);
+        if (read_bytes(&reader, ts, so.tslen) == 0) journal_quit(book, "Bad snapshot for");
+        ts[so.tslen] = '\0';
+
+        account = book->allaccounts[so.account];
+        order = init_order(book, account, so.originalQty, so.price, so.direction, so.orderType, so.id, ts);
+        order->qty = so.qty;
+        order->totalFilled = so.totalFilled;
+        order->open = so.open;
+        order->fillcount = so.fillcount;
+        add_order_to_account(book, order, account);
+
+        fillnode = NULL;
+        for (j = 0; j < so.fillcount; j++)
+        {
+            if (read_bytes(&reader, &id, sizeof(int32_t)) == 0 || id < 0 || id >= header.fills || fills[id] == NULL)
+            {
+                journal_quit(book, "Bad snapshot for");
+            }
+
+            if (fillnode == NULL)
+            {
+                order->firstfillnode = init_fillnode(book, fills[id], NULL, NULL);
+                fillnode = order->firstfillnode;
+            } else {
+                fillnode->next = init_fillnode(book, fills[id], fillnode, NULL);
+                fillnode = fillnode->next;
+            }
+        }
+    }
+
+    free(fills);
+
+    // The bids, then the asks...
+
+    for (i = 0; i < 2; i++)
+    {
+        if (read_bytes(&reader, n32, sizeof(int32_t)) == 0) journal_quit(book, "Bad snapshot for");
+
+        prev_level = NULL;
+
+        for (n = n32[0]; n > 0; n--)
+        {
+            if (read_bytes(&reader, n32, 2 * sizeof(int32_t)) == 0 || n32[1] < 1) journal_quit(book, "Bad snapshot for");
+
+            level = init_level(book, n32[0], NULL, prev_level, NULL);
+            if (prev_level)
+            {
+                prev_level->next = level;
+            } else if (i == 0) {
+                book->firstbidlevel = level;
+            } else {
+                book->firstasklevel = level;
+            }
+
+            ordernode = NULL;
+            for (j = 0; j < n32[1]; j++)
+            {
+                if (read_bytes(&reader, &id, sizeof(int32_t)) == 0 || id < 0 || id > book->highestknownorder || book->allorders[id] == NULL)
+                {
+                    journal_quit(book, "Bad snapshot for");
+                }
+
+                if (ordernode == NULL)
+                {
+                    level->firstordernode = init_ordernode(book, book->allorders[id], NULL, NULL);
+                    ordernode = level->firstordernode;
+                } else {
+                    ordernode->next = init_ordernode(book, book->allorders[id], ordernode, NULL);
+                    ordernode = ordernode->next;
+                }
+            }
+
+            prev_level = level;
+        }
+    }
+
+    if (read_bytes(&reader, end, 8) == 0 || memcmp(end, SNAPSHOT_END, 8) != 0) journal_quit(book, "Bad snapshot for");
+
+    expected = reader.checksum;
+    if (read_bytes(&reader, &checksum, sizeof(uint32_t)) == 0 || checksum != expected) journal_quit(book, "Bad snapshot for");
+
+    free(reader.buf);
+    close(fd);
+
+    safe_strcpy(book->starttime, header.starttime, SMALLSTRING);
+    book->nextid = header.nextid;
+    book->quote = header.quote;
+    book->debuginfo = header.debuginfo;
+    book->version++;
+
+    book->journalseq = header.commands;
+    book->snapshotseq = header.commands;
+    book->snapshotstartseq = header.commands;
+    return 1;
+}
+
+
+off_t replay_journal (BOOK * book, FILEREADER * reader, ACCOUNTMAP * map)   // Returns where the last whole record ends; anything after is junk from a crash
+{
+    JOURNAL_RECORD record;
+    ORDER_AND_ERROR * o_and_e;
+    char name[SMALLSTRING];
+    off_t good = sizeof(JOURNAL_HEADER);
+
+    while (read_bytes(reader, &record, sizeof(JOURNAL_RECORD)))
+    {
+        if (record.type == JOURNAL_ORDER && record.namelen >= 0 && record.namelen < SMALLSTRING)
+        {
+            if (read_bytes(reader, name, record.namelen) == 0) break;
+            name[record.namelen] = '\0';
+        } else if (record.type != JOURNAL_CANCEL || record.namelen != 0) {
+            break;                      // Not a record; e.g. the zeros a crash can leave at the end of a file
+        }
+
+        good += sizeof(JOURNAL_RECORD) + record.namelen;
+        book->journalseq++;
+
+        if (book->journalseq <= book->snapshotseq) continue;      // The snapshot already has this one
+
+        book->clocksecond = record.clocksecond;
+        book->clockmicro = record.clockmicro;
+
+        if (record.type == JOURNAL_ORDER)
+        {
+            if (record.namelen > 0)
+            {
+                record.id = map_account(book, map, name, record.id);
+            } else if (map->present && record.id >= 0 && record.id < MAXACCOUNTS && map->remap[record.id] >= 0) {
+                record.id = map->remap[record.id];
+            }
+            o_and_e = execute_order(book, name, record.id, record.qty, record.price, record.direction, record.orderType);
+            free(o_and_e);
+        } else if (record.id >= 0 && record.id <= book->highestknownorder && book->allorders[record.id] != NULL) {
+            cancel_order_by_id(book, record.id);
+        }
+
+        book->journalreplayed++;
+    }
+
+    if (reader->eof < 0) journal_quit(book, "Couldn't read journal for");
+
+    return good;
+}
+
+
+void open_journal (BOOK * book)         // Loads the book's snapshot and replays its journal, if it has them
+{
+    JOURNAL_HEADER header;
+    FILEREADER reader;
+    ACCOUNTMAP map;
+    char filename[MAXSTRING];
+    off_t end;
+    int loaded;
+    int64_t saved_second = book->clocksecond;
+    int saved_micro = book->clockmicro;
+    int saved_pinned = book->clockpinned;
+
+    book->replaying = 1;                // No output, and leave the clock as we found it
+    book->clockpinned = 1;
+
+    // Snapshots and journals hold accounts by int, and by name only where each is created. So
+    // that an account gets back its own orders even if its int has changed (e.g. the frontend
+    // lost its accounts file, or the journal is from before there was one), accounts are
+    // matched to the frontend's ints by name as they're loaded.
+
+    load_account_map(&map);
+
+    loaded = load_snapshot(book, &map);
+
+    journal_filename(book, "journal", filename);
+
+    book->journalfd = open(filename, O_RDWR | O_CREAT, 0644);
+    if (book->journalfd < 0) journal_quit(book, "Couldn't open journal for");
+
+    init_reader(&reader, book->journalfd);
+
+    if (read_bytes(&reader, &header, sizeof(JOURNAL_HEADER)) == 0)
+    {
+        if (reader.end > 0 || reader.eof < 0) journal_quit(book, "Bad journal for");
+
+        // A new journal. It carries on from the snapshot, if there is one...
+
+        memset(&header, 0, sizeof(JOURNAL_HEADER));
+        safe_strcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+        safe_strcpy(header.venue, book->venue, SMALLSTRING);
+        safe_strcpy(header.symbol, book->symbol, SMALLSTRING);
+        safe_strcpy(header.starttime, book->starttime, SMALLSTRING);
+        header.firstrecord = book->journalseq;
+        out_write(&book->journal, &header, sizeof(JOURNAL_HEADER));
+        write_journal(book);
+        sync_dir();
+        book->journalbytes = sizeof(JOURNAL_HEADER);
+
+    } else {
+
+        header.magic[sizeof(header.magic) - 1] = '\0';
+        header.venue[SMALLSTRING - 1] = '\0';
+        header.symbol[SMALLSTRING - 1] = '\0';
+        header.starttime[SMALLSTRING - 1] = '\0';
+
+        if (strcmp(header.magic, JOURNAL_MAGIC) || strcmp(header.venue, book->venue) || strcmp(header.symbol, book->symbol))
+        {
+            journal_quit(book, "Bad journal for");
+        }
+        if (header.firstrecord > book->journalseq)
+        {
+            journal_quit(book, "Journal doesn't follow on from the snapshot for");
+        }
+
+        if (loaded == 0)
+        {
+            safe_strcpy(book->starttime, header.starttime, SMALLSTRING);      // The book carries on as if it never went away
+            safe_strcpy(book->quote.quoteTime, book->starttime, SMALLSTRING);
+        }
+
+        book->journalseq = header.firstrecord;
+        end = replay_journal(book, &reader, &map);
+
+        if (ftruncate(book->journalfd, end) != 0 || lseek(book->journalfd, end, SEEK_SET) != end)
+        {
+            journal_quit(book, "Couldn't truncate journal for");
+        }
+        book->journalbytes = end;
+    }
+
+    free(reader.buf);
+
+    // If any account moved, the journal now has records from before under the old ints, and
+    // will have ones from now under the new. Naming every ORDER from here on keeps the next
+    // replay straight (the name wins).
+
+    book->journalnames = map.changed;
+    free_account_map(&map);
+
+    if (VirtualClock > 0 && clock_micros(book) > saved_second * 1000000 + saved_micro)
+    {
+        saved_second = book->clocksecond;       // A virtual clock carries on from the last replayed command
+        saved_micro = book->clockmicro;
+    }
+
+    book->clocksecond = saved_second;
+    book->clockmicro = saved_micro;
+    book->clockpinned = saved_pinned;
+    book->replaying = 0;
+
+    if (book->journalreplayed > 0)
+    {
+        remake_most_of_quote(book);
+        reset_stats(book);              // Only count what happens from now on
+    }
+    return;
+}
+
+#endif
+
+
+// Archiving (-archive N, POSIX only). Closed orders are hardly ever looked at again, yet with their
+// fills they are most of what a busy book has in memory. So once a closed order is at least N orders
+// old, it is copied into the book's archive and its slot in allorders is emptied. The archive is an
+// unlinked temporary file, mapped in segments of ARCHIVESEGMENTSIZE, so the kernel can page it out
+// like any other file. Archived orders never change, and the segments never move, so STATUS and
+// STATUSALL just give the output thread a pointer to them.
+//
+// The order itself can't be freed at once, as the output thread may still be formatting something
+// that refers to it (or to its fills). So it waits in the book's retired list until the output
+// thread has got past every record that was in the ring at the time.
+//
+// The archive goes in $TMPDIR (default /tmp), which had better be on a disk for this to help.
+
+#if !defined(_WIN32)
+
+char * archive_space (BOOK * book, size_t size)     // Where to write a record of this size; NULL if there's no room
+{
+    char path[MAXSTRING];
+    char * tmpdir;
+    char * segment;
+    off_t offset;
+
+    if (book->archivefd == -2) return NULL;
+
+    if (book->archivefd == -1)
+    {
+        tmpdir = getenv("TMPDIR");
+        snprintf(path, MAXSTRING, "%s/disorderBook-archive-XXXXXX", tmpdir != NULL && tmpdir[0] != '\0' ? tmpdir : "/tmp");
+
+        book->archivefd = mkstemp(path);
+        if (book->archivefd < 0)
+        {
+            book->archivefd = -2;       // Don't keep trying; the orders just stay where they are
+            return NULL;
+        }
+        unlink(path);                   // So it goes away with us
+    }
+
+    if (book->archivebytes + (int64_t) size > (int64_t) book->archivesegmentcount * ARCHIVESEGMENTSIZE)
+    {
+        offset = (off_t) book->archivesegmentcount * ARCHIVESEGMENTSIZE;
+
+        // Actually allocate the disk space, so that a full disk is an error here, not a SIGBUS later...
+
+        #if defined(__linux__)
+            if (posix_fallocate(book->archivefd, offset, ARCHIVESEGMENTSIZE) != 0) return NULL;
+        #else
+            if (ftruncate(book->archivefd, offset + ARCHIVESEGMENTSIZE) != 0) return NULL;
+        #endif
+
+        segment = mmap(NULL, ARCHIVESEGMENTSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, book->archivefd, offset);
+        if (segment == MAP_FAILED) return NULL;
+
+        book->archivesegments = realloc(book->archivesegments, (book->archivesegmentcount + 1) * sizeof(char *));
+        check_ptr_or_quit(book->archivesegments);
+        count_memory(book, MEM_DIRECTORIES, book->archivesegmentcount == 0, sizeof(char *));
+        book->archivesegments[book->archivesegmentcount] = segment;
+        book->archivesegmentcount++;
+
+        book->archivebytes = offset;    // Whatever was left at the end of the last segment goes unused
+    }
+
+    return book->archivesegments[book->archivebytes / ARCHIVESEGMENTSIZE] + book->archivebytes % ARCHIVESEGMENTSIZE;
+}
+
+
+int archive_order (BOOK * book, ORDER * order)     // Returns 0 if it couldn't, in which case the order stays where it is
+{
+    ARCHIVED_ORDER * archived;
+    FILLNODE * fillnode;
+    size_t size;
+    int n;
+
+    assert(order->open == 0);
+
+    size = sizeof(ARCHIVED_ORDER) + (size_t) order->fillcount * sizeof(ARCHIVED_FILL);
+    size = (size + 7) & ~((size_t) 7);          // Keeps the next record aligned
+
+    if (size > ARCHIVESEGMENTSIZE) return 0;    // Absurdly many fills
+
+    archived = (ARCHIVED_ORDER *) archive_space(book, size);
+    if (archived == NULL) return 0;
+
+    archived->account = order->account;
+    archived->id = order->id;
+    archived->direction = order->direction;
+    archived->originalQty = order->originalQty;
+    archived->qty = order->qty;
+    archived->price = order->price;
+    archived->orderType = order->orderType;
+    archived->totalFilled = order->totalFilled;
+    archived->fillcount = order->fillcount;
+    safe_strcpy(archived->ts, order->ts, ARCHIVE_TS_LEN);
+
+    n = 0;
+    for (fillnode = order->firstfillnode; fillnode != NULL; fillnode = fillnode->next)
+    {
+        archived->fills[n].id = fillnode->fill->id;
+        archived->fills[n].price = fillnode->fill->price;
+        archived->fills[n].qty = fillnode->fill->qty;
+        safe_strcpy(archived->fills[n].ts, fillnode->fill->ts, ARCHIVE_TS_LEN);
+        n++;
+    }
+
+    while (order->id >= book->archivedlen)
+    {
+        book->archived = realloc(book->archived, (book->archivedlen + 8192) * sizeof(int64_t));
+        check_ptr_or_quit(book->archived);
+        count_memory(book, MEM_DIRECTORIES, book->archivedlen == 0, 8192 * sizeof(int64_t));
+        memset(book->archived + book->archivedlen, 0, 8192 * sizeof(int64_t));
+        book->archivedlen += 8192;
+    }
+
+    book->archived[order->id] = book->archivebytes + 1;
+    book->archivebytes += size;
+    book->archivedcount++;
+
+    book->allorders[order->id] = NULL;
+
+    if (book->retiredcount == book->retiredcap)
+    {
+        book->retired = realloc(book->retired, (book->retiredcap + ARCHIVEBATCH) * sizeof(ORDER *));
+        check_ptr_or_quit(book->retired);
+        count_memory(book, MEM_DIRECTORIES, book->retiredcap == 0, ARCHIVEBATCH * sizeof(ORDER *));
+        book->retiredcap += ARCHIVEBATCH;
+    }
+    book->retired[book->retiredcount] = order;
+    book->retiredcount++;
+
+    return 1;
+}
+
+
+void free_retired_orders (BOOK * book)
+{
+    ORDER * order;
+    FILLNODE * fillnode;
+    FILLNODE * next;
+    int n;
+
+    for (n = 0; n < book->retiredcount; n++)
+    {
+        order = book->retired[n];
+
+        for (fillnode = order->firstfillnode; fillnode != NULL; fillnode = next)
+        {
+            next = fillnode->next;
+
+            fillnode->fill->refs--;
+            if (fillnode->fill->refs == 0)      // The other order has gone too
+            {
+                free(fillnode->fill->ts);
+                free(fillnode->fill);
+                count_memory(book, MEM_TIMESTAMPS, -1, -SMALLSTRING);
+                count_memory(book, MEM_FILLS, -1, -(int64_t) sizeof(FILL));
+            }
+            free(fillnode);
+            count_memory(book, MEM_FILLNODES, -1, -(int64_t) sizeof(FILLNODE));
+        }
 
-    while (1)
+        free(order->ts);
+        free(order);
+        count_memory(book, MEM_TIMESTAMPS, -1, -SMALLSTRING);
+        count_memory(book, MEM_ORDERS, -1, -(int64_t) sizeof(ORDER));
+    }
+
+    book->retiredcount = 0;
+    return;
+}
+
+
+void archive_old_orders (BOOK * book)
+{
+    ORDER * order;
+    int limit;
+    int kept;
+    int n;
+
+    limit = book->highestknownorder - ArchiveAfter;     // Orders up to here are old enough
+
+    // The old orders that were still open last time...
+
+    kept = 0;
+    for (n = 0; n < book->stillopencount; n++)
     {
-        if (current_node->order->open)                  // We found the very first (highest priority) open order
+        order = book->allorders[book->stillopen[n]];
+        if (order->open || archive_order(book, order) == 0)
         {
-            current_level->firstordernode = current_node;
-            current_level->prev = NULL;
-            current_node->prev = NULL;
-            *root_level = current_level;                // Remembering that current_level is a pointer, so
-            return;                                     // FirstBidLevel or FirstAskLevel ends up pointing to the level
+            book->stillopen[kept] = order->id;
+            kept++;
         }
+    }
+    book->stillopencount = kept;
 
-        if (current_node->next != NULL)
+    // Then the ones that have become old enough since...
+
+    for (n = book->archivecursor; n <= limit; n++)
+    {
+        order = book->allorders[n];
+        if (order == NULL) continue;
+
+        if (order->open)
         {
-            old_node = current_node;
-            current_node = current_node->next;
-            free(old_node);
-        } else {
-            old_node = current_node;
-            old_level = current_level;
-            current_level = current_level->next;
-            free(old_node);
-            free(old_level);
-            if (current_level != NULL)
+            if (book->stillopencount == book->stillopencap)
             {
-                current_node = current_level->firstordernode;
-                assert(current_node != NULL);
-            } else {
-                *root_level = NULL;
-                return;
+                book->stillopen = realloc(book->stillopen, (book->stillopencap + 256) * sizeof(int));
+                check_ptr_or_quit(book->stillopen);
+                count_memory(book, MEM_DIRECTORIES, book->stillopencap == 0, 256 * sizeof(int));
+                book->stillopencap += 256;
             }
+            book->stillopen[book->stillopencount] = n;
+            book->stillopencount++;
+        } else {
+            archive_order(book, order);         // If this fails the order just stays put
         }
     }
+    book->archivecursor = limit + 1;
 
+    if (OutputThread)
+    {
+        book->retiredtail = atomic_load_explicit(&book->worker->outtail, memory_order_relaxed);
+    }
     return;
 }
 
 
-void insert_ask (ORDER * order)
+void maybe_archive (BOOK * book)        // Called after every command to the book
 {
-    ORDERNODE * ordernode;
-    ORDERNODE * current_node;
-    LEVEL * prev_level = NULL;
-    LEVEL * level;
-    LEVEL * newlevel;
+    if (ArchiveAfter <= 0) return;
 
-    ordernode = init_ordernode(order, NULL, NULL);      // Fix ->prev later
+    if (book->retiredcount > 0)
+    {
+        if (OutputThread && atomic_load_explicit(&book->worker->outhead, memory_order_acquire) < book->retiredtail)
+        {
+            return;                     // The output thread may still need them
+        }
+        free_retired_orders(book);
+    }
 
-    if (FirstAskLevel == NULL)
+    if (book->highestknownorder - ArchiveAfter - book->archivecursor + 1 >= ARCHIVEBATCH)
     {
-        FirstAskLevel = init_level(order->price, ordernode, NULL, NULL);
-        return;
-    } else {
-        level = FirstAskLevel;
+        archive_old_orders(book);
+    }
+    return;
+}
+
+#endif
+
+
+void print_memory_info (BOOK * book, OUTBUF * out)
+{
+    int n;
+
+    out_printf(out, "DebugInfo.inits_of_level: %d,\n"               // The compiler auto-concatenates these things
+                    "DebugInfo.inits_of_fill: %d,\n"                // (note the lack of commas)
+                    "DebugInfo.inits_of_fillnode: %d,\n"
+                    "DebugInfo.inits_of_order: %d,\n"
+                    "DebugInfo.inits_of_ordernode: %d,\n"
+                    "DebugInfo.inits_of_account: %d,\n"
+                    "DebugInfo.reallocs_of_global_order_list: %d,\n"
+                    "DebugInfo.reallocs_of_global_account_list: %d,\n"
+                    "DebugInfo.reallocs_of_account_order_list: %d",
+            book->debuginfo.inits_of_level,
+            book->debuginfo.inits_of_fill,
+            book->debuginfo.inits_of_fillnode,
+            book->debuginfo.inits_of_order,
+            book->debuginfo.inits_of_ordernode,
+            book->debuginfo.inits_of_account,
+            book->debuginfo.reallocs_of_global_order_list,
+            book->debuginfo.reallocs_of_global_account_list,
+            book->debuginfo.reallocs_of_account_order_list
+            );
+
+    for (n = 0; n < MEM_TYPES; n++)
+    {
+        out_printf(out, ",\nMemory.%s: %" PRId64 " live (%" PRId64 " bytes), peak %" PRId64 " (%" PRId64 " bytes)",
+                   MemoryTypeNames[n], book->memory.objects[n], book->memory.bytes[n], book->memory.peakobjects[n], book->memory.peakbytes[n]);
+    }
+    out_printf(out, ",\nMemory.total: %" PRId64 " bytes live, peak %" PRId64 " bytes", book->memory.totalbytes, book->memory.peaktotalbytes);
+
+    #if !defined(_WIN32)
+        if (ArchiveAfter > 0)
+        {
+            out_printf(out, ",\nArchive.orders: %d,\nArchive.bytes: %" PRId64 ",\nArchive.waiting_to_be_freed: %d",
+                    book->archivedcount, book->archivebytes, book->retiredcount);
+        }
+    #endif
+    return;
+}
+
+
+void print_memory_json (BOOK * book, OUTBUF * out)
+{
+    int n;
+
+    out_printf(out, "{\n  \"ok\": true,\n  \"venue\": \"%s\",\n  \"symbol\": \"%s\",\n"
+                    "  \"liveBytes\": %" PRId64 ",\n  \"peakBytes\": %" PRId64 ",\n",
+               book->venue, book->symbol, book->memory.totalbytes, book->memory.peaktotalbytes);
+
+    #if !defined(_WIN32)
+        out_printf(out, "  \"archiveBytes\": %" PRId64 ",\n", book->archivebytes);     // On disk (or in the page cache), not the heap
+    #endif
+
+    out_printf(out, "  \"types\": {");
+    for (n = 0; n < MEM_TYPES; n++)
+    {
+        out_printf(out, "%s\n    \"%s\": {\"live\": %" PRId64 ", \"liveBytes\": %" PRId64 ", \"peak\": %" PRId64 ", \"peakBytes\": %" PRId64 "}",
+                   n ? "," : "", MemoryTypeNames[n],
+                   book->memory.objects[n], book->memory.bytes[n], book->memory.peakobjects[n], book->memory.peakbytes[n]);
     }
+    out_printf(out, "\n  }\n}");
+    return;
+}
+
+
+// We do our own buffering of stdin rather than using fgets(), because ticker conflation
+// needs to know whether another command is already waiting before we block on a read.
+
+int line_waiting (void)
+{
+    return memchr(InputBuffer + InputStart, '\n', InputEnd - InputStart) != NULL;
+}
+
+
+int wait_for_input (int timeout_ms)     // Returns 0 on timeout, i.e. nothing arrived
+{
+    #if defined(_WIN32)
+        return 0;                       // Can't easily poll a pipe here; caller just flushes early
+    #else
+        struct pollfd pfd;
+
+        if (ShmMode)
+        {
+            return shm_wait(&CommandRing, timeout_ms) != 0;    // EOF counts as input; read_line() will see it
+        }
+
+        pfd.fd = 0;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+
+        return poll(&pfd, 1, timeout_ms) != 0;
+    #endif
+}
+
+
+char * read_line (char * dest, size_t size)     // Like fgets() on stdin; NULL means EOF
+{
+    char * newline;
+    size_t linelen;
+    int n;
 
     while (1)
     {
-        if (order->price < level->price)
+        newline = memchr(InputBuffer + InputStart, '\n', InputEnd - InputStart);
+
+        if (newline != NULL || InputEnd - InputStart == INPUTBUFFERSIZE)
         {
-            // Create new level...
+            // Either we have a whole line, or the buffer is full of one huge line
+            // which we hand over (truncated) rather than waiting forever...
 
-            newlevel = init_level(order->price, ordernode, prev_level, level);
-            level->prev = newlevel;
-            if (prev_level)
+            linelen = newline ? (size_t) (newline - (InputBuffer + InputStart)) + 1 : InputEnd - InputStart;
+            if (linelen > size - 1)
             {
-                prev_level->next = newlevel;
+                memcpy(dest, InputBuffer + InputStart, size - 1);
+                dest[size - 1] = '\0';
             } else {
-                FirstAskLevel = newlevel;
+                memcpy(dest, InputBuffer + InputStart, linelen);
+                dest[linelen] = '\0';
             }
-            return;
+            InputStart += linelen;
+            return dest;
+        }
 
-        } else if (order->price == level->price) {
+        // Need more data. Move what we have to the start of the buffer first...
 
-            break;
+        if (InputStart > 0)
+        {
+            memmove(InputBuffer, InputBuffer + InputStart, InputEnd - InputStart);
+            InputEnd -= InputStart;
+            InputStart = 0;
+        }
 
-        } else {
+        #if defined(_WIN32)
+            n = _read(0, InputBuffer + InputEnd, (unsigned int) (INPUTBUFFERSIZE - InputEnd));
+        #else
+            if (ShmMode)
+            {
+                n = (int) shm_read(&CommandRing, InputBuffer + InputEnd, INPUTBUFFERSIZE - InputEnd);
+            } else {
+                n = (int) read(0, InputBuffer + InputEnd, INPUTBUFFERSIZE - InputEnd);
+            }
+        #endif
 
-            // Iterate...
+        if (n <= 0)
+        {
+            return NULL;
+        }
+        InputEnd += n;
+    }
+}
 
-            prev_level = level;
-            if (level->next != NULL)
+
+#if defined(__linux__)
+
+int pin_threads (char * list)       // For __AFFINITY__; returns 0 if the list was bad or pinning failed
+{
+    cpu_set_t set;
+    char * p;
+    long cpu;
+    int count = 0;
+    int ok;
+    int n;
+
+    CPU_ZERO(&set);
+
+    p = list;
+    while (*p != '\0')
+    {
+        if (*p < '0' || *p > '9') return 0;
+        cpu = strtol(p, &p, 10);
+        if (cpu >= CPU_SETSIZE) return 0;
+        CPU_SET(cpu, &set);
+        count++;
+        if (*p == ',') p++;
+    }
+
+    if (count == 0) return 0;
+
+    #if defined(DISORDERBOOK_ENGINE)
+        ok = (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0);      // The engine is just the thread calling it
+    #else
+        ok = (pthread_setaffinity_np(MainThreadId, sizeof(set), &set) == 0);
+
+        if (WorkerCount > 1)
+        {
+            for (n = 0; n < WorkerCount; n++)
             {
-                level = level->next;
+                if (pthread_setaffinity_np(Workers[n].thread, sizeof(set), &set) != 0) ok = 0;
+            }
+        }
+        if (OutputThread)
+        {
+            if (pthread_setaffinity_np(OutputThreadId, sizeof(set), &set) != 0) ok = 0;
+        }
+    #endif
+
+    return ok;
+}
+
+#endif
+
+
+BOOK * handle_command (WORKER * worker, char * input)
+{
+    // Handles a single command line, writing the response into the worker's output buffer.
+    // Returns the book the command was for (NULL if there was no such book).
+
+    char * tmp;
+    char * saveptr;
+    char tokens[MAXTOKENS][SMALLSTRING];
+    int id;
+    int n;
+    int book_id;
+    BOOK * book;
+    OUTBUF * out = &worker->out;
+    ORDER_AND_ERROR * o_and_e;
+    ORDER_SNAPSHOT snapshot;
+    char * clocktoken = NULL;
+
+    worker->stattype = STATS_OTHER;
+
+    tmp = strtok_r(input, " \t\n\r", &saveptr);      // strtok() isn't thread-safe
+
+    if (tmp != NULL && tmp[0] == '#')           // Request id: echo it, then carry on as normal
+    {
+        n = strlen(tmp);
+        if (n > 1 && tmp[n - 1] == '~')         // ...unless it asks for a trace (see finish_trace())
+        {
+            tmp[n - 1] = '\0';
+            worker->traced = 1;
+            worker->traceid = atoi(tmp + 1);
+        }
+        out_printf(out, "%s\n", tmp);
+        tmp = strtok_r(NULL, " \t\n\r", &saveptr);
+    }
+
+    book_id = 0;
+
+    if (tmp != NULL && tmp[0] == '@')           // Book id: without one, the command is for book 0
+    {
+        book_id = atoi(tmp + 1);
+        tmp = strtok_r(NULL, " \t\n\r", &saveptr);
+    }
+
+    if (tmp != NULL && tmp[0] == '$')           // Time for the virtual clock, once we know the book
+    {
+        clocktoken = tmp;
+        tmp = strtok_r(NULL, " \t\n\r", &saveptr);
+    }
+
+    for (n = 0; n < MAXTOKENS; n++)
+    {
+        tokens[n][0] = '\0';        // Clear the token in case there isn't one in this slot
+        if (tmp != NULL)
+        {
+            safe_strcpy(tokens[n], tmp, SMALLSTRING);
+            tmp = strtok_r(NULL, " \t\n\r", &saveptr);
+        }
+    }
+
+    if (worker->traced)
+    {
+        worker->traceparsed = monotonic_ns();
+    }
+
+    if (strcmp("__AFFINITY__", tokens[0]) == 0)
+    {
+        #if defined(__linux__)
+            if (pin_threads(tokens[1]))
+            {
+                out_printf(out, "{\"ok\": true, \"cpus\": \"%s\"}", tokens[1]);     // Only digits and commas, or it would have failed
             } else {
-                level->next = init_level(order->price, ordernode, prev_level, NULL);
-                return;
+                out_printf(out, "{\"ok\": false, \"error\": \"Bad CPU list, or couldn't set affinity\"}");
             }
+        #else
+            out_printf(out, "{\"ok\": false, \"error\": \"Affinity is only available on Linux\"}");
+        #endif
+        end_message(out);
+        return NULL;
+    }
+
+    if (strcmp("__NEWBOOK__", tokens[0]) == 0)
+    {
+        if (book_id < 0 || book_id >= MAXBOOKS || tokens[1][0] == '\0' || tokens[2][0] == '\0')
+        {
+            out_printf(out, "{\"ok\": false, \"error\": \"Bad book id, venue or symbol\"}");
+            book = NULL;
+        } else if (AllBooks[book_id] != NULL) {
+            out_printf(out, "{\"ok\": false, \"error\": \"Book id already in use\"}");
+            book = NULL;
+        } else {
+            book = init_book(worker, book_id, tokens[1], tokens[2]);
+            out_printf(out, "{\"ok\": true, \"book\": %d, \"venue\": \"%s\", \"symbol\": \"%s\"", book_id, book->venue, book->symbol);
+            #if !defined(_WIN32)
+                if (JournalDir != NULL)
+                {
+                    open_journal(book);
+                    out_printf(out, ", \"replayed\": %d", book->journalreplayed);
+                }
+            #endif
+            out_printf(out, "}");
         }
+        end_message(out);
+        return book;
     }
 
-    // So we should be on the right level now
+    if (book_id < 0 || book_id >= MAXBOOKS || AllBooks[book_id] == NULL)     // The order matters here (short-circuit)
+    {
+        out_printf(out, "{\"ok\": false, \"error\": \"No such book on this backend\"}");
+        end_message(out);
+        return NULL;
+    }
 
-    assert(level->price == order->price);
+    book = AllBooks[book_id];
 
-    current_node = level->firstordernode;
-    assert(current_node != NULL);
+    clock_pin(book);                            // The caller unpins it (see clock_pin())
+    if (clocktoken != NULL)
+    {
+        clock_move_to(book, clocktoken);
+    }
 
-    while (current_node->next != NULL)
+    // Now handle whatever the request was.........
+
+    if (strcmp("ORDER", tokens[0]) == 0)
     {
-        current_node = current_node->next;
+        worker->stattype = STATS_ORDER;
+
+        #if !defined(_WIN32)
+            journal_order(book, tokens[1], atoi(tokens[2]), atoi(tokens[3]), atoi(tokens[4]), atoi(tokens[5]), atoi(tokens[6]));
+        #endif
+
+        o_and_e = execute_order(book, tokens[1], atoi(tokens[2]), atoi(tokens[3]), atoi(tokens[4]), atoi(tokens[5]), atoi(tokens[6]));
+        //                            account    account_int      qty              price            direction        orderType
+
+        if (o_and_e->error)
+        {
+            out_printf(out, "{\"ok\": false, \"error\": \"Backend error %d (account = %s, account_int = %d, qty = %d, price = %d, direction = %d, orderType = %d)\"}",
+                o_and_e->error, tokens[1], atoi(tokens[2]), atoi(tokens[3]), atoi(tokens[4]), atoi(tokens[5]), atoi(tokens[6]));
+            end_message(out);
+        } else {
+            respond_with_order(worker, book, o_and_e->order->id);
+        }
+        free(o_and_e);
+
+        return book;
+    }
+
+    if (strcmp("ORDERBOOK_BINARY", tokens[0]) == 0)
+    {
+        worker->stattype = STATS_ORDERBOOK_BINARY;
+
+        respond_with_book_snapshot(worker, book);       // no end_message() call for binary
+        return book;
+    }
+
+    if (strcmp("STATUS", tokens[0]) == 0)
+    {
+        worker->stattype = STATS_STATUS;
+
+        id = atoi(tokens[1]);
+
+        if (order_exists(book, id) == 0)
+        {
+            out_printf(out, "{\"ok\": false, \"error\": \"No such ID\"}");
+            end_message(out);
+        } else {
+            respond_with_order(worker, book, id);
+        }
+
+        return book;
+    }
+
+    if (strcmp("STATUSALL", tokens[0]) == 0)
+    {
+        worker->stattype = STATS_STATUSALL;
+
+        // This can return a stupid amount of data. Frontend might want to not honour requests for this.
+
+        id = atoi(tokens[1]);       // id is an account id in this case
+
+        if (id < 0 || id >= book->currentaccountarraylen || book->allaccounts[id] == NULL)      // The order matters here (short-circuit)
+        {
+            out_printf(out, "{\"ok\": false, \"error\": \"Account not known on this book\"}");
+            end_message(out);
+        } else {
+            respond_with_orders_of_account(worker, book, book->allaccounts[id]);
+        }
+
+        return book;
+    }
+
+    if (strcmp("CANCEL", tokens[0]) == 0)
+    {
+        worker->stattype = STATS_CANCEL;
+
+        id = atoi(tokens[1]);
+
+        if (order_exists(book, id) == 0)
+        {
+            out_printf(out, "{\"ok\": false, \"error\": \"No such ID\"}");
+            end_message(out);
+        } else {
+            #if !defined(_WIN32)
+                journal_cancel(book, id);
+            #endif
+            cancel_order_by_id(book, id);
+            respond_with_order(worker, book, id);
+        }
+
+        return book;
+    }
+
+    if (strcmp("QUOTE", tokens[0]) == 0)
+    {
+        worker->stattype = STATS_QUOTE;
+
+        if (book->tickerdirty) remake_most_of_quote(book);     // Conflating, so the quote may be stale
+        print_quote(book, &book->quote, out);
+        end_message(out);
+        return book;
+    }
+
+    if (strcmp("__ACC_FROM_ID__", tokens[0]) == 0)
+    {
+        id = atoi(tokens[1]);
+
+        if (order_exists(book, id) == 0)
+        {
+            out_printf(out, "ERROR None");
+        } else {
+            snapshot_order_by_id(book, id, &snapshot);
+            out_printf(out, "OK %s", snapshot.order ? snapshot.order->account->name : snapshot.archived->account->name);
+        }
+
+        end_message(out);
+        return book;
     }
 
-    current_node->next = ordernode;
-    ordernode->prev = current_node;
+    if (strcmp("__STATS__", tokens[0]) == 0)
+    {
+        worker->stattype = STATS_NONE;
 
-    return;
-}
+        print_stats(book, out);
+        end_message(out);
+        if (strcmp("RESET", tokens[1]) == 0)
+        {
+            reset_stats(book);
+        }
+        return book;
+    }
 
+    if (strcmp("__MEMORY__", tokens[0]) == 0)
+    {
+        worker->stattype = STATS_NONE;      // The frontend polls this, which shouldn't show in __STATS__
 
-void insert_bid (ORDER * order)
-{
-    ORDERNODE * ordernode;
-    ORDERNODE * current_node;
-    LEVEL * prev_level = NULL;
-    LEVEL * level;
-    LEVEL * newlevel;
+        print_memory_json(book, out);
+        end_message(out);
+        return book;
+    }
 
-    ordernode = init_ordernode(order, NULL, NULL);      // Fix ->prev later
+    if (strcmp("__DEBUG_MEMORY__", tokens[0]) == 0)
+    {
+        print_memory_info(book, out);
+        end_message(out);
+        return book;
+    }
 
-    if (FirstBidLevel == NULL)
+    if (strcmp("__CONFLATE__", tokens[0]) == 0)
     {
-        FirstBidLevel = init_level(order->price, ordernode, NULL, NULL);
-        return;
-    } else {
-        level = FirstBidLevel;
+        book->tickerintervalms = atoi(tokens[1]);
+        book->tickereveryn = atoi(tokens[2]);
+        out_printf(out, "{\"ok\": true, \"tickerIntervalMs\": %d, \"tickerEveryN\": %d}", book->tickerintervalms, book->tickereveryn);
+        end_message(out);
+        return book;
     }
 
-    while (1)
+    if (strcmp("__TIMESTAMP__", tokens[0]) == 0)
     {
-        if (order->price > level->price)
-        {
-            // Create new level...
+        print_timestamp(book, out);
+        end_message(out);
+        return book;
+    }
 
-            newlevel = init_level(order->price, ordernode, prev_level, level);
-            level->prev = newlevel;
-            if (prev_level)
+    if (strcmp("__SCORES__", tokens[0]) == 0)
+    {
+        respond_with_scores(worker, book);
+        return book;
+    }
+
+    if (strcmp("DUMP", tokens[0]) == 0 || strcmp("DUMPSTATUS", tokens[0]) == 0)
+    {
+        #if defined(_WIN32)
+            out_printf(out, "{\"ok\": false, \"error\": \"DUMP is not available on Windows\"}");
+        #else
+            if (strcmp("DUMPSTATUS", tokens[0]) == 0)
             {
-                prev_level->next = newlevel;
+                print_dump_status(book, out);
+            } else if (tokens[1][0] == '\0') {
+                out_printf(out, "{\"ok\": false, \"error\": \"DUMP needs a directory\"}");
             } else {
-                FirstBidLevel = newlevel;
+                start_dump(book, tokens[1], out);
             }
-            return;
-
-        } else if (order->price == level->price) {
-
-            break;
-
-        } else {
-
-            // Iterate...
+        #endif
+        end_message(out);
+        return book;
+    }
 
-            prev_level = level;
-            if (level->next != NULL)
+    if (strcmp("SNAPSHOT", tokens[0]) == 0 || strcmp("SNAPSHOTSTATUS", tokens[0]) == 0)
+    {
+        #if defined(_WIN32)
+            out_printf(out, "{\"ok\": false, \"error\": \"SNAPSHOT is not available on Windows\"}");
+        #else
+            if (book->journalfd < 0)
             {
-                level = level->next;
+                out_printf(out, "{\"ok\": false, \"error\": \"SNAPSHOT needs -journal\"}");
+            } else if (strcmp("SNAPSHOTSTATUS", tokens[0]) == 0) {
+                update_snapshot(book);
+                print_snapshot_status(book, out);
             } else {
-                level->next = init_level(order->price, ordernode, prev_level, NULL);
-                return;
+                start_snapshot(book, out);
             }
-        }
+        #endif
+        end_message(out);
+        return book;
     }
 
-    // So we should be on the right level now
+    out_printf(out, "{\"ok\": false, \"error\": \"Did not comprehend\"}");
+    end_message(out);
+    return book;
+}
 
-    assert(level->price == order->price);
 
-    current_node = level->firstordernode;
-    assert(current_node != NULL);
+int peek_book_id (char * input)         // Finds the @<book_id> in a command line without modifying it
+{
+    char * p = input;
 
-    while (current_node->next != NULL)
+    while (*p == ' ' || *p == '\t') p++;
+
+    if (*p == '#')                      // Skip the request id
     {
-        current_node = current_node->next;
+        while (*p != ' ' && *p != '\t' && *p != '\0') p++;
+        while (*p == ' ' || *p == '\t') p++;
     }
 
-    current_node->next = ordernode;
-    ordernode->prev = current_node;
+    if (*p == '@')
+    {
+        return atoi(p + 1);
+    }
 
-    return;
+    return 0;
 }
 
 
-int fok_can_buy (int qty, int price)
-{
-    // Must use subtraction only. Adding could overflow.
-
-    LEVEL * level;
-    ORDERNODE * ordernode;
+// Worker threads. With -workers N (N > 1), each book is owned by one worker thread, which is
+// the only thread that ever touches it, so the books need no locks. The main thread reads
+// commands from stdin and passes each one to the right worker through a ring buffer that has
+// exactly one producer and one consumer, so it needs no locks either. A worker with nothing
+// to do spins for a bit, then sleeps on a condition variable until woken.
 
-    for (level = FirstAskLevel; level != NULL && level->price <= price; level = level->next)
-    {
-        for (ordernode = level->firstordernode; ordernode != NULL; ordernode = ordernode->next)
-        {
-            qty -= ordernode->order->qty;
-            if (qty <= 0) return 1;
-        }
-    }
+#if !defined(_WIN32)
 
-    return 0;
+int ring_empty (WORKER * worker)
+{
+    return atomic_load(&worker->head) == atomic_load(&worker->tail);
 }
 
 
-int fok_can_sell (int qty, int price)
+void ring_push (WORKER * worker, char * line)      // Main thread only
 {
-    // Must use subtraction only. Adding could overflow.
+    size_t tail;
 
-    LEVEL * level;
-    ORDERNODE * ordernode;
+    tail = atomic_load_explicit(&worker->tail, memory_order_relaxed);
 
-    for (level = FirstBidLevel; level != NULL && level->price >= price; level = level->next)
+    while (tail - atomic_load_explicit(&worker->head, memory_order_acquire) >= RINGSIZE)
     {
-        for (ordernode = level->firstordernode; ordernode != NULL; ordernode = ordernode->next)
-        {
-            qty -= ordernode->order->qty;
-            if (qty <= 0) return 1;
-        }
+        sched_yield();                  // Ring is full; the worker is behind
     }
 
-    return 0;
+    safe_strcpy(worker->ring[tail & (RINGSIZE - 1)], line, MAXSTRING);
+    atomic_store(&worker->tail, tail + 1);
+
+    if (atomic_load(&worker->sleeping))
+    {
+        pthread_mutex_lock(&worker->mutex);
+        pthread_cond_signal(&worker->cond);
+        pthread_mutex_unlock(&worker->mutex);
+    }
+    return;
 }
 
 
-ACCOUNT * init_account (char * name)
+int ring_pop (WORKER * worker, char * dest)        // Worker only; returns 0 if there was nothing
 {
-    ACCOUNT * ret;
-
-    DebugInfo.inits_of_account++;
-
-    ret = malloc(sizeof(ACCOUNT));
-    check_ptr_or_quit(ret);
-
-    safe_strcpy(ret->name, name, SMALLSTRING);
+    size_t head;
 
-    ret->orders = NULL;
-    ret->arraylen = 0;
-    ret->count = 0;
+    head = atomic_load_explicit(&worker->head, memory_order_relaxed);
 
-    ret->posmin = 0;
-    ret->posmax = 0;
-    ret->shares = 0;
-    ret->cents = 0;
+    if (head == atomic_load_explicit(&worker->tail, memory_order_acquire))
+    {
+        return 0;
+    }
 
-    return ret;
+    safe_strcpy(dest, worker->ring[head & (RINGSIZE - 1)], MAXSTRING);
+    atomic_store_explicit(&worker->head, head + 1, memory_order_release);
+    return 1;
 }
 
 
-ACCOUNT * account_lookup_or_create (char * account_name, int account_int)
+void worker_sleep (WORKER * worker)
 {
+    struct timespec deadline;
+    int timed_out = 0;
+    int ms;
     int n;
 
-    // If account_id is too high, we will need more storage...
-
-    while (account_int >= CurrentAccountArrayLen)
+    for (n = 0; n < SPINS_BEFORE_SLEEP; n++)
     {
-        AllAccounts = realloc(AllAccounts, (CurrentAccountArrayLen + 64) * sizeof(ACCOUNT *));
-        check_ptr_or_quit(AllAccounts);
-        CurrentAccountArrayLen += 64;
+        if (ring_empty(worker) == 0) return;
+    }
 
-        // We must NULLify our new account pointers because there can be holes in the known
-        // account IDs: e.g. known IDs are 0,1,2,3,7. So, if we're asked to lookup ID 5, we
-        // need a way to know it doesn't exist...
+    pthread_mutex_lock(&worker->mutex);
+    atomic_store(&worker->sleeping, 1);
 
-        for (n = CurrentAccountArrayLen - 64; n < CurrentAccountArrayLen; n++)
+    if (ring_empty(worker))             // Checked after setting the flag, so a push can't be missed
+    {
+        if (worker->dirtybooks > 0)
         {
-            AllAccounts[n] = NULL;
+            // Same logic as the main thread uses when single-threaded: wait out the rest
+            // of the conflation interval at most, then make sure the latest state goes out.
+
+            ms = ms_until_next_ticker(worker);
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += ms / 1000;
+            deadline.tv_nsec += (long) (ms % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000)
+            {
+                deadline.tv_sec += 1;
+                deadline.tv_nsec -= 1000000000;
+            }
+            timed_out = (pthread_cond_timedwait(&worker->cond, &worker->mutex, &deadline) == ETIMEDOUT);
+        } else {
+            pthread_cond_wait(&worker->cond, &worker->mutex);
         }
-
-        DebugInfo.reallocs_of_global_account_list++;
     }
 
-    // If the account corresponsing to the account_id is NULL, create it...
+    atomic_store(&worker->sleeping, 0);
+    pthread_mutex_unlock(&worker->mutex);
 
-    if (AllAccounts[account_int] == NULL)
+    if (timed_out)
     {
-        AllAccounts[account_int] = init_account(account_name);
+        flush_due_tickers(worker, 1);
+        emit_output(worker);
     }
-
-    // Done...
-
-    return AllAccounts[account_int];
+    return;
 }
 
 
-void add_order_to_account (ORDER * order, ACCOUNT * accountobject)
+void * worker_main (void * arg)
 {
-    if (accountobject->count == accountobject->arraylen)
+    WORKER * worker = arg;
+    BOOK * book;
+    char input[MAXSTRING];
+    int64_t started;
+
+    while (1)
     {
-        accountobject->orders = realloc(accountobject->orders, (accountobject->arraylen + 256) * sizeof(ORDER *));
-        check_ptr_or_quit(accountobject->orders);
-        accountobject->arraylen += 256;
+        if (ring_pop(worker, input) == 0)
+        {
+            worker_sleep(worker);
+            continue;
+        }
 
-        DebugInfo.reallocs_of_account_order_list++;
-    }
-    accountobject->orders[accountobject->count] = order;
-    accountobject->count += 1;
+        if (input[0] == '\0')           // The main thread hit EOF
+        {
+            flush_due_tickers(worker, 1);
+            emit_output(worker);
+            sync_journals(worker);
+            return NULL;
+        }
 
-    return;
+        started = monotonic_ns();
+        book = handle_command(worker, input);
+        if (book != NULL) clock_unpin(book);
+        finish_trace(worker, started);
+        if (book != NULL)
+        {
+            record_command(book, worker->stattype, monotonic_ns() - started);
+            maybe_flush_ticker(book);   // Does nothing unless conflating and the quote is dirty
+            maybe_snapshot(book);
+            maybe_archive(book);
+        }
+        flush_due_tickers(worker, 0);
+        emit_output(worker);
+        maybe_sync_journals(worker, ring_empty(worker));
+    }
 }
 
+#endif
 
-ORDER_AND_ERROR * execute_order (char * account_name, int account_int, int qty, int price, int direction, int orderType)
-{
-    // Note: account_name will be in the stack of the calling function, not in the heap
-
-    ORDER * order;
-    ORDER_AND_ERROR * o_and_e;
-    int id;
-    ACCOUNT * accountobject;
 
-    // The o_and_e structure lets us send either an order or an error to the caller...
+// The output thread. Workers never format executions, tickers or single-order responses
+// themselves, nor wait on the frontend to read what they've written; they pass compact records
+// to this thread instead (see create_execution_messages() and friends). It is the only thread
+// that writes to stdout / stderr (or the shared memory rings), so it needs no OutputMutex.
 
-    o_and_e = init_o_and_e();
+#if !defined(_WIN32)
 
-    // Check for too high an order ID, too high an account ID, or silly values...
+void format_out_record (OUTRECORD * record)
+{
+    // WebSocket messages...
 
-    if (next_id(1) >= MAXORDERS)                // Pass the no-iterate flag to next_id() here
-    {                                           // i.e. don't iterate until we know order succeeds
-        o_and_e->error = TOO_MANY_ORDERS;
-        return o_and_e;
+    if (record->type == OUT_EVENT_BLOB)
+    {
+        out_write(&OutputEvents, record->blob.data, record->blob.len);
+        free(record->blob.data);
+        return;
+    }
 
-    } else if (account_int >= MAXACCOUNTS)
+    if (record->type == OUT_EXECUTION)
     {
-        o_and_e->error = TOO_HIGH_ACCOUNT;
-        return o_and_e;
+        write_execution_messages(record->book, &record->standing, &record->incoming, record->quantity, record->price, record->ts, &OutputEvents);
+        return;
+    }
 
-    } else if (price < 0 || qty < 1 || (direction != SELL && direction != BUY))
+    if (record->type == OUT_TICKER)
     {
-        o_and_e->error = SILLY_VALUE;
-        return o_and_e;
+        write_ticker_message(record->book, &record->quote, &OutputEvents);
+        return;
     }
 
-    // The following call gets the account object. If not already extant, it is created.
-    // If more memory is needed to store accounts up to this account_id, that happens...
+    // Everything else is a response, which may have something (e.g. the request id) to go first...
 
-    accountobject = account_lookup_or_create(account_name, account_int);
+    if (record->blob.len > 0) out_write(&OutputResponses, record->blob.data, record->blob.len);
+    free(record->blob.data);
 
-    // Create order struct, and store a pointer to it in the account...
+    if (record->type == OUT_ORDER)
+    {
+        print_order_snapshot(record->book, &OutputResponses, &record->standing);
+        end_message(&OutputResponses);
+    } else if (record->type == OUT_ORDERBOOK) {
+        write_book_snapshot(record->snapshot, &OutputResponses);
+        release_book_snapshot(record->snapshot);
+    } else if (record->type == OUT_ACCOUNT_ORDERS) {
+        print_orders_of_account(record->book, record->snapshot, record->count, &OutputResponses);
+        end_message(&OutputResponses);
+        free(record->snapshot);
+    } else if (record->type == OUT_SCORES) {
+        print_scores(record->book, record->snapshot, record->count, record->price, record->ts, &OutputResponses);
+        end_message(&OutputResponses);
+        free(record->snapshot);
+        free(record->ts);
+    }
+    return;
+}
 
-    id = next_id(0);
-    order = init_order(accountobject, qty, price, direction, orderType, id);
-    add_order_to_account(order, accountobject);
 
-    // Run the order, with checks for FOK if needed...
+int drain_out_ring (WORKER * worker)     // Returns how many records there were
+{
+    OUTRECORD * record;
+    size_t head;
+    int64_t started;
+    int count = 0;
 
-    if (order->orderType != FOK)
+    head = atomic_load_explicit(&worker->outhead, memory_order_relaxed);
+
+    while (head != atomic_load_explicit(&worker->outtail, memory_order_acquire))
     {
-        run_order(order);
-    } else {
-        if (order->direction == BUY)
+        record = &worker->outring[head & (OUTRINGSIZE - 1)];
+
+        if (record->type == OUT_TRACE)          // See finish_trace()
         {
-            if (fok_can_buy(order->qty, order->price))
-            {
-                run_order(order);
-            }
+            out_write(&OutputResponses, record->blob.data, record->blob.len);
+            out_printf(&OutputResponses, " %" PRId64 "\n", worker->traceformatns);
+            free(record->blob.data);
+            worker->traceformatns = 0;
+        } else if (record->traced) {
+            started = monotonic_ns();
+            format_out_record(record);
+            worker->traceformatns += monotonic_ns() - started;
         } else {
-            if (fok_can_sell(order->qty, order->price))
-            {
-                run_order(order);
-            }
+            format_out_record(record);
+        }
+
+        head++;
+        atomic_store_explicit(&worker->outhead, head, memory_order_release);
+        count++;
+
+        if (OutputResponses.len + OutputEvents.len > INPUTBUFFERSIZE)
+        {
+            write_output(&OutputEvents, &OutputResponses);
         }
     }
 
-    // Iterate through the Bids or Asks as appropriate, removing them from the book if they are now closed...
+    return count;
+}
 
-    if (order->direction == SELL)
+
+int out_rings_empty (void)
+{
+    int n;
+
+    for (n = 0; n < WorkerCount; n++)
     {
-        cleanup_closed_bids_or_asks(&FirstBidLevel);
-    } else {
-        cleanup_closed_bids_or_asks(&FirstAskLevel);
+        if (atomic_load(&Workers[n].outhead) != atomic_load(&Workers[n].outtail)) return 0;
     }
+    return 1;
+}
 
-    // Market orders get set to price == 0 in official for storage / reporting
-    // (the timing doesn't matter, this could be done before running the order)
-
-    if (order->orderType == MARKET) order->price = 0;
 
-    // Place open limit orders on the book. Mark other order types as closed...
+void output_sleep (void)
+{
+    int n;
 
-    if (order->open)
+    for (n = 0; n < SPINS_BEFORE_SLEEP; n++)
     {
-        if (order->orderType == LIMIT)
-        {
-            if (order->direction == SELL)
-            {
-                insert_ask(order);
-            } else {
-                insert_bid(order);
-            }
-        } else {
-            order->open = 0;
-            order->qty = 0;
-        }
+        if (out_rings_empty() == 0 || atomic_load(&OutputStop)) return;
     }
 
-    // If something happened, fix the quote and fire a ticker WebSocket message.
-    // The definition of "something happened" is anything that changes the book:
-    //      - a limit order was placed, OR
-    //      - fills were generated
-    // Nothing else changes the book except cancels, which we aren't dealing with here.
+    pthread_mutex_lock(&OutputWakeMutex);
+    atomic_store(&OutputSleeping, 1);
 
-    if (order->totalFilled || order->orderType == LIMIT)
+    if (out_rings_empty() && atomic_load(&OutputStop) == 0)    // Checked after setting the flag, so a push can't be missed
     {
-        remake_most_of_quote();     // the "last trade" parts are done by cross()
-        create_ticker_message();
+        pthread_cond_wait(&OutputWakeCond, &OutputWakeMutex);
     }
 
-    o_and_e->order = order;
-    return o_and_e;
+    atomic_store(&OutputSleeping, 0);
+    pthread_mutex_unlock(&OutputWakeMutex);
+    return;
 }
 
 
-LEVEL * find_level (int price, int dir)      // Return ptr to level, or return NULL if not present
+void * output_main (void * arg)
 {
-    LEVEL * level = NULL;
+    int stopping;
+    int count;
+    int n;
 
-    if (dir == BUY)
+    (void) arg;
+
+    while (1)
     {
-        level = FirstBidLevel;
-        while (level != NULL)
+        stopping = atomic_load(&OutputStop);        // Read first, so that everything sent before the stop gets drained
+
+        count = 0;
+        for (n = 0; n < WorkerCount; n++)
         {
-            if (level->price > price)
-            {
-                level = level->next;
-            } else if (level->price == price) {
-                break;
-            } else {
-                level = NULL;
-                break;
-            }
+            count += drain_out_ring(&Workers[n]);
         }
-    } else {
-        level = FirstAskLevel;
-        while (level != NULL)
+
+        if (count > 0)
         {
-            if (level->price < price)
-            {
-                level = level->next;
-            } else if (level->price == price) {
-                break;
-            } else {
-                level = NULL;
-                break;
-            }
+            write_output(&OutputEvents, &OutputResponses);     // One write for everything that was waiting
+            continue;
         }
-    }
 
-    return level;
+        if (stopping) return NULL;
+
+        output_sleep();
+    }
 }
 
 
-ORDERNODE * find_ordernode (LEVEL * level, int id)
+void start_output_thread (void)
 {
-    ORDERNODE * ordernode;
+    int n;
 
-    if (level)
+    for (n = 0; n < WorkerCount; n++)
     {
-        for (ordernode = level->firstordernode; ordernode != NULL; ordernode = ordernode->next)
-        {
-            if (ordernode->order->id == id)
-            {
-                return ordernode;
-            }
-        }
+        Workers[n].outring = malloc(OUTRINGSIZE * sizeof(OUTRECORD));
+        check_ptr_or_quit(Workers[n].outring);
+        atomic_init(&Workers[n].outhead, 0);
+        atomic_init(&Workers[n].outtail, 0);
     }
 
-    return NULL;
+    atomic_init(&OutputSleeping, 0);
+    atomic_init(&OutputStop, 0);
+
+    if (pthread_create(&OutputThreadId, NULL, output_main, NULL) != 0)
+    {
+        return;                         // Not fatal; the workers will just write for themselves
+    }
+
+    OutputThread = 1;
+    return;
 }
 
 
-void cleanup_after_cancel (ORDERNODE * ordernode, LEVEL * level)       // Free the ordernode, maybe free the level, fix all links
+void stop_output_thread (void)          // Only once nothing else will be sent to it
 {
-    int dir;
+    if (OutputThread == 0) return;
 
-    assert(ordernode && level);
+    atomic_store(&OutputStop, 1);
 
-    dir = ordernode->order->direction;                  // Needed later
+    pthread_mutex_lock(&OutputWakeMutex);
+    pthread_cond_signal(&OutputWakeCond);
+    pthread_mutex_unlock(&OutputWakeMutex);
 
+    pthread_join(OutputThreadId, NULL);
+    OutputThread = 0;
+    return;
+}
 
-    if (ordernode->prev)
-    {
-        ordernode->prev->next = ordernode->next;
-    } else {
-        level->firstordernode = ordernode->next;        // Can set level->firstordernode to NULL, in which case
-    }                                                   // the level is now empty and must be destroyed in a bit
+#endif
 
-    if (ordernode->next)
-    {
-        ordernode->next->prev = ordernode->prev;
-    }
 
-    free(ordernode);
+void init_workers (int count)
+{
+    int n;
 
-    if (level->firstordernode == NULL)
+    #if defined(_WIN32)
+        count = 1;
+    #endif
+
+    if (count < 1) count = 1;
+    if (count > MAXWORKERS) count = MAXWORKERS;
+
+    WorkerCount = count;
+
+    Workers = calloc(count, sizeof(WORKER));
+    check_ptr_or_quit(Workers);
+
+    for (n = 0; n < count; n++)
     {
-        if (level->prev)
-        {
-            level->prev->next = level->next;
-        } else {
-            if (dir == BUY)
-            {
-                FirstBidLevel = level->next;
-            } else {
-                FirstAskLevel = level->next;
-            }
-        }
+        Workers[n].index = n;
+    }
 
-        if (level->next)
+    #if !defined(_WIN32)
+        if (count == 1) return;         // The main thread does all the work itself
+
+        for (n = 0; n < count; n++)
         {
-            level->next->prev = level->prev;
+            Workers[n].ring = malloc(RINGSIZE * MAXSTRING);
+            check_ptr_or_quit(Workers[n].ring);
+            atomic_init(&Workers[n].head, 0);
+            atomic_init(&Workers[n].tail, 0);
+            atomic_init(&Workers[n].sleeping, 0);
+            pthread_mutex_init(&Workers[n].mutex, NULL);
+            pthread_cond_init(&Workers[n].cond, NULL);
         }
-
-        free(level);
-    }
+    #endif
 
     return;
 }
 
 
-void print_orderbook_binary (void)
+void start_workers (void)
 {
-    /*
-    Strategy for binary printout of the orderbook. Qty is never 0, so 0 qty can be used as an in-channel flag.
-
-    Format then is:
+    #if !defined(_WIN32)
+        int n;
 
-    all bids ... flag ... all asks ... flag
-    using 8 bytes per message (e.g. 1 order or 1 flag takes 8 bytes)
+        if (WorkerCount == 1) return;
 
-    e.g for a book with 2 bids and 2 asks:
+        for (n = 0; n < WorkerCount; n++)
+        {
+            if (pthread_create(&Workers[n].thread, NULL, worker_main, &Workers[n]) != 0)
+            {
+                printf("{\"ok\": false, \"error\": \"Couldn't start worker thread. Quitting\"}\nEND\n");
+                fflush(stdout);
+                exit(1);
+            }
+        }
+    #endif
 
-    4bytes (qty)
-    4bytes (price)
-    4bytes (qty)
-    4bytes (price)
-    0x00000000 (zero qty: flag)
-    0x00000000 (for consistency, i.e. 8 bytes per message)
-    4bytes (qty)
-    4bytes (price)
-    4bytes (qty)
-    4bytes (price)
-    0x00000000 (zero qty: flag)
-    0x00000000 (for consistency, i.e. 8 bytes per message)
+    return;
+}
 
-    Since we must choose an endian system, we will choose BIG (go big endian or go home).
-    */
 
-    LEVEL * level;
-    ORDERNODE * ordernode;
+void stop_workers (void)        // Tell every worker we've hit EOF, and wait for them to finish up
+{
+    #if !defined(_WIN32)
+        int n;
 
-    int i;
-    int n;
-    uint32_t qty;       // the order qty and price are signed ints not exceeding 2^31-1
-    uint32_t price;     // but promotion to unsigned here seems perfectly fine
+        if (WorkerCount == 1) return;
 
-    for (i = 0; i < 2; i++)
-    {
-        for (level = (i == 0 ? FirstBidLevel : FirstAskLevel); level != NULL; level = level->next)
+        for (n = 0; n < WorkerCount; n++)
         {
-            for (ordernode = level->firstordernode; ordernode != NULL; ordernode = ordernode->next)
-            {
-                qty = (uint32_t) ordernode->order->qty;
-                putc((qty & 0xFF000000) >> 24, stdout);
-                putc((qty & 0x00FF0000) >> 16, stdout);
-                putc((qty & 0x0000FF00) >>  8, stdout);
-                putc((qty & 0x000000FF)      , stdout);
-
-                price = (uint32_t) ordernode->order->price;
-                putc((price & 0xFF000000) >> 24, stdout);
-                putc((price & 0x00FF0000) >> 16, stdout);
-                putc((price & 0x0000FF00) >>  8, stdout);
-                putc((price & 0x000000FF)      , stdout);
-            }
+            ring_push(&Workers[n], "");
         }
-
-        for (n = 0; n < 8; n++)
+        for (n = 0; n < WorkerCount; n++)
         {
-            putc('\0', stdout);
+            pthread_join(Workers[n].thread, NULL);
         }
-    }
+    #endif
 
     return;
 }
 
 
-void print_all_orders_of_account (ACCOUNT * account)
-{
-    int flag;
-    int n;
-
-    assert(account);
-
-    printf("{\"ok\": true, \"venue\": \"%s\", \"orders\": [", Venue);
+// The in-process engine (DISORDERBOOK_ENGINE). Each engine is a WORKER of its own, which the caller
+// creates with engine_new() and must only ever use from one thread at a time (and always the same
+// thread, since the clock is per thread). Commands are the same lines as on stdin, and the books they
+// create belong to that engine. Book ids are shared by all engines, so the caller must hand them out.
+// There is no output thread and nothing is written anywhere: responses and WebSocket messages build
+// up in the worker's buffers, and the caller copies them out with engine_take().
 
-    flag = 0;
-    for (n = 0; n < account->count; n++)
-    {
-        if (flag) printf(", \n");
-        print_order(stdout, account->orders[n]);
-        flag = 1;
-    }
+#if defined(DISORDERBOOK_ENGINE)
 
-    printf("]}");
+void engine_init (char * journal, int64_t snapshotevery, int archive, int64_t virtualclock, int clockstep)     // Once, before anything else
+{
+    #if !defined(_WIN32)
+        if (journal != NULL && journal[0] != '\0')
+        {
+            JournalDir = journal;
+            SnapshotEvery = snapshotevery;
+        }
+        ArchiveAfter = archive;
+    #endif
 
+    VirtualClock = virtualclock;
+    ClockStep = clockstep;
     return;
 }
 
 
-void cancel_order_by_id (int id)
+WORKER * engine_new (void)
 {
-    ORDERNODE * ordernode;
-    int price;
-    int dir;
-    LEVEL * level;
+    WORKER * ret;
 
-    assert(id >= 0 && id <= HighestKnownOrder);
+    ret = calloc(1, sizeof(WORKER));
+    check_ptr_or_quit(ret);
+    return ret;
+}
 
-    if (AllOrders[id]->orderType != LIMIT)          // Everything else is auto-cancelled after running
-    {
-        return;
-    }
 
-    price = AllOrders[id]->price;
-    dir = AllOrders[id]->direction;
+int engine_open_book (WORKER * worker, int book_id, char * venue, char * symbol)     // As main() does, given a venue and symbol
+{
+    BOOK * book;
 
-    // Find the level then the ordernode, if possible...
+    if (book_id < 0 || book_id >= MAXBOOKS || AllBooks[book_id] != NULL) return 0;
 
-    level = find_level(price, dir);
-    ordernode = find_ordernode(level, id);          // This is safe even if level == NULL
+    book = init_book(worker, book_id, venue, symbol);
+    #if !defined(_WIN32)
+        if (JournalDir != NULL)
+        {
+            open_journal(book);
+        }
+    #endif
+    return 1;
+}
 
-    // Now close the order and do the linked-list fiddling...
 
-    if (ordernode)
-    {
-        ordernode->order->open = 0;
-        ordernode->order->qty = 0;
+void engine_command (WORKER * worker, char * input)     // Same as the main loop does with a line from stdin
+{
+    BOOK * book;
+    int64_t started;
 
-        cleanup_after_cancel(ordernode, level);     // Frees the node and even the level if needed; fixes links
+    started = monotonic_ns();
+    book = handle_command(worker, input);
+    if (book != NULL) clock_unpin(book);
+    finish_trace(worker, started);
 
-        remake_most_of_quote();                     // Remakes all but the "last trade" info in the quote
-        create_ticker_message();
+    if (book != NULL)
+    {
+        record_command(book, worker->stattype, monotonic_ns() - started);
+        maybe_flush_ticker(book);       // Does nothing unless conflating and the quote is dirty
+        #if !defined(_WIN32)
+            maybe_snapshot(book);
+            maybe_archive(book);
+        #endif
     }
+    flush_due_tickers(worker, 0);
 
+    #if !defined(_WIN32)
+        maybe_sync_journals(worker, 0);
+    #endif
     return;
 }
 
 
-void print_scores (void)
+int engine_idle (WORKER * worker, int timed_out)     // When the caller has no command waiting; returns ms until it should call again, or -1
 {
-    ACCOUNT * account;
-    int64_t nav64;
-    char * ts;
-    int n;
+    flush_due_tickers(worker, timed_out);
 
-    printf("<html><head><title>%s %s</title></head><body><pre>%s %s\n", Venue, Symbol, Venue, Symbol);
+    #if !defined(_WIN32)
+        maybe_sync_journals(worker, 1);
+    #endif
 
-    if (Quote.last == -1)
+    if (worker->dirtybooks > 0)
     {
-        printf("No trading activity yet.</pre>");
-        return;
+        return ms_until_next_ticker(worker);
     }
+    return -1;
+}
 
-    printf("Current price: $%d.%02d\n\n", Quote.last / 100, Quote.last % 100);
-
-    printf("             Account           USD $          Shares         Pos.min         Pos.max           NAV $\n");
-
-    for (n = 0; n < CurrentAccountArrayLen; n++)
-    {
-        if (AllAccounts[n])
-        {
-            account = AllAccounts[n];
-
-            // The values account->shares and account->cents are both int32, as is Quote.last, so
-            // account->shares * Quote.last + account->cents is guaranteed to fit in an int64.
 
-            nav64 = (int64_t) account->shares * (int64_t) Quote.last + (int64_t) account->cents;
+size_t engine_pending (WORKER * worker, int events)     // How many bytes of responses (or WebSocket messages) are waiting
+{
+    return events ? worker->events.len : worker->out.len;
+}
 
-            printf("%20s %15d %15d %15d %15d %15" PRId64 "\n",
-                    account->name, account->cents / 100, account->shares, account->posmin, account->posmax, nav64 / 100);
-        }
-    }
 
-    ts = new_timestamp();
-    printf("\n  Start time: %s\nCurrent time: %s", StartTime, ts);
-    free(ts);
+size_t engine_take (WORKER * worker, int events, char * dest, size_t size)     // Copies out (and removes) up to size bytes
+{
+    OUTBUF * buf;
+    size_t n;
 
-    printf("</pre></body></html>");
+    buf = events ? &worker->events : &worker->out;
 
-    return;
+    n = buf->len < size ? buf->len : size;
+    memcpy(dest, buf->data, n);
+    memmove(buf->data, buf->data + n, buf->len - n);
+    buf->len -= n;
+    return n;
 }
 
 
-void print_timestamp (void)
+void engine_close (WORKER * worker)     // The worker's books stay in memory; there is no freeing a book
 {
-    char * ts;
-    ts = new_timestamp();
-    printf("%s", ts);
-    free(ts);
+    flush_due_tickers(worker, 1);
+    #if !defined(_WIN32)
+        sync_journals(worker);
+    #endif
     return;
 }
 
+#endif
 
-void print_memory_info (void)
-{
-    printf( "DebugInfo.inits_of_level: %d,\n"               // The compiler auto-concatenates these things
-            "DebugInfo.inits_of_fill: %d,\n"                // (note the lack of commas)
-            "DebugInfo.inits_of_fillnode: %d,\n"
-            "DebugInfo.inits_of_order: %d,\n"
-            "DebugInfo.inits_of_ordernode: %d,\n"
-            "DebugInfo.inits_of_account: %d,\n"
-            "DebugInfo.reallocs_of_global_order_list: %d,\n"
-            "DebugInfo.reallocs_of_global_account_list: %d,\n"
-            "DebugInfo.reallocs_of_account_order_list: %d",
-            DebugInfo.inits_of_level,
-            DebugInfo.inits_of_fill,
-            DebugInfo.inits_of_fillnode,
-            DebugInfo.inits_of_order,
-            DebugInfo.inits_of_ordernode,
-            DebugInfo.inits_of_account,
-            DebugInfo.reallocs_of_global_order_list,
-            DebugInfo.reallocs_of_global_account_list,
-            DebugInfo.reallocs_of_account_order_list
-            );
-    return;
-}
 
+#if !defined(DISORDERBOOK_NO_MAIN)       // disorderBook_bench.c includes this file and has its own main()
 
 int main (int argc, char ** argv)
 {
     char * eofcheck;
-    char * tmp;
     char input[MAXSTRING];
-    char tokens[MAXTOKENS][SMALLSTRING];
-    int id;
+    char * positional[2];
+    int positional_count = 0;
+    int workers = 1;
+    int shm = 0;
+    char * journal = NULL;
+    int64_t snapshotevery = 0;
+    int archive = 0;
+    int book_id;
     int n;
-    ORDER_AND_ERROR * o_and_e;
+    BOOK * book = NULL;
+    WORKER * worker;
+    int64_t started;
+
+    // Arguments are an optional venue and symbol, and the options -workers N, -shm, -journal DIR, -snapshotevery N,
+    // -archive N, -virtualclock SECONDS and -clockstep MICROSECONDS
+
+    for (n = 1; n < argc; n++)
+    {
+        if (strcmp(argv[n], "-workers") == 0 && n + 1 < argc)
+        {
+            workers = atoi(argv[n + 1]);
+            n++;
+        } else if (strcmp(argv[n], "-shm") == 0) {
+            shm = 1;
+        } else if (strcmp(argv[n], "-journal") == 0 && n + 1 < argc) {
+            journal = argv[n + 1];
+            n++;
+        } else if (strcmp(argv[n], "-snapshotevery") == 0 && n + 1 < argc) {
+            snapshotevery = atoll(argv[n + 1]);
+            n++;
+        } else if (strcmp(argv[n], "-archive") == 0 && n + 1 < argc) {
+            archive = atoi(argv[n + 1]);
+            n++;
+        } else if (strcmp(argv[n], "-virtualclock") == 0 && n + 1 < argc) {
+            VirtualClock = atoll(argv[n + 1]);
+            n++;
+        } else if (strcmp(argv[n], "-clockstep") == 0 && n + 1 < argc) {
+            ClockStep = atoi(argv[n + 1]);
+            n++;
+        } else if (positional_count < 2) {
+            positional[positional_count] = argv[n];
+            positional_count++;
+        } else {
+            positional_count = 3;       // Too many
+            break;
+        }
+    }
 
-    if (argc != 3)
+    if (positional_count != 0 && positional_count != 2)
     {
-        printf("Backend called with %d arguments (2 required). Quitting.\n", argc - 1);
+        printf("Backend called with %d arguments (0 or 2 required, plus optional -workers N, -shm, -journal DIR, -snapshotevery N, -archive N, -virtualclock SECONDS and -clockstep MICROSECONDS). Quitting.\n", positional_count);
         return 1;
     }
 
@@ -1585,157 +6098,148 @@ int main (int argc, char ** argv)
         _setmode(_fileno(stdout), _O_BINARY);
     #endif
 
-    safe_strcpy(Venue, argv[1], SMALLSTRING);
-    safe_strcpy(Symbol, argv[2], SMALLSTRING);
-
-    StartTime = new_timestamp();
-
-    safe_strcpy(Quote.quoteTime, StartTime, SMALLSTRING);
+    if (shm)
+    {
+        #if defined(_WIN32)
+            printf("Backend called with -shm, which isn't available on Windows. Quitting.\n");
+            return 1;
+        #else
+            init_shm();
+        #endif
+    }
 
-    while (1)
+    if (journal != NULL)
     {
-        eofcheck = fgets(input, MAXSTRING, stdin);
+        #if defined(_WIN32)
+            printf("Backend called with -journal, which isn't available on Windows. Quitting.\n");
+            return 1;
+        #else
+            JournalDir = journal;
+            SnapshotEvery = snapshotevery;
+        #endif
+    }
 
-        if (eofcheck == NULL)           // i.e. we HAVE reached EOF
-        {
-            printf("{\"ok\": false, \"error\": \"Unexpected EOF on stdin. Quitting.\"}");
-            end_message(stdout);
+    if (archive > 0)
+    {
+        #if defined(_WIN32)
+            printf("Backend called with -archive, which isn't available on Windows. Quitting.\n");
             return 1;
-        }
+        #else
+            ArchiveAfter = archive;
+        #endif
+    }
 
-        tmp = strtok(input, " \t\n\r");
-        for (n = 0; n < MAXTOKENS; n++)
-        {
-            tokens[n][0] = '\0';        // Clear the token in case there isn't one in this slot
-            if (tmp != NULL)
-            {
-                safe_strcpy(tokens[n], tmp, SMALLSTRING);
-                tmp = strtok(NULL, " \t\n\r");
-            }
-        }
+    init_workers(workers);
 
-        // Now handle whatever the request was.........
+    #if !defined(_WIN32)
+        start_output_thread();
+    #endif
 
-        if (strcmp("ORDER", tokens[0]) == 0)
-        {
-            o_and_e = execute_order(tokens[1], atoi(tokens[2]), atoi(tokens[3]), atoi(tokens[4]), atoi(tokens[5]), atoi(tokens[6]));
-            //                      account    account_int      qty              price            direction        orderType
+    // Called with a venue and symbol, we start with that as book 0 (and will
+    // probably never see another). Called without, we start with no books.
 
-            if (o_and_e->error)
+    if (positional_count == 2)
+    {
+        init_book(&Workers[0], 0, positional[0], positional[1]);
+        #if !defined(_WIN32)
+            if (JournalDir != NULL)
             {
-                printf("{\"ok\": false, \"error\": \"Backend error %d (account = %s, account_int = %d, qty = %d, price = %d, direction = %d, orderType = %d)\"}",
-                    o_and_e->error, tokens[1], atoi(tokens[2]), atoi(tokens[3]), atoi(tokens[4]), atoi(tokens[5]), atoi(tokens[6]));
-            } else {
-                print_order(stdout, o_and_e->order);
+                open_journal(AllBooks[0]);
             }
-            free(o_and_e);
-
-            end_message(stdout);
-            continue;
-        }
-
-        if (strcmp("ORDERBOOK_BINARY", tokens[0]) == 0)
-        {
-            print_orderbook_binary();
-            fflush(stdout);             // no end_message() call for binary
-            continue;
-        }
+        #endif
+    }
 
-        if (strcmp("STATUS", tokens[0]) == 0)
-        {
-            id = atoi(tokens[1]);
+    #if !defined(_WIN32)
+        MainThreadId = pthread_self();
+    #endif
 
-            if (id < 0 || id > HighestKnownOrder || AllOrders[id] == NULL)
-            {
-                printf("{\"ok\": false, \"error\": \"No such ID\"}");
-            } else {
-                print_order(stdout, AllOrders[id]);
-            }
+    start_workers();
 
-            end_message(stdout);
-            continue;
-        }
+    worker = &Workers[0];
 
-        if (strcmp("STATUSALL", tokens[0]) == 0)
+    while (1)
+    {
+        if (WorkerCount == 1)
         {
-            // This can return a stupid amount of data. Frontend might want to not honour requests for this.
-
-            id = atoi(tokens[1]);       // id is an account id in this case
-
-            if (id < 0 || id >= CurrentAccountArrayLen || AllAccounts[id] == NULL)      // The order matters here (short-circuit)
+            if (book != NULL)
             {
-                printf("{\"ok\": false, \"error\": \"Account not known on this book\"}");
-            } else {
-                print_all_orders_of_account(AllAccounts[id]);
+                maybe_flush_ticker(book);   // Does nothing unless conflating and the quote is dirty
+                #if !defined(_WIN32)
+                    maybe_snapshot(book);
+                    maybe_archive(book);
+                #endif
             }
+            flush_due_tickers(worker, 0);
+            emit_output(worker);
 
-            end_message(stdout);
-            continue;
-        }
-
-        if (strcmp("CANCEL", tokens[0]) == 0)
-        {
-            id = atoi(tokens[1]);
+            #if !defined(_WIN32)
+                maybe_sync_journals(worker, line_waiting() == 0);
+            #endif
 
-            if (id < 0 || id > HighestKnownOrder || AllOrders[id] == NULL)
+            if (worker->dirtybooks > 0 && line_waiting() == 0)
             {
-                printf("{\"ok\": false, \"error\": \"No such ID\"}");
-            } else {
-                cancel_order_by_id(id);
-                print_order(stdout, AllOrders[id]);
+                // We might be about to block waiting for the frontend. Wait out the rest of
+                // the conflation interval at most, then make sure the latest state goes out.
+
+                if (wait_for_input(ms_until_next_ticker(worker)) == 0)
+                {
+                    flush_due_tickers(worker, 1);
+                    emit_output(worker);
+                }
             }
-
-            end_message(stdout);
-            continue;
         }
 
-        if (strcmp("QUOTE", tokens[0]) == 0)
-        {
-            print_quote(stdout);
-            end_message(stdout);
-            continue;
-        }
+        eofcheck = read_line(input, MAXSTRING);
 
-        if (strcmp("__ACC_FROM_ID__", tokens[0]) == 0)
+        if (eofcheck == NULL)           // i.e. we HAVE reached EOF
         {
-            id = atoi(tokens[1]);
-
-            if (id < 0 || id > HighestKnownOrder || AllOrders[id] == NULL)
+            if (WorkerCount == 1)
             {
-                printf("ERROR None");
+                flush_due_tickers(worker, 1);
+                emit_output(worker);
+                #if !defined(_WIN32)
+                    sync_journals(worker);
+                #endif
             } else {
-                printf("OK %s", AllOrders[id]->account->name);
+                stop_workers();
             }
-
-            end_message(stdout);
-            continue;
-        }
-
-        if (strcmp("__DEBUG_MEMORY__", tokens[0]) == 0)
-        {
-            print_memory_info();
-            end_message(stdout);
-            continue;
+            #if !defined(_WIN32)
+                stop_output_thread();
+                if (ShmMode)
+                {
+                    return 1;           // Nobody reads our real stdout; the frontend just closed the ring
+                }
+            #endif
+            printf("{\"ok\": false, \"error\": \"Unexpected EOF on stdin. Quitting.\"}");
+            printf("\nEND\n");
+            fflush(stdout);
+            return 1;
         }
 
-        if (strcmp("__TIMESTAMP__", tokens[0]) == 0)
+        if (WorkerCount == 1)
         {
-            print_timestamp();
-            end_message(stdout);
+            started = monotonic_ns();
+            book = handle_command(worker, input);
+            if (book != NULL) clock_unpin(book);
+            finish_trace(worker, started);
+            if (book != NULL)
+            {
+                record_command(book, worker->stattype, monotonic_ns() - started);
+            }
             continue;
         }
 
-        if (strcmp("__SCORES__", tokens[0]) == 0)
-        {
-            print_scores();
-            end_message(stdout);
-            continue;
-        }
+        // Multi-threaded: pass the command to the worker that owns the book. Commands for
+        // impossible book ids go to worker 0, which will send the error message.
 
-        printf("{\"ok\": false, \"error\": \"Did not comprehend\"}");
-        end_message(stdout);
-        continue;
+        #if !defined(_WIN32)
+            book_id = peek_book_id(input);
+            if (book_id < 0 || book_id >= MAXBOOKS) book_id = 0;
+            ring_push(&Workers[book_id % WorkerCount], input);
+        #endif
     }
 
     return 0;
 }
+
+#endif
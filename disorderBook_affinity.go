@@ -0,0 +1,53 @@
+//go:build linux
+// +build linux
+
+package main
+
+// Pins the frontend itself to the cores kept for it by -affinity -reservecores, built with
+//
+//     go build disorderBook_front.go disorderBook_affinity.go
+//
+// Affinity belongs to each thread, so every thread the Go runtime has started so far is
+// pinned. This is done before the frontend starts any goroutines, and threads started
+// later inherit it from whichever thread starts them.
+
+import (
+    "io/ioutil"
+    "strconv"
+    "syscall"
+    "unsafe"
+)
+
+func init() {
+    PinFrontend = pin_frontend
+}
+
+func pin_frontend(cpus []int) error {
+
+    var mask [16]uint64         // 1024 cores, the same as the C library's cpu_set_t
+
+    for _, cpu := range cpus {
+        if cpu < 0 || cpu >= len(mask) * 64 {
+            return syscall.EINVAL
+        }
+        mask[cpu / 64] |= 1 << uint(cpu % 64)
+    }
+
+    tasks, err := ioutil.ReadDir("/proc/self/task")
+    if err != nil {
+        return err
+    }
+
+    for _, task := range tasks {
+        tid, err := strconv.Atoi(task.Name())
+        if err != nil {
+            continue
+        }
+        _, _, errno := syscall.RawSyscall(syscall.SYS_SCHED_SETAFFINITY, uintptr(tid), unsafe.Sizeof(mask), uintptr(unsafe.Pointer(&mask)))
+        if errno != 0 {
+            return errno
+        }
+    }
+
+    return nil
+}
@@ -0,0 +1,437 @@
+/*  Microbenchmark for the disorderBook backend. It includes the backend
+    itself, so there are no pipes or frontend involved:
+
+    gcc -O2 -o disorderBook_bench disorderBook_bench.c -pthread
+
+    Each profile gets a book of its own and feeds it synthetic commands
+    through handle_command(), exactly as the backend's main loop would. The
+    response and WebSocket messages are built as normal, then thrown away
+    (so formatting is measured, writing isn't). Every command is timed, and
+    for each profile we report commands per second, latency percentiles by
+    command type, and the book's DebugInfo allocation counts.
+
+    Profiles:
+
+    deep        Passive limit orders that never cross, over thousands of levels
+    sweep       A refilled book near the mid, swept by big aggressive orders
+    mm          Market makers that cancel and replace both sides every step
+    fokioc      FOK, IOC and market orders against a refilled book
+    accounts    Crossing limit orders from 5000 different accounts
+
+    Options: -profile <name>|all, -n <commands per profile> (default
+    20000), -seed <n>, and -archive <n> (as for the backend). The deep and
+    accounts profiles get slower as their books grow, so mind -n.
+
+    The workloads are the same for the same seed, so runs can be compared.
+
+    */
+
+#define DISORDERBOOK_NO_MAIN
+#include "disorderBook.c"
+
+#define BENCH_MID 5000              // Prices are in cents, like everything else
+#define BENCH_MAKERS 50
+#define OP_CANCEL 0                 // Other ops are indexed by orderType (LIMIT, MARKET, FOK, IOC)
+#define OP_COUNT 5
+
+typedef struct Bench_struct {
+    BOOK * book;
+    WORKER * worker;
+    int book_id;
+    int measure;                    // Setup commands aren't timed
+    int64_t * latencies[OP_COUNT];  // Nanoseconds, one per timed command
+    int counts[OP_COUNT];
+    int limit;                      // Size of each latency array
+    int64_t totalns;
+} BENCH;
+
+
+uint64_t RandomState = 88172645463325252ULL;
+
+
+uint32_t bench_random (void)        // xorshift64; the same seed always gives the same workload
+{
+    RandomState ^= RandomState << 13;
+    RandomState ^= RandomState >> 7;
+    RandomState ^= RandomState << 17;
+    return (uint32_t) (RandomState >> 32);
+}
+
+
+int random_between (int lo, int hi)     // Inclusive
+{
+    return lo + (int) (bench_random() % (uint32_t) (hi - lo + 1));
+}
+
+
+void run_command (BENCH * bench, int op, char * format, ...)
+{
+    char input[MAXSTRING];
+    int64_t start;
+    int64_t ns;
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(input, MAXSTRING, format, args);
+    va_end(args);
+
+    start = monotonic_ns();
+
+    if (handle_command(bench->worker, input) != NULL)
+    {
+        clock_unpin(bench->book);
+    }
+
+    #if !defined(_WIN32)
+        maybe_archive(bench->book);
+    #endif
+
+    ns = monotonic_ns() - start;
+
+    bench->worker->out.len = 0;         // Built but never written
+    bench->worker->events.len = 0;
+
+    if (bench->measure && bench->counts[op] < bench->limit)
+    {
+        bench->latencies[op][bench->counts[op]] = ns;
+        bench->counts[op] += 1;
+        bench->totalns += ns;
+    }
+    return;
+}
+
+
+int place_order (BENCH * bench, int account, int qty, int price, int direction, int orderType)     // Returns the order's id
+{
+    run_command(bench, orderType, "@%d ORDER bench%d %d %d %d %d %d", bench->book_id, account, account, qty, price, direction, orderType);
+    return bench->book->highestknownorder;
+}
+
+
+void cancel_order (BENCH * bench, int id)
+{
+    run_command(bench, OP_CANCEL, "@%d CANCEL %d", bench->book_id, id);
+    return;
+}
+
+
+void passive_order (BENCH * bench, int account, int spread)     // A limit order within spread cents of the mid, on a random side
+{
+    if (bench_random() % 2)
+    {
+        place_order(bench, account, random_between(1, 100), BENCH_MID - random_between(1, spread), BUY, LIMIT);
+    } else {
+        place_order(bench, account, random_between(1, 100), BENCH_MID + random_between(1, spread), SELL, LIMIT);
+    }
+    return;
+}
+
+
+// ---------------------------------- PROFILES -----------------------------------------------
+
+
+void profile_deep (BENCH * bench, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        passive_order(bench, random_between(0, 99), 4000);
+    }
+    return;
+}
+
+
+void profile_sweep (BENCH * bench, int n)
+{
+    int i;
+
+    bench->measure = 0;
+    for (i = 0; i < 2000; i++)
+    {
+        passive_order(bench, random_between(0, 99), 100);
+    }
+    bench->measure = 1;
+
+    for (i = 0; i < n; i++)
+    {
+        if (i % 10 == 9)            // Takes out around 500 shares' worth of levels
+        {
+            if (bench_random() % 2)
+            {
+                place_order(bench, 100, 500, BENCH_MID + 100, BUY, LIMIT);
+            } else {
+                place_order(bench, 100, 500, BENCH_MID - 100, SELL, LIMIT);
+            }
+        } else {
+            passive_order(bench, random_between(0, 99), 100);
+        }
+    }
+    return;
+}
+
+
+void profile_mm (BENCH * bench, int n)
+{
+    int bids[BENCH_MAKERS];
+    int asks[BENCH_MAKERS];
+    int mid = BENCH_MID;
+    int maker;
+    int i;
+
+    for (maker = 0; maker < BENCH_MAKERS; maker++)
+    {
+        bids[maker] = -1;
+        asks[maker] = -1;
+    }
+
+    // Each step, one maker moves both its quotes (two cancels, two orders). Now and
+    // then, a taker crosses the spread with an IOC.
+
+    i = 0;
+    while (i < n)
+    {
+        mid += random_between(-2, 2);
+        if (mid < 100) mid = 100;
+
+        if (bench_random() % 20 == 0)
+        {
+            if (bench_random() % 2)
+            {
+                place_order(bench, BENCH_MAKERS, random_between(1, 200), mid + 5, BUY, IOC);
+            } else {
+                place_order(bench, BENCH_MAKERS, random_between(1, 200), mid - 5, SELL, IOC);
+            }
+            i += 1;
+            continue;
+        }
+
+        maker = random_between(0, BENCH_MAKERS - 1);
+
+        if (bids[maker] >= 0) cancel_order(bench, bids[maker]);
+        if (asks[maker] >= 0) cancel_order(bench, asks[maker]);
+
+        bids[maker] = place_order(bench, maker, random_between(1, 100), mid - random_between(1, 10), BUY, LIMIT);
+        asks[maker] = place_order(bench, maker, random_between(1, 100), mid + random_between(1, 10), SELL, LIMIT);
+
+        i += 4;
+    }
+    return;
+}
+
+
+void profile_fokioc (BENCH * bench, int n)
+{
+    int orderType;
+    int i;
+
+    bench->measure = 0;
+    for (i = 0; i < 2000; i++)
+    {
+        passive_order(bench, random_between(0, 99), 50);
+    }
+    bench->measure = 1;
+
+    for (i = 0; i < n; i++)
+    {
+        switch (random_between(0, 4))
+        {
+            case 0:
+            case 1:
+                passive_order(bench, random_between(0, 99), 50);
+                continue;
+            case 2:
+                orderType = FOK;
+                break;
+            case 3:
+                orderType = IOC;
+                break;
+            default:
+                orderType = MARKET;
+                break;
+        }
+
+        if (bench_random() % 2)
+        {
+            place_order(bench, 100, random_between(1, 300), BENCH_MID + random_between(0, 20), BUY, orderType);
+        } else {
+            place_order(bench, 100, random_between(1, 300), BENCH_MID - random_between(0, 20), SELL, orderType);
+        }
+    }
+    return;
+}
+
+
+void profile_accounts (BENCH * bench, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        if (bench_random() % 2)
+        {
+            place_order(bench, random_between(0, MAXACCOUNTS - 1), random_between(1, 100), BENCH_MID + random_between(-10, 5), BUY, LIMIT);
+        } else {
+            place_order(bench, random_between(0, MAXACCOUNTS - 1), random_between(1, 100), BENCH_MID + random_between(-5, 10), SELL, LIMIT);
+        }
+    }
+    return;
+}
+
+
+// ---------------------------------- REPORTING -----------------------------------------------
+
+
+int compare_int64 (const void * a, const void * b)
+{
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+
+double percentile_us (int64_t * sorted, int count, double p)
+{
+    int index;
+
+    index = (int) (p * (count - 1) + 0.5);
+    return sorted[index] / 1000.0;
+}
+
+
+void report (BENCH * bench, char * name)
+{
+    char * opnames[OP_COUNT] = {"CANCEL", "LIMIT", "MARKET", "FOK", "IOC"};
+    OUTBUF memory = {NULL, 0, 0};
+    int total = 0;
+    int op;
+    int n;
+
+    for (op = 0; op < OP_COUNT; op++)
+    {
+        total += bench->counts[op];
+    }
+
+    printf("%s: %d commands in %.3f s of matching = %.0f per second\n",
+           name, total, bench->totalns / 1e9, total / (bench->totalns / 1e9));
+
+    for (op = 0; op < OP_COUNT; op++)
+    {
+        n = bench->counts[op];
+        if (n == 0) continue;
+
+        qsort(bench->latencies[op], n, sizeof(int64_t), compare_int64);
+
+        printf("    %-8s %8d   p50 %8.2f us   p90 %8.2f us   p99 %8.2f us   p99.9 %8.2f us   max %9.2f us\n",
+               opnames[op], n,
+               percentile_us(bench->latencies[op], n, 0.5),
+               percentile_us(bench->latencies[op], n, 0.9),
+               percentile_us(bench->latencies[op], n, 0.99),
+               percentile_us(bench->latencies[op], n, 0.999),
+               bench->latencies[op][n - 1] / 1000.0);
+    }
+
+    print_memory_info(bench->book, &memory);
+    out_printf(&memory, "\n");
+
+    printf("    ");
+    for (n = 0; n < (int) memory.len; n++)
+    {
+        putchar(memory.data[n]);
+        if (memory.data[n] == '\n' && n + 1 < (int) memory.len) printf("    ");
+    }
+    printf("\n");
+
+    free(memory.data);
+    return;
+}
+
+
+int main (int argc, char ** argv)
+{
+    char * names[] = {"deep", "sweep", "mm", "fokioc", "accounts"};
+    void (* profiles[])(BENCH *, int) = {profile_deep, profile_sweep, profile_mm, profile_fokioc, profile_accounts};
+    char * wanted = "all";
+    int count = 20000;
+    int found = 0;
+    int archive = 0;
+    BENCH bench;
+    int n;
+    int op;
+
+    for (n = 1; n < argc; n++)
+    {
+        if (strcmp(argv[n], "-profile") == 0 && n + 1 < argc)
+        {
+            wanted = argv[n + 1];
+            n++;
+        } else if (strcmp(argv[n], "-n") == 0 && n + 1 < argc) {
+            count = atoi(argv[n + 1]);
+            n++;
+        } else if (strcmp(argv[n], "-seed") == 0 && n + 1 < argc) {
+            RandomState = strtoull(argv[n + 1], NULL, 10) | 1;     // xorshift must never be seeded with 0
+            n++;
+        } else if (strcmp(argv[n], "-archive") == 0 && n + 1 < argc) {
+            archive = atoi(argv[n + 1]);
+            n++;
+        } else {
+            printf("Usage: %s [-profile deep|sweep|mm|fokioc|accounts|all] [-n N] [-seed N] [-archive N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (count < 1)
+    {
+        printf("-n must be positive\n");
+        return 1;
+    }
+
+    #if !defined(_WIN32)
+        ArchiveAfter = archive;
+    #else
+        if (archive > 0)
+        {
+            printf("-archive isn't available on Windows\n");
+            return 1;
+        }
+    #endif
+
+    init_workers(1);            // No output thread, so messages are built in the worker's buffers
+
+    for (n = 0; n < (int) (sizeof(names) / sizeof(names[0])); n++)
+    {
+        if (strcmp(wanted, "all") != 0 && strcmp(wanted, names[n]) != 0) continue;
+
+        found = 1;
+
+        memset(&bench, 0, sizeof(BENCH));
+        bench.book_id = n;
+        bench.book = init_book(&Workers[0], n, "BENCHEX", names[n]);
+        bench.worker = &Workers[0];
+        bench.measure = 1;
+        bench.limit = count;
+
+        for (op = 0; op < OP_COUNT; op++)
+        {
+            bench.latencies[op] = malloc(count * sizeof(int64_t));
+            check_ptr_or_quit(bench.latencies[op]);
+        }
+
+        profiles[n](&bench, count);
+        report(&bench, names[n]);
+
+        for (op = 0; op < OP_COUNT; op++)
+        {
+            free(bench.latencies[op]);
+        }
+    }
+
+    if (found == 0)
+    {
+        printf("No such profile: %s\n", wanted);
+        return 1;
+    }
+
+    return 0;
+}
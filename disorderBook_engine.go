@@ -0,0 +1,246 @@
+//go:build cgo && !windows
+// +build cgo,!windows
+
+package main
+
+// In-process engine (see -inprocess), built with
+//
+//     go build disorderBook_front.go disorderBook_engine.go
+//
+// (naming the files, so that cgo doesn't also compile disorderBook.c by itself). The C
+// file is compiled into the frontend as a library, and each "backend" is an engine handle
+// (a WORKER, to the C) owned by one goroutine, engine_controller(), which calls it
+// directly: no processes, pipes, request ids or response_reader(). Responses and
+// WebSocket messages are the same bytes the pipes would have carried, copied out into
+// buffers of ours, so everything else is unchanged.
+//
+// Book ids are shared by every engine in the process, so each engine maps its own
+// (the ones the rest of the frontend uses) to ids handed out here.
+
+/*
+#cgo CFLAGS: -O2 -std=gnu99 -DDISORDERBOOK_NO_MAIN -DDISORDERBOOK_ENGINE
+#cgo LDFLAGS: -lpthread
+#include "disorderBook.c"
+*/
+import "C"
+
+import (
+    "bufio"
+    "bytes"
+    "fmt"
+    "io"
+    "runtime"
+    "strconv"
+    "strings"
+    "sync"
+    "sync/atomic"
+    "time"
+    "unsafe"
+)
+
+type EventQueue struct {       // What ws_controller() reads instead of a backend's stderr
+    Chunks chan []byte
+    Current []byte
+}
+
+var EngineInit sync.Once
+var EngineBookIds int32 = -1    // Last book id handed out, accessed atomically
+
+func init() {
+    InProcessEngine = start_engine
+}
+
+func start_engine(backend * Backend, args []string) {
+
+    EngineInit.Do(func() {
+        C.engine_init(C.CString(Options.JournalDir), C.int64_t(Options.SnapshotEvery), C.int(Options.Archive),
+                      C.int64_t(Options.VirtualClock), C.int(Options.ClockStep))        // Strings are never freed
+    })
+
+    venue, symbol := "", ""
+    if len(args) >= 2 && strings.HasPrefix(args[0], "-") == false {
+        venue, symbol = args[0], args[1]
+    }
+
+    events := &EventQueue{Chunks: make(chan []byte, 256)}
+
+    backend.Readers.Add(2)
+
+    go func() {
+        ws_controller(events)
+        backend.Readers.Done()
+    }()
+    go engine_controller(backend, events, venue, symbol)
+}
+
+func engine_controller(backend * Backend, events * EventQueue, venue string, symbol string) {
+
+    runtime.LockOSThread()          // The C clock is per thread
+
+    engine := C.engine_new()
+
+    line_ptr := C.malloc(C.MAXSTRING)
+    defer C.free(line_ptr)
+    line := (*[C.MAXSTRING]byte)(line_ptr)[:]
+
+    ids := make(map[int]int)        // Our book ids to the engine's
+    var scratch []byte
+
+    take := func(which C.int) []byte {
+        n := C.engine_pending(engine, which)
+        if n == 0 {
+            return nil
+        }
+        buf := make([]byte, int(n))
+        C.engine_take(engine, which, (*C.char)(unsafe.Pointer(&buf[0])), n)
+        return buf
+    }
+
+    pass_events := func() {
+        if chunk := take(1); chunk != nil {
+            events.Chunks <- chunk
+        }
+    }
+
+    run := func(book_id int, clock int64, traced bool, command string) []byte {
+
+        if strings.HasPrefix(command, "__NEWBOOK__ ") {
+            if _, ok := ids[book_id]; ok == false {
+                ids[book_id] = int(atomic.AddInt32(&EngineBookIds, 1))
+            }
+        }
+
+        engine_id, ok := ids[book_id]
+        if ok == false {
+            engine_id = -1          // So the engine says there's no such book
+        }
+
+        scratch = scratch[:0]
+        if traced {
+            scratch = append(scratch, "#0~ "...)
+        }
+        scratch = append(scratch, '@')
+        scratch = strconv.AppendInt(scratch, int64(engine_id), 10)
+        scratch = append(scratch, ' ')
+        if clock > 0 {
+            scratch = append(scratch, '$')
+            scratch = strconv.AppendInt(scratch, clock, 10)
+            scratch = append(scratch, ' ')
+        }
+        scratch = append(scratch, command...)
+
+        n := copy(line[:C.MAXSTRING - 1], scratch)
+        line[n] = 0
+
+        C.engine_command(engine, (*C.char)(line_ptr))
+        pass_events()
+        return take(0)
+    }
+
+    if venue != "" {
+        engine_id := int(atomic.AddInt32(&EngineBookIds, 1))
+        c_venue, c_symbol := C.CString(venue), C.CString(symbol)
+        if C.engine_open_book(engine, C.int(engine_id), c_venue, c_symbol) != 0 {
+            ids[0] = engine_id
+        }
+        C.free(unsafe.Pointer(c_venue))
+        C.free(unsafe.Pointer(c_symbol))
+    }
+
+    command_chan := backend.CommandChan
+
+    for {
+        var msg Command
+        ok := true
+
+        if len(command_chan) > 0 {
+            msg, ok = <- command_chan
+        } else {
+
+            // Nothing waiting, so this is when the journals get written. With dirty tickers,
+            // wait out the rest of the conflation interval at most, then send the latest state.
+
+            idle_ms := int(C.engine_idle(engine, 0))
+            pass_events()
+
+            if idle_ms < 0 {
+                msg, ok = <- command_chan
+            } else {
+                timer := time.NewTimer(time.Duration(idle_ms) * time.Millisecond)
+                select {
+                    case msg, ok = <- command_chan:
+                        timer.Stop()
+                    case <- timer.C:
+                        C.engine_idle(engine, 1)
+                        pass_events()
+                        continue
+                }
+            }
+        }
+
+        if ok == false {
+            C.engine_close(engine)
+            pass_events()
+            close(events.Chunks)
+            backend.Readers.Done()
+            return
+        }
+
+        if msg.Trace != nil {
+            msg.Trace.Dequeued = time.Now()
+            msg.Trace.Flushed = msg.Trace.Dequeued
+        }
+
+        command := msg.Command
+
+        if len(command) == 0 || command[len(command) - 1] != '\n' {
+            command = command + "\n"
+        }
+
+        out := run(msg.BookId, msg.Clock, msg.Trace != nil, command)
+
+        if msg.Trace != nil {
+            msg.Trace.HeaderRead = time.Now()
+        }
+
+        reader := bufio.NewReader(bytes.NewReader(out))
+        var response []byte
+
+        if msg.Trace != nil {
+            reader.ReadString('\n')                 // The #0 line
+        }
+
+        if command == "ORDERBOOK_BINARY\n" {
+            response = read_binary_orderbook_response(reader, msg.Venue, msg.Symbol)
+        } else {
+            response = read_text_response(reader)
+        }
+
+        if msg.Trace != nil {
+            msg.Trace.BodyRead = time.Now()
+            timings, _ := reader.ReadString('\n')
+            fmt.Sscanf(timings, "%%0 %d %d %d", &msg.Trace.ParseNs, &msg.Trace.MatchNs, &msg.Trace.SerialiseNs)
+        }
+
+        msg.ResponseChan <- response
+    }
+}
+
+func (queue * EventQueue) Read(p []byte) (int, error) {
+
+    for len(queue.Current) == 0 {
+        chunk, ok := <- queue.Chunks
+        if ok == false {
+            return 0, io.EOF
+        }
+        queue.Current = chunk
+    }
+
+    n := copy(p, queue.Current)
+    queue.Current = queue.Current[n:]
+    return n, nil
+}
+
+func (queue * EventQueue) Close() error {
+    return nil
+}
@@ -9,12 +9,17 @@ import (
     "fmt"
     "io"
     "io/ioutil"
+    "math"
     "net/http"
     "os"
     "os/exec"
+    "path/filepath"
+    "runtime"
+    "sort"
     "strconv"
     "strings"
     "sync"
+    "sync/atomic"
     "time"
 
     "github.com/gorilla/websocket"      // go get github.com/gorilla/websocket
@@ -24,6 +29,7 @@ type PipesStruct struct {
     Stdin io.WriteCloser
     Stdout io.ReadCloser
     Stderr io.ReadCloser
+    Release func()              // If not nil, frees the transport once the backend has gone
 }
 
 type OrderStruct struct {
@@ -42,9 +48,30 @@ type OptionsStruct struct {
     Port                int
     WsPort              int
     AccountFilename     string
+    AdminAccount        string
     DefaultVenue        string
     DefaultSymbol       string
     Excess              bool
+    TickerMs            int
+    TickerCmds          int
+    Pipeline            int
+    Backends            int
+    Workers             int
+    Shm                 bool
+    DumpDir             string
+    JournalDir          string
+    SnapshotEvery       int
+    Archive             int
+    Hibernate           int
+    Trace               int
+    TraceSlowMs         int
+    VirtualClock        int64
+    ClockStep           int
+    Pool                int
+    InProcess           bool
+    Affinity            bool
+    ReserveCores        int
+    HotCmds             int
 }
 
 type WsInfo struct {
@@ -52,7 +79,22 @@ type WsInfo struct {
     Venue               string
     Symbol              string
     ConnType            int
-    MessageChannel      chan string
+    MessageChannel      chan *websocket.PreparedMessage         // Executions: bounded but reliable; if it fills we disconnect
+    TickerSlots         map[string]*websocket.PreparedMessage   // Tickers: latest unsent message per symbol ("latest wins")
+    TickerOrder         []string                // Symbols with a filled slot, in the order they were first filled
+    TickerSlots_MUTEX   sync.Mutex
+    Wake                chan bool               // Poked when a ticker slot is filled
+    Kick                chan bool               // Poked when the client must be disconnected
+    Sent                int64                   // Counters are accessed atomically
+    Coalesced           int64
+    Dropped             int64
+}
+
+type WsKey struct {            // WebSocket clients are indexed by what they subscribed to
+    Venue               string
+    Symbol              string      // "" for clients who want the whole venue
+    ConnType            int
+    Account             string      // "" for tickertape clients
 }
 
 type Command struct {
@@ -61,12 +103,95 @@ type Command struct {
     Command string
     HubCommand int
     CreateIfNeeded bool
+    BookId int
+    ResponseChan chan []byte
+    Trace * Trace               // nil unless this one was sampled (see -trace)
+    Clock int64                 // With -virtualclock, the time (Unix microseconds) to move the book's clock to, or 0
+}
+
+type RequestMeta struct {      // What relay() needs to know about the HTTP request, besides the command
+    Received time.Time          // Only set with -trace
+    Clock int64                 // From the X-Disorderbook-Clock header, only with -virtualclock
+}
+
+type Pending struct {          // A command sent to a backend whose response hasn't arrived yet
+    Venue string
+    Symbol string
+    Binary bool
     ResponseChan chan []byte
+    Trace * Trace
+    Response []byte             // Only used while waiting for the backend's timings for a trace
+}
+
+type Trace struct {            // When a sampled request reached each stage (see -trace)
+    Received time.Time          // main_handler() got it
+    Relayed time.Time           // ...and had parsed it
+    Queued time.Time            // send_to_backend() put it on the backend's CommandChan (after any wake)
+    Dequeued time.Time          // controller() took it off
+    Flushed time.Time           // ...and wrote it to the pipe
+    HeaderRead time.Time        // response_reader() saw the response begin
+    BodyRead time.Time          // ...and had all of it
+    Returned time.Time          // send_to_backend() got it back
+    Written time.Time           // relay() wrote the HTTP response
+    ParseNs int64               // These three are from the backend
+    MatchNs int64
+    SerialiseNs int64
+}
+
+type Backend struct {          // A backend process (or, with -inprocess, engine), hosting one book or many
+    Name string
+    CommandChan chan Command    // Closing this closes the backend's stdin, so it exits
+    Books int                   // Only touched while holding BookCreation_MUTEX
+    Process * exec.Cmd          // nil with -inprocess
+    Core int                    // With -affinity, the core it has to itself, or -1 if it shares (see place_backends())
+    Cpus string                 // ...and what it was last pinned to; these three are covered by Placement_MUTEX
+    Pinned bool
+    Stopping int32              // Set (atomically) when we're the ones closing it
+    Readers sync.WaitGroup      // Its stdout and stderr readers, which finish once it has gone
+    Release func()              // From PipesStruct
 }
 
-type BookInfo struct {
+type Book struct {
     Venue string
     Symbol string
+    BookId int                  // The id of the book within its backend
+    Backend * Backend           // nil while the book is hibernating (see -hibernate)
+    Backend_MUTEX sync.RWMutex  // Read-held by each command in flight; hibernating and waking write-hold it
+    LastUsed int64              // Unix nanoseconds, accessed atomically
+    Wakes int                   // These two are covered by Backend_MUTEX
+    LastWakeMs float64
+    Metrics BookMetrics
+}
+
+type BookMetrics struct {      // For /ob/api/admin/books
+    Commands [METRIC_TYPES]int64    // These seven are accessed atomically
+    InFlight int64              // Sent to the book but not yet answered
+    LatencyNs int64             // Total time spent waiting for the backend...
+    Responses int64             // ...over this many responses
+    WsSent int64                // Handed to WebSocket clients (by ws_controller), not counting...
+    WsCoalesced int64           // ...tickers that replaced an unsent one, and so will never be sent
+    WsDropped int64             // Executions that a full client queue couldn't take
+    Polled BookPoll             // The rest are covered by Polled_MUTEX
+    Polled_MUTEX sync.Mutex
+    LastCommands [METRIC_TYPES]int64
+    LastLatencyNs int64
+    LastResponses int64
+}
+
+type BookPoll struct {         // Worked out by metrics_poller() every METRICS_INTERVAL
+    Rates [METRIC_TYPES]float64     // Commands per second
+    LatencyUs float64           // Mean over the interval
+    RestingOrders int64         // These two are from the backend's __MEMORY__
+    LiveBytes int64
+    PolledAt int64              // Unix nanoseconds of the last successful __MEMORY__, or 0
+}
+
+type MemoryResponse struct {
+    Ok bool                     `json:"ok"`
+    LiveBytes int64             `json:"liveBytes"`
+    Types map[string]struct {
+        Live int64              `json:"live"`
+    }                           `json:"types"`
 }
 
 var HEARTBEAT_OK      = []byte(`{"ok": true, "error": ""}`)
@@ -93,6 +218,7 @@ var MYSTERY_HUB_CMD   = []byte(`{"ok": false, "error": "Hub received unknown hub
 var STATUS_ON_UNKNOWN = []byte(`{"ok": false, "error": "Status/cancel on unknown book"}`)
 var BAD_METHOD        = []byte(`{"ok": false, "error": "Method not allowed, use GET, DELETE, POST only"}`)
 var BAD_METHOD_HERE   = []byte(`{"ok": false, "error": "Method not allowed at this URL"}`)
+var BACKEND_DIED      = []byte(`{"ok": false, "error": "Backend died"}`)
 
 const (
     VENUES_LIST = 1
@@ -117,6 +243,35 @@ const (
     EXECUTION = 2
 )
 
+const (
+    METRIC_ORDER = iota         // Types of command counted for /ob/api/admin/books
+    METRIC_CANCEL
+    METRIC_STATUS
+    METRIC_ORDERBOOK
+    METRIC_QUOTE
+    METRIC_OTHER
+    METRIC_TYPES
+)
+
+var MetricNames = [METRIC_TYPES]string{"order", "cancel", "status", "orderbook", "quote", "other"}
+
+const METRICS_INTERVAL = 5 * time.Second
+
+type PlacementStruct struct {  // With -affinity, what place_backends() last decided
+    Shared string               // Cores shared by every backend without one of its own
+    Moves int                   // Times a backend has been given its own core or sent back to the shared ones
+    Report []BackendPlacement   // The backends part of /ob/api/admin/placement
+}
+
+type BackendPlacement struct {
+    Backend string              `json:"backend"`
+    Books []string              `json:"books"`
+    CommandsPerSec float64      `json:"commandsPerSec"`
+    OwnCore bool                `json:"ownCore"`
+    Cpus string                 `json:"cpus"`
+    Pinned bool                 `json:"pinned"`
+}
+
 const FRONTPAGE = `<html>
 <head><title>disorderBook</title></head>
 <body><pre>
@@ -141,23 +296,43 @@ const FRONTPAGE = `<html>
 // The following globals are unsafe -- could be touched by multiple goroutines (e.g. web handlers):
 
 var AccountInts = make(map[string]int)
+var BookCount = 0
 var WebSocketClients = make([]*WsInfo, 0)
+var WebSocketIndex = make(map[WsKey][]*WsInfo)
+var Placement PlacementStruct
 
 // The following are mutexes for the above:
 
 var AccountInts_MUTEX sync.RWMutex
-var WebSocketClients_MUTEX sync.RWMutex
+var BookCreation_MUTEX sync.Mutex                // Serialises book creation, covers BookCount
+var WebSocketClients_MUTEX sync.RWMutex          // Covers both the list and the index
+var Placement_MUTEX sync.Mutex                   // Covers Placement, and each Backend's Core, Cpus and Pinned
 
 // The following globals are safe because they are only written to before the various goroutines start:
 
 var Options OptionsStruct
+var SharedBackends = make([]*Backend, 0)        // Only used if Options.Backends > 0
+var BackendPool chan *Backend = nil             // Only used if Options.Pool > 0
 var AuthMode = false
+var ShmTransport func(exec_command * exec.Cmd) PipesStruct = nil      // Set by disorderBook_shm.go, if built with it
+var InProcessEngine func(backend * Backend, args []string) = nil      // Set by disorderBook_engine.go, if built with it
+var PinFrontend func(cpus []int) error = nil    // Set by disorderBook_affinity.go, if built with it
+var FrontendCpus []int                          // Only used with -affinity: cores reserved for us...
+var BackendCpus []int                           // ...and the ones the backends get
+var FrontendPinned = false
 var Auth = make(map[string]string)
+var AccountsFile * os.File = nil               // Only used with -journal; covered by AccountInts_MUTEX
 
 // The following globals are safe because they are never "written" to as such:
 
 var Upgrader = websocket.Upgrader{ReadBufferSize: 1024, WriteBufferSize: 1024, CheckOrigin: func(r *http.Request) bool {return true}}
-var GlobalCommandChan = make(chan Command)
+
+// The map of books is copy-on-write: a stored map is never modified, creating a book stores
+// a new one. So anyone can look up a book without locking (creation is behind a mutex).
+
+var Books atomic.Value          // map[string]map[string]*Book
+
+var TraceCounter int64          // Accessed atomically
 
 // -------------------------------------------------------------------------------------------------------
 
@@ -166,12 +341,113 @@ func main() {
     flag.IntVar(&Options.MaxBooks, "maxbooks", 100, "Maximum number of books")
     flag.IntVar(&Options.Port, "port", 8000, "Port for web API and WebSockets")
     flag.StringVar(&Options.AccountFilename, "accounts", "", "Accounts file for authentication")
+    flag.StringVar(&Options.AdminAccount, "adminaccount", "admin", "With -accounts, the account whose API key the /ob/api/admin routes need")
     flag.StringVar(&Options.DefaultVenue, "venue", "TESTEX", "Default venue")
     flag.StringVar(&Options.DefaultSymbol, "symbol", "FOOBAR", "Default symbol")
     flag.BoolVar(&Options.Excess, "excess", false, "Enable commands that can return excessive responses")
+    flag.IntVar(&Options.TickerMs, "tickerms", 0, "Ticker conflation: minimum milliseconds between tickers per book (0 = off)")
+    flag.IntVar(&Options.TickerCmds, "tickercmds", 0, "Ticker conflation: send a dirty ticker at least every N commands (0 = off)")
+
+    flag.IntVar(&Options.Pipeline, "pipeline", 64, "Maximum commands in flight to each backend")
+    flag.IntVar(&Options.Backends, "backends", 0, "Number of shared backend processes to host all the books (0 = one process per book)")
+    flag.IntVar(&Options.Workers, "workers", 1, "Worker threads in each shared backend (books are split between them)")
+    flag.StringVar(&Options.DumpDir, "dumpdir", "", "Directory for book dumps made via /ob/api/admin/ (default: dumps disabled)")
+    flag.StringVar(&Options.JournalDir, "journal", "", "Directory for book journals; journaled books are rebuilt on restart (default: no journals)")
+    flag.IntVar(&Options.SnapshotEvery, "snapshotevery", 0, "With -journal, snapshot each book every N journaled commands so restarts replay less (0 = only via /ob/api/admin/)")
+    flag.IntVar(&Options.Hibernate, "hibernate", 0, "With -journal, shut down a book's backend once it has been idle this many seconds, and restart it when next used (0 = never)")
+    flag.IntVar(&Options.Archive, "archive", 0, "Move closed orders at least N orders old out of RAM into a file in $TMPDIR (0 = never)")
+    flag.BoolVar(&Options.Shm, "shm", false, "Talk to backends through shared memory instead of pipes (needs disorderBook_shm.go)")
+    flag.IntVar(&Options.Trace, "trace", 0, "Trace one request in N through every stage, logging those slower than -traceslowms (0 = off)")
+    flag.IntVar(&Options.TraceSlowMs, "traceslowms", 10, "With -trace, log traced requests that took at least this many milliseconds")
+    flag.Int64Var(&Options.VirtualClock, "virtualclock", 0, "Give the books a virtual clock starting at this Unix time (seconds), so replays are deterministic; an X-Disorderbook-Clock header (Unix microseconds) moves it on (0 = real time)")
+    flag.IntVar(&Options.ClockStep, "clockstep", 0, "With -virtualclock, microseconds the clock moves on before each command")
+    flag.IntVar(&Options.Pool, "pool", 0, "Keep this many idle backends running, so a new (or waking) book needn't wait for one to start (0 = none)")
+    flag.BoolVar(&Options.Affinity, "affinity", false, "Pin backends to cores, giving each busy one a core to itself and packing the rest together (Linux only)")
+    flag.IntVar(&Options.ReserveCores, "reservecores", 0, "With -affinity, keep this many cores for the frontend itself (HTTP and WebSockets); the backends get the rest")
+    flag.IntVar(&Options.HotCmds, "hotcmds", 1000, "With -affinity, commands per second at which a backend gets a core to itself")
+    flag.BoolVar(&Options.InProcess, "inprocess", false, "Run the C engine inside this process instead of as backend processes (needs disorderBook_engine.go and cgo; -shm and -workers then don't apply)")
 
     flag.Parse()
 
+    if Options.Pipeline < 1 {
+        Options.Pipeline = 1
+    }
+
+    if strings.ContainsAny(Options.DumpDir, " \t\r\n") || len(Options.DumpDir) > 40 {
+        fmt.Printf("Dump directory must be a short path with no spaces.\n\n")     // It gets sent to the backend as one token
+        os.Exit(1)
+    }
+
+    if Options.JournalDir != "" {
+        if runtime.GOOS == "windows" {
+            fmt.Printf("Journals aren't available on Windows.\n\n")
+            os.Exit(1)
+        }
+        err := os.MkdirAll(Options.JournalDir, 0755)
+        if err != nil {
+            fmt.Printf("Couldn't create journal directory: %v\n\n", err)
+            os.Exit(1)
+        }
+    }
+
+    if Options.Hibernate > 0 && (Options.JournalDir == "" || Options.Backends > 0) {
+        fmt.Printf("Hibernation needs -journal, and a backend per book (no -backends).\n\n")
+        os.Exit(1)
+    }
+
+    if Options.Pool > 0 && Options.Backends > 0 {
+        fmt.Printf("A pool of backends is only for a backend per book (no -backends).\n\n")
+        os.Exit(1)
+    }
+
+    if Options.Archive > 0 && runtime.GOOS == "windows" {
+        fmt.Printf("Archiving isn't available on Windows.\n\n")
+        os.Exit(1)
+    }
+
+    if Options.Shm && ShmTransport == nil {
+        fmt.Printf("Shared memory transport not built in (build with disorderBook_shm.go, not on Windows); using pipes\n")
+        Options.Shm = false
+    }
+
+    if Options.InProcess && InProcessEngine == nil {
+        fmt.Printf("In-process engine not built in (build with disorderBook_engine.go and cgo, not on Windows); using backend processes\n")
+        Options.InProcess = false
+    }
+
+    if Options.InProcess && (Options.Hibernate > 0 || Options.Pool > 0) {
+        fmt.Printf("In-process books can't hibernate or be pooled (no -hibernate or -pool with -inprocess).\n\n")
+        os.Exit(1)
+    }
+
+    if Options.Affinity {
+        if runtime.GOOS != "linux" {
+            fmt.Printf("CPU affinity is only available on Linux.\n\n")
+            os.Exit(1)
+        }
+        cpus := allowed_cpus()
+        if Options.ReserveCores < 0 || Options.ReserveCores >= len(cpus) {
+            fmt.Printf("-reservecores must leave at least one core for the backends (%d available).\n\n", len(cpus))
+            os.Exit(1)
+        }
+        FrontendCpus = cpus[:Options.ReserveCores]
+        BackendCpus = cpus[Options.ReserveCores:]
+        Placement.Shared = cpu_list(BackendCpus)
+
+        // Pinned before any backend starts (they'd inherit it, until told otherwise) and
+        // before the goroutines start, so that any threads the runtime adds inherit it too.
+
+        if len(FrontendCpus) > 0 {
+            if PinFrontend == nil {
+                fmt.Printf("Frontend pinning not built in (build with disorderBook_affinity.go); its cores are only kept free of backends\n")
+            } else if err := PinFrontend(FrontendCpus); err != nil {
+                fmt.Printf("Couldn't pin the frontend to cores %s: %v\n", cpu_list(FrontendCpus), err)
+            } else {
+                FrontendPinned = true
+            }
+        }
+    }
+
     fmt.Printf("\ndisorderBook (C+Go version) starting up on port %d\n", Options.Port)
 
     if Options.AccountFilename != "" {
@@ -181,19 +457,38 @@ func main() {
         fmt.Printf("\n-----> Warning: running WITHOUT AUTHENTICATION! <-----\n\n")
     }
 
-    go hub()
+    if Options.JournalDir != "" {
+        load_account_ints()            // Before any book is rebuilt from a journal that uses them
+    }
 
-    // Create the default venue...
-    result_chan := make(chan []byte)
-    msg := Command{
-        ResponseChan: result_chan,
-        Venue: Options.DefaultVenue,
-        Symbol: Options.DefaultSymbol,
-        CreateIfNeeded: true,
-        Command: "THIS_DOES_NOT_MATTER",
+    Books.Store(make(map[string]map[string]*Book))
+
+    for n := 0; n < Options.Backends; n++ {
+        name := fmt.Sprintf("shared backend %d", n)
+        if Options.Workers > 1 {
+            SharedBackends = append(SharedBackends, start_backend(name, "-workers", strconv.Itoa(Options.Workers)))
+        } else {
+            SharedBackends = append(SharedBackends, start_backend(name))
+        }
+    }
+
+    if Options.Pool > 0 {
+        BackendPool = make(chan *Backend, Options.Pool - 1)        // pool_filler() holds the other one
+        go pool_filler()
+    }
+
+    // Create the default venue, and bring back any books that were journaled last time...
+    get_book(Options.DefaultVenue, Options.DefaultSymbol, true)
+
+    if Options.JournalDir != "" {
+        restore_journaled_books()
     }
-    GlobalCommandChan <- msg
-    <- result_chan              // Need to read a result to prevent deadlock
+
+    if Options.Hibernate > 0 {
+        go hibernator()
+    }
+
+    go metrics_poller()
 
     server_string := fmt.Sprintf("127.0.0.1:%d", Options.Port)
 
@@ -207,6 +502,14 @@ func main_handler(writer http.ResponseWriter, request * http.Request) {
     // Each time a new web request comes in (not including
     // WebSocket connections) this is called as a new goroutine.
 
+    var meta RequestMeta
+    if Options.Trace > 0 {
+        meta.Received = time.Now()
+    }
+    if Options.VirtualClock > 0 {
+        meta.Clock, _ = strconv.ParseInt(request.Header.Get("X-Disorderbook-Clock"), 10, 64)
+    }
+
     writer.Header().Set("Content-Type", "application/json")     // A few things change this later
 
     request_api_key := request.Header.Get("X-Starfighter-Authorization")
@@ -256,7 +559,7 @@ func main_handler(writer http.ResponseWriter, request * http.Request) {
             msg := Command{
                 HubCommand: VENUES_LIST,
             }
-            relay(msg, writer)
+            relay(msg, writer, meta)
             return
         }
     }
@@ -271,7 +574,7 @@ func main_handler(writer http.ResponseWriter, request * http.Request) {
                 Venue: venue,
                 HubCommand: VENUE_HEARTBEAT,
             }
-            relay(msg, writer)
+            relay(msg, writer, meta)
             return
         }
     }
@@ -297,7 +600,7 @@ func main_handler(writer http.ResponseWriter, request * http.Request) {
             Venue: venue,
             HubCommand: STOCK_LIST,
         }
-        relay(msg, writer)
+        relay(msg, writer, meta)
         return
     }
 
@@ -314,7 +617,7 @@ func main_handler(writer http.ResponseWriter, request * http.Request) {
                 Command: "QUOTE",
                 CreateIfNeeded: true,
             }
-            relay(msg, writer)
+            relay(msg, writer, meta)
             return
         }
     }
@@ -332,7 +635,7 @@ func main_handler(writer http.ResponseWriter, request * http.Request) {
                 Command: "ORDERBOOK_BINARY",
                 CreateIfNeeded: true,
             }
-            relay(msg, writer)
+            relay(msg, writer, meta)
             return
         }
     }
@@ -359,6 +662,11 @@ func main_handler(writer http.ResponseWriter, request * http.Request) {
                 return
             }
 
+            if bad_name(account) {
+                writer.Write(BAD_ACCOUNT_NAME)
+                return
+            }
+
             if AuthMode {       // Do this before the acc_id int is generated
                 api_key, ok := Auth[account]
                 if api_key != request_api_key || ok == false {
@@ -367,13 +675,7 @@ func main_handler(writer http.ResponseWriter, request * http.Request) {
                 }
             }
 
-            AccountInts_MUTEX.Lock()
-            acc_id, ok := AccountInts[account]
-            if !ok {
-                acc_id = len(AccountInts)
-                AccountInts[account] = acc_id
-            }
-            AccountInts_MUTEX.Unlock()
+            acc_id := account_int(account)
 
             msg := Command{
                 Venue: venue,
@@ -381,7 +683,7 @@ func main_handler(writer http.ResponseWriter, request * http.Request) {
                 Command: "STATUSALL " + strconv.Itoa(acc_id),
                 CreateIfNeeded: true,
             }
-            relay(msg, writer)
+            relay(msg, writer, meta)
             return
         }
     }
@@ -410,17 +712,14 @@ func main_handler(writer http.ResponseWriter, request * http.Request) {
         // send that on to the client. Once we have the info we can make the real request.
 
         command := "__ACC_FROM_ID__ " + strconv.Itoa(id)
-        result_chan := make(chan []byte)
 
         msg := Command{
-            ResponseChan: result_chan,
             Venue: venue,
             Symbol: symbol,
             Command: command,
             CreateIfNeeded: false,
         }
-        GlobalCommandChan <- msg
-        res1 := <- result_chan
+        res1 := send_command(msg)
 
         // If the book didn't exist we will receive one of these replies...
         if bytes.Equal(res1, UNKNOWN_VENUE) || bytes.Equal(res1, UNKNOWN_SYMBOL) {
@@ -456,7 +755,7 @@ func main_handler(writer http.ResponseWriter, request * http.Request) {
             Command: command,
             CreateIfNeeded: false,
         }
-        relay(msg, writer)
+        relay(msg, writer, meta)
         return
     }
 
@@ -559,13 +858,7 @@ func main_handler(writer http.ResponseWriter, request * http.Request) {
 
             // Do the account-ID generation as late as possible so we don't get unused IDs if we return early
 
-            AccountInts_MUTEX.Lock()
-            acc_id, ok := AccountInts[raw_order.Account]
-            if !ok {
-                acc_id = len(AccountInts)
-                AccountInts[raw_order.Account] = acc_id
-            }
-            AccountInts_MUTEX.Unlock()
+            acc_id := account_int(raw_order.Account)
 
             command := fmt.Sprintf("ORDER %s %d %d %d %d %d", raw_order.Account, acc_id, raw_order.Qty, raw_order.Price, int_direction, int_ordertype)
 
@@ -575,7 +868,7 @@ func main_handler(writer http.ResponseWriter, request * http.Request) {
                 Command: command,
                 CreateIfNeeded: true,
             }
-            relay(msg, writer)
+            relay(msg, writer, meta)
             return
         }
     }
@@ -595,256 +888,1391 @@ func main_handler(writer http.ResponseWriter, request * http.Request) {
                 Command: "__SCORES__",
                 CreateIfNeeded: false,
             }
-            relay(msg, writer)
+            relay(msg, writer, meta)
             return
         }
     }
 
-    // Unknown...................................................................................
-
-    writer.Write(UNKNOWN_PATH)
-    return
-}
+    // Admin routes: with -accounts, only for the admin account...................................
 
-func relay(msg Command, writer http.ResponseWriter) {
+    if len(pathlist) >= 3 && pathlist[2] == "admin" && AuthMode {
+        api_key, ok := Auth[Options.AdminAccount]
+        if api_key != request_api_key || ok == false {
+            writer.Write(AUTH_FAILURE)
+            return
+        }
+    }
 
-    // Send the message to the hub, read the response via a channel,
-    // and then send that response to the http client.
+    // Admin: dump a book's whole history to a CSV file (POST), or check on its dumps (GET)......
 
-    result_chan := make(chan []byte)
-    msg.ResponseChan = result_chan
-    GlobalCommandChan <- msg
-    res := <- result_chan
-    writer.Write(res)
-    return
-}
+    if len(pathlist) == 8 && pathlist[2] == "admin" && pathlist[3] == "venues" && pathlist[5] == "stocks" && pathlist[7] == "dumps" {
 
-func hub() {
+        if Options.DumpDir == "" {
+            writer.Write(DISABLED)
+            return
+        }
 
-    // All web-handlers that need some sort of considered response send their commands to the hub.
-    // The real reason for this is that the books are behind a map; accessing which is not thread-safe.
-    // Earlier architecture ended up with a ton of mutex calls and a map of mutexes behind a mutex...
+        command := "DUMPSTATUS"
+        if request.Method == "POST" {
+            command = "DUMP " + Options.DumpDir
+        }
 
-    books := make(map[string]map[string]chan Command)
-    bookcount := 0
+        msg := Command{
+            Venue: pathlist[4],
+            Symbol: pathlist[6],
+            Command: command,
+            CreateIfNeeded: false,
+        }
+        relay(msg, writer, meta)
+        return
+    }
 
-    hub_command_chan := make(chan Command)
-    hub_update_chan := make(chan BookInfo)
+    // Admin: snapshot a journaled book, so its journal can be cut short (POST), or check on it (GET)....
 
-    go hub_command_handler(hub_command_chan, hub_update_chan)
+    if len(pathlist) == 8 && pathlist[2] == "admin" && pathlist[3] == "venues" && pathlist[5] == "stocks" && pathlist[7] == "snapshot" {
 
-    for {
-        msg := <- GlobalCommandChan
+        if Options.JournalDir == "" {
+            writer.Write(DISABLED)
+            return
+        }
 
-        // Check whether the command was to the hub or to the book...
+        command := "SNAPSHOTSTATUS"
+        if request.Method == "POST" {
+            command = "SNAPSHOT"
+        }
 
-        if msg.HubCommand != 0 {
-            hub_command_chan <- msg
-            continue
+        msg := Command{
+            Venue: pathlist[4],
+            Symbol: pathlist[6],
+            Command: command,
+            CreateIfNeeded: false,
         }
+        relay(msg, writer, meta)
+        return
+    }
 
-        // Command was a real command to a book...
-        // But maybe it doesn't exist and we can ignore it?
+    // Admin: a book's command timings and matching counters (GET), reset after reporting (POST).....
 
-        venue, symbol := msg.Venue, msg.Symbol
+    if len(pathlist) == 8 && pathlist[2] == "admin" && pathlist[3] == "venues" && pathlist[5] == "stocks" && pathlist[7] == "stats" {
 
-        if msg.CreateIfNeeded == false {
-            if books[venue] == nil {
-                msg.ResponseChan <- UNKNOWN_VENUE
-                continue
-            }
-            if books[venue][symbol] == nil {
-                msg.ResponseChan <- UNKNOWN_SYMBOL
-                continue
-            }
+        command := "__STATS__"
+        if request.Method == "POST" {
+            command = "__STATS__ RESET"
         }
 
-        // Either the book exists or we need to create it...
-
-        if books[venue] == nil || books[venue][symbol] == nil {     // Short circuits if no venue
-
-            if bad_name(venue) || bad_name(symbol) {
-                msg.ResponseChan <- BAD_BOOK_NAME
-                continue
-            }
+        msg := Command{
+            Venue: pathlist[4],
+            Symbol: pathlist[6],
+            Command: command,
+            CreateIfNeeded: false,
+        }
+        relay(msg, writer, meta)
+        return
+    }
 
-            if bookcount >= Options.MaxBooks {
-                msg.ResponseChan <- TOO_MANY_BOOKS
-                continue
-            }
+    // Admin: a book's live heap use by type, and the most it has used...........................
 
-            if books[venue] == nil {
-                books[venue] = make(map[string]chan Command)
-            }
+    if len(pathlist) == 8 && pathlist[2] == "admin" && pathlist[3] == "venues" && pathlist[5] == "stocks" && pathlist[7] == "memory" {
+        msg := Command{
+            Venue: pathlist[4],
+            Symbol: pathlist[6],
+            Command: "__MEMORY__",
+            CreateIfNeeded: false,
+        }
+        relay(msg, writer, meta)
+        return
+    }
 
-            new_command_chan := make(chan Command)
-            books[venue][symbol] = new_command_chan
-            bookcount += 1
+    // Admin: which books are hibernating, and how long they took to wake..........................
 
-            hub_update_chan <- BookInfo{venue, symbol}
+    if len(pathlist) == 4 && pathlist[2] == "admin" && pathlist[3] == "hibernation" {
+        if Options.Hibernate == 0 {
+            writer.Write(DISABLED)
+            return
+        }
+        writer.Write(hibernation_report())
+        return
+    }
 
-            exec_command := exec.Command("./disorderBook.exe", venue, symbol)
-            i_pipe, _ := exec_command.StdinPipe()
-            o_pipe, _ := exec_command.StdoutPipe()
-            e_pipe, _ := exec_command.StderrPipe()
+    // Admin: every book's traffic, latency, WebSocket load, resting orders and memory.........
 
-            // Should maybe handle errors from the above.
+    if len(pathlist) == 4 && pathlist[2] == "admin" && pathlist[3] == "books" {
+        writer.Write(metrics_report())
+        return
+    }
 
-            new_pipes_struct := PipesStruct{i_pipe, o_pipe, e_pipe}
+    // Admin: which cores each backend is pinned to, and why.....................................
 
-            exec_command.Start()
-            go ws_controller(venue, symbol, e_pipe)
-            go controller(venue, symbol, new_pipes_struct, new_command_chan)
-            fmt.Printf("Creating %s %s\n", venue, symbol)
+    if len(pathlist) == 4 && pathlist[2] == "admin" && pathlist[3] == "placement" {
+        if Options.Affinity == false {
+            writer.Write(DISABLED)
+            return
         }
+        writer.Write(placement_report())
+        return
+    }
 
-        // The book exists...
+    // Admin: WebSocket clients and their counters...............................................
 
-        books[venue][symbol] <- msg
+    if len(pathlist) == 4 && pathlist[2] == "admin" && pathlist[3] == "websockets" {
+        writer.Write(ws_client_report())
+        return
     }
+
+    // Unknown...................................................................................
+
+    writer.Write(UNKNOWN_PATH)
+    return
 }
 
-func hub_command_handler(hub_command_chan chan Command, hub_update_chan chan BookInfo) {
+func relay(msg Command, writer http.ResponseWriter, meta RequestMeta) {
 
-    // Some commands aren't dealt with by passing them to a book but rather are queries of global state.
-    // This goroutine keeps a copy of the relevant state up-to-date by receiving messages from the hub
-    // about new book creation. It thus is able to deal with the commands for such state.
+    // Send the message to the book (or deal with it here if it's a
+    // query of global state) and then send the response to the http client.
 
-    venue_symbol_map := make(map[string]map[string]bool)   // bool is adequate here
+    msg.Trace = sample_trace(meta.Received)
+    msg.Clock = meta.Clock
 
-    for {
-        select {
-            case cmd := <- hub_command_chan:
-                handle_hub_command(cmd, venue_symbol_map)
+    writer.Write(send_command(msg))
 
-            case update := <- hub_update_chan:
-                if venue_symbol_map[update.Venue] == nil {
-                    venue_symbol_map[update.Venue] = make(map[string]bool)
-                }
-                venue_symbol_map[update.Venue][update.Symbol] = true
-        }
+    if msg.Trace != nil {
+        msg.Trace.Written = time.Now()
+        report_trace(msg)
     }
+    return
 }
 
-func handle_hub_command(msg Command, venue_symbol_map map[string]map[string]bool) {
-    var buffer bytes.Buffer
-    switch msg.HubCommand {
+func send_command(msg Command) []byte {
 
-        case VENUES_LIST:
+    if msg.HubCommand != 0 {
+        return handle_hub_command(msg)
+    }
 
-            commaflag := false
-            buffer.WriteString("{\n  \"ok\": true,\n  \"venues\": [")
-            for v := range venue_symbol_map {
-                name := v + " Exchange"
-                if commaflag {
-                    buffer.WriteString(",")
-                }
-                line := fmt.Sprintf("\n    {\"name\": \"%s\", \"state\": \"open\", \"venue\": \"%s\"}", name, v)
-                buffer.WriteString(line)
-                commaflag = true
-            }
-            buffer.WriteString("\n  ]\n}")
+    book, errmsg := get_book(msg.Venue, msg.Symbol, msg.CreateIfNeeded)
+    if book == nil {
+        return errmsg
+    }
 
-        case VENUE_HEARTBEAT:
+    return send_to_book(book, msg)
+}
 
-            if venue_symbol_map[msg.Venue] == nil {
-                buffer.Write(NO_VENUE_HEART)
-            } else {
-                line := fmt.Sprintf(`{"ok": true, "venue": "%s"}`, msg.Venue)
-                buffer.WriteString(line)
-            }
+func send_to_book(book * Book, msg Command) []byte {
 
-        case STOCK_LIST:
+    atomic.StoreInt64(&book.LastUsed, time.Now().UnixNano())
 
-            if venue_symbol_map[msg.Venue] == nil {
-                buffer.Write(NO_VENUE_HEART)
-            } else {
-                commaflag := false
-                buffer.WriteString("{\n  \"ok\": true,\n  \"symbols\": [")
-                for s := range venue_symbol_map[msg.Venue] {
-                    name := s + " Inc"
-                    if commaflag {
-                        buffer.WriteString(",")
-                    }
-                    line := fmt.Sprintf("\n    {\"name\": \"%s\", \"symbol\": \"%s\"}", name, s)
-                    buffer.WriteString(line)
-                    commaflag = true
-                }
-                buffer.WriteString("\n  ]\n}")
-            }
+    book.Backend_MUTEX.RLock()
+    defer book.Backend_MUTEX.RUnlock()
 
-        default:
+    for book.Backend == nil {
+        book.Backend_MUTEX.RUnlock()
+        wake_book(book)
+        book.Backend_MUTEX.RLock()     // It could, just possibly, have gone back to sleep already
+    }
 
-            buffer.Write(MYSTERY_HUB_CMD)
+    metrics := &book.Metrics
+
+    atomic.AddInt64(&metrics.Commands[command_metric(msg.Command)], 1)
+    atomic.AddInt64(&metrics.InFlight, 1)
+    start := time.Now()
+
+    response := send_to_backend(book.Backend, book.BookId, msg)
+
+    atomic.AddInt64(&metrics.LatencyNs, int64(time.Since(start)))
+    atomic.AddInt64(&metrics.Responses, 1)
+    atomic.AddInt64(&metrics.InFlight, -1)
+
+    return response
+}
+
+func command_metric(command string) int {
+
+    word := command
+    if i := strings.IndexByte(command, ' '); i >= 0 {
+        word = command[:i]
     }
 
-    msg.ResponseChan <- buffer.Bytes()
-    return
+    switch word {
+        case "ORDER":
+            return METRIC_ORDER
+        case "CANCEL":
+            return METRIC_CANCEL
+        case "STATUS", "STATUSALL":
+            return METRIC_STATUS
+        case "ORDERBOOK_BINARY":
+            return METRIC_ORDERBOOK
+        case "QUOTE":
+            return METRIC_QUOTE
+    }
+    return METRIC_OTHER
 }
 
-func controller(venue string, symbol string, pipes PipesStruct, command_chan chan Command)  {
+func send_to_backend(backend * Backend, book_id int, msg Command) []byte {
 
-    // This goroutine controls the stdout and stdin for a single backend.
-    // (stderr (for WebSockets) is handled by a different goroutine.)
+    result_chan := make(chan []byte)
+    msg.ResponseChan = result_chan
+    msg.BookId = book_id
+
+    if msg.Trace != nil {
+        msg.Trace.Queued = time.Now()
+        backend.CommandChan <- msg
+        response := <- result_chan
+        msg.Trace.Returned = time.Now()
+        return response
+    }
 
-    for {
-        msg := <- command_chan
+    backend.CommandChan <- msg
+    return <- result_chan
+}
 
-        command := msg.Command
+func book_command(book * Book, command string) []byte {
 
-        if len(command) == 0 || command[len(command) - 1] != '\n' {
-            command = command + "\n"
-        }
+    // For commands the frontend itself wants to send to a book. Doesn't look the book up,
+    // so this works even before the book has been published in the map.
 
-        fmt.Fprintf(pipes.Stdin, command)
+    return send_to_book(book, Command{Venue: book.Venue, Symbol: book.Symbol, Command: command})
+}
 
-        if command == "ORDERBOOK_BINARY\n" {      // This is a special case since the response is binary
-            handle_binary_orderbook_response(pipes.Stdout, msg.Venue, msg.Symbol, msg.ResponseChan)
-            continue
-        }
+func get_book(venue string, symbol string, create bool) (*Book, []byte) {
 
-        scanner := bufio.NewScanner(pipes.Stdout)
-        var buffer bytes.Buffer
+    // Usual case: the book exists and we find it without taking any lock.
 
-        for {
-            scanner.Scan()
-            str_piece := scanner.Bytes()
-            if bytes.Equal(str_piece, []byte("END")) {
-                break
-            } else {
-                buffer.Write(str_piece)
-                buffer.WriteByte('\n')
-            }
+    books := Books.Load().(map[string]map[string]*Book)
+
+    if books[venue] != nil && books[venue][symbol] != nil {
+        return books[venue][symbol], nil
+    }
+
+    if create == false {
+        if books[venue] == nil {
+            return nil, UNKNOWN_VENUE
         }
+        return nil, UNKNOWN_SYMBOL
+    }
 
-        msg.ResponseChan <- buffer.Bytes()
+    if bad_name(venue) || bad_name(symbol) {
+        return nil, BAD_BOOK_NAME
     }
-}
 
-func handle_binary_orderbook_response(backend_stdout io.ReadCloser, venue string, symbol string, result_chan chan []byte) {
+    BookCreation_MUTEX.Lock()
+    defer BookCreation_MUTEX.Unlock()
 
-    // The orderbook is the only thing the C backend sends in a binary format (this is
-    // done for speed reasons, as it's potentially a large amount of data, frequently
-    // requested in normal usage). See comments in the C file for format info.
+    // Someone may have created it while we waited for the lock...
 
-    reader := bufio.NewReader(backend_stdout)
+    books = Books.Load().(map[string]map[string]*Book)
 
-    var qty uint32
-    var price uint32
-    var commaflag bool
+    if books[venue] != nil && books[venue][symbol] != nil {
+        return books[venue][symbol], nil
+    }
 
-    var buffer bytes.Buffer
+    if BookCount >= Options.MaxBooks {
+        return nil, TOO_MANY_BOOKS
+    }
 
-    buffer.WriteString("{\n  \"ok\": true,\n  \"venue\": \"")
-    buffer.WriteString(venue)
-    buffer.WriteString("\",\n  \"symbol\": \"")
-    buffer.WriteString(symbol)
-    buffer.WriteString("\",\n  \"bids\": [")
+    // Either give the book a whole backend of its own, or put it on the shared backend
+    // that has the fewest books. A shared backend needs to be told about the new book.
 
-    wrote_any_bids := false
-    wrote_any_asks := false
+    var book * Book
 
-    commaflag = false
+    if len(SharedBackends) > 0 {
+        backend := SharedBackends[0]
+        for _, b := range SharedBackends {
+            if b.Books < backend.Books {
+                backend = b
+            }
+        }
+        book = &Book{Venue: venue, Symbol: symbol, BookId: backend.Books, Backend: backend}
+        backend.Books += 1
+        book_command(book, fmt.Sprintf("__NEWBOOK__ %s %s", venue, symbol))
+    } else {
+        backend := backend_for_book(venue, symbol)
+        book = &Book{Venue: venue, Symbol: symbol, BookId: 0, Backend: backend, LastUsed: time.Now().UnixNano()}
+        backend.Books += 1
+    }
+
+    if Options.TickerMs > 0 || Options.TickerCmds > 0 {
+        book_command(book, fmt.Sprintf("__CONFLATE__ %d %d", Options.TickerMs, Options.TickerCmds))
+    }
+
+    if book.Backend.Name != venue + " " + symbol {       // Shared, or from the pool
+        fmt.Printf("Creating %s %s (on %s as book %d)\n", venue, symbol, book.Backend.Name, book.BookId)
+    } else {
+        fmt.Printf("Creating %s %s\n", venue, symbol)
+    }
+
+    publish_book(book)
+    return book, nil
+}
+
+func publish_book(book * Book) {
+
+    // Must hold BookCreation_MUTEX. Copy the map (only the outer map and the one venue
+    // that changes), then publish it...
+
+    books := Books.Load().(map[string]map[string]*Book)
+    venue := book.Venue
+    symbol := book.Symbol
+
+    new_books := make(map[string]map[string]*Book, len(books) + 1)
+    for v, m := range books {
+        new_books[v] = m
+    }
+
+    new_venue := make(map[string]*Book, len(books[venue]) + 1)
+    for s, b := range books[venue] {
+        new_venue[s] = b
+    }
+    new_venue[symbol] = book
+    new_books[venue] = new_venue
+
+    Books.Store(new_books)
+    BookCount += 1
+}
+
+func start_backend(name string, args ...string) * Backend {
+
+    backend := &Backend{
+        Name: name,
+        CommandChan: make(chan Command, 256),
+        Core: -1,
+    }
+
+    if Options.InProcess {
+        InProcessEngine(backend, args)      // The other options are the same for every engine, so it reads them itself
+        if Options.Affinity {
+            place_new_backend(backend)
+        }
+        return backend
+    }
+
+    if Options.JournalDir != "" {
+        args = append(args, "-journal", Options.JournalDir)
+        if Options.SnapshotEvery > 0 {
+            args = append(args, "-snapshotevery", strconv.Itoa(Options.SnapshotEvery))
+        }
+    }
+
+    if Options.Archive > 0 {
+        args = append(args, "-archive", strconv.Itoa(Options.Archive))
+    }
+
+    if Options.VirtualClock > 0 {
+        args = append(args, "-virtualclock", strconv.FormatInt(Options.VirtualClock, 10), "-clockstep", strconv.Itoa(Options.ClockStep))
+    }
+
+    exec_command := exec.Command("./disorderBook.exe", args...)
+
+    var new_pipes_struct PipesStruct
+
+    if Options.Shm {
+        new_pipes_struct = ShmTransport(exec_command)
+    } else {
+        i_pipe, _ := exec_command.StdinPipe()
+        o_pipe, _ := exec_command.StdoutPipe()
+        e_pipe, _ := exec_command.StderrPipe()
+
+        // Should maybe handle errors from the above.
+
+        new_pipes_struct = PipesStruct{i_pipe, o_pipe, e_pipe, nil}
+    }
+
+    exec_command.Start()
+
+    for _, f := range exec_command.ExtraFiles {
+        f.Close()               // The backend has its own copies now
+    }
+
+    backend.Process = exec_command
+    backend.Release = new_pipes_struct.Release
+    backend.Readers.Add(2)
+
+    go func() {
+        ws_controller(new_pipes_struct.Stderr)
+        backend.Readers.Done()
+    }()
+    go controller(backend, new_pipes_struct)
+
+    if Options.Affinity {
+        place_new_backend(backend)
+    }
+
+    return backend
+}
+
+// With -pool N, up to N backends are kept started but with no books, so that a book that needs a
+// backend of its own gets one with a single __NEWBOOK__ rather than waiting for a process to start
+// (and, with -journal, that is also what replays the book's journal). pool_filler() tops the pool
+// up in the background: it starts a backend, then blocks until there's room for it. So the channel
+// holds one fewer than N, and the backend the filler is waiting to hand over makes up the N.
+
+func pool_filler() {
+
+    for n := 0; ; n++ {
+        BackendPool <- start_backend(fmt.Sprintf("pooled backend %d", n))
+    }
+}
+
+func backend_for_book(venue string, symbol string) * Backend {
+
+    if BackendPool != nil {
+        select {
+            case backend := <- BackendPool:
+                if Options.Affinity {
+                    place_new_backend(backend)
+                }
+                send_to_backend(backend, 0, Command{Venue: venue, Symbol: symbol, Command: fmt.Sprintf("__NEWBOOK__ %s %s", venue, symbol)})
+                return backend
+            default:                    // Pool's empty; don't wait for the filler
+        }
+    }
+
+    return start_backend(venue + " " + symbol, venue, symbol)
+}
+
+func restore_journaled_books() {
+
+    // Each journal is named <venue>-<symbol>.journal (names can't contain '-'). Creating the
+    // book is enough: the backend finds the journal and replays it.
+
+    files, err := ioutil.ReadDir(Options.JournalDir)
+    if err != nil {
+        fmt.Printf("Couldn't read journal directory: %v\n\n", err)
+        os.Exit(1)
+    }
+
+    for _, f := range files {
+        if strings.HasSuffix(f.Name(), ".journal") == false {
+            continue
+        }
+        parts := strings.Split(strings.TrimSuffix(f.Name(), ".journal"), "-")
+        if len(parts) == 2 {
+            if Options.Hibernate > 0 {
+                add_hibernating_book(parts[0], parts[1])       // No need to start it until it's used
+            } else {
+                get_book(parts[0], parts[1], true)
+            }
+        }
+    }
+}
+
+// Hibernation (-hibernate SECONDS, which needs -journal). A book's backend holds all its history
+// in memory, so once nobody has used the book for a while we snapshot it, close the backend's
+// stdin (it syncs its journal and exits), and set book.Backend to nil. The next command for the
+// book starts a new backend, which rebuilds the book from the snapshot and the end of the journal.
+// Every command holds the book's Backend_MUTEX for reading until its response arrives, so a book
+// is never put to sleep with commands in flight.
+//
+// A book can sleep through a restart of the frontend, and meanwhile accounts it has never seen
+// may have been numbered. That's fine: the account ints are kept in the accounts file (see
+// account_int()), and the backend matches the book's accounts to them by name as it loads.
+
+type SnapshotStatus struct {
+    Ok bool                     `json:"ok"`
+    Snapshot struct {
+        State string            `json:"state"`
+    }                           `json:"snapshot"`
+}
+
+func add_hibernating_book(venue string, symbol string) {
+
+    if bad_name(venue) || bad_name(symbol) {
+        return
+    }
+
+    BookCreation_MUTEX.Lock()
+    defer BookCreation_MUTEX.Unlock()
+
+    books := Books.Load().(map[string]map[string]*Book)
+
+    if (books[venue] != nil && books[venue][symbol] != nil) || BookCount >= Options.MaxBooks {
+        return
+    }
+
+    fmt.Printf("Found %s %s (hibernating)\n", venue, symbol)
+    publish_book(&Book{Venue: venue, Symbol: symbol, BookId: 0, Backend: nil, LastUsed: time.Now().UnixNano()})
+}
+
+func hibernator() {
+
+    // Every so often, puts to sleep the books that haven't been used for Options.Hibernate seconds.
+
+    idle := time.Duration(Options.Hibernate) * time.Second
+
+    interval := idle / 4
+    if interval < time.Second {
+        interval = time.Second
+    }
+
+    for {
+        time.Sleep(interval)
+
+        cutoff := time.Now().Add(-idle).UnixNano()
+
+        books := Books.Load().(map[string]map[string]*Book)
+        for _, venue_map := range books {
+            for _, book := range venue_map {
+                if atomic.LoadInt64(&book.LastUsed) < cutoff {
+                    hibernate_book(book, cutoff)
+                }
+            }
+        }
+    }
+}
+
+func hibernate_book(book * Book, cutoff int64) {
+
+    book.Backend_MUTEX.Lock()
+    defer book.Backend_MUTEX.Unlock()
+
+    backend := book.Backend
+
+    if backend == nil || atomic.LoadInt64(&book.LastUsed) >= cutoff {
+        return                  // Already asleep, or used while we waited for the lock
+    }
+
+    // Snapshot it, so that waking it only means replaying a little of the journal. (If a
+    // snapshot is already being made, SNAPSHOT fails, but we wait for that one instead.)
+
+    var status SnapshotStatus
+
+    send_to_backend(backend, book.BookId, Command{Venue: book.Venue, Symbol: book.Symbol, Command: "SNAPSHOT"})
+
+    for {
+        response := send_to_backend(backend, book.BookId, Command{Venue: book.Venue, Symbol: book.Symbol, Command: "SNAPSHOTSTATUS"})
+        err := json.Unmarshal(response, &status)
+        if err != nil || status.Snapshot.State != "running" {
+            break               // If it failed, never mind; the journal has everything anyway
+        }
+        time.Sleep(10 * time.Millisecond)
+    }
+
+    atomic.StoreInt32(&backend.Stopping, 1)
+    close(backend.CommandChan)
+    backend.Readers.Wait()
+    backend.Process.Wait()
+    if backend.Release != nil {
+        backend.Release()
+    }
+
+    book.Backend = nil
+    fmt.Printf("Hibernating %s %s\n", book.Venue, book.Symbol)
+}
+
+func wake_book(book * Book) {
+
+    book.Backend_MUTEX.Lock()
+    defer book.Backend_MUTEX.Unlock()
+
+    if book.Backend != nil {
+        return                  // Someone else woke it while we waited for the lock
+    }
+
+    start := time.Now()
+
+    backend := backend_for_book(book.Venue, book.Symbol)
+
+    if Options.TickerMs > 0 || Options.TickerCmds > 0 {
+        send_to_backend(backend, 0, Command{Venue: book.Venue, Symbol: book.Symbol,
+                        Command: fmt.Sprintf("__CONFLATE__ %d %d", Options.TickerMs, Options.TickerCmds)})
+    }
+
+    // The backend rebuilds the book before it reads any commands, so once this
+    // is answered the book is ready...
+
+    send_to_backend(backend, 0, Command{Venue: book.Venue, Symbol: book.Symbol, Command: "__TIMESTAMP__"})
+
+    book.Backend = backend
+    book.Wakes += 1
+    book.LastWakeMs = float64(time.Since(start).Nanoseconds()) / 1e6
+
+    fmt.Printf("Woke %s %s in %.1f ms\n", book.Venue, book.Symbol, book.LastWakeMs)
+}
+
+type HibernationReport struct {
+    Venue string                `json:"venue"`
+    Symbol string               `json:"symbol"`
+    State string                `json:"state"`
+    IdleSeconds int64           `json:"idleSeconds"`
+    Wakes int                   `json:"wakes"`
+    LastWakeMs float64          `json:"lastWakeMs"`
+}
+
+func hibernation_report() []byte {
+
+    now := time.Now().UnixNano()
+    books := Books.Load().(map[string]map[string]*Book)
+
+    report := struct {
+        Ok bool                     `json:"ok"`
+        Books []HibernationReport   `json:"books"`
+    }{Ok: true, Books: []HibernationReport{}}
+
+    for _, venue_map := range books {
+        for _, book := range venue_map {
+            book.Backend_MUTEX.RLock()
+            state := "awake"
+            if book.Backend == nil {
+                state = "hibernating"
+            }
+            report.Books = append(report.Books, HibernationReport{
+                Venue: book.Venue,
+                Symbol: book.Symbol,
+                State: state,
+                IdleSeconds: (now - atomic.LoadInt64(&book.LastUsed)) / 1e9,
+                Wakes: book.Wakes,
+                LastWakeMs: tenths(book.LastWakeMs),
+            })
+            book.Backend_MUTEX.RUnlock()
+        }
+    }
+
+    ret, _ := json.MarshalIndent(report, "", "  ")
+    return ret
+}
+
+// Per-book metrics. The counters are bumped as commands go through send_to_book() and as
+// ws_controller() hands out messages, which costs a few atomic adds. Every METRICS_INTERVAL,
+// metrics_poller() turns them into rates, and asks each awake book for its __MEMORY__ (which
+// includes how many order nodes are resting in the book). Hibernating books aren't woken for
+// this; they just keep their last figures.
+
+func metrics_poller() {
+
+    for {
+        time.Sleep(METRICS_INTERVAL)
+
+        books := Books.Load().(map[string]map[string]*Book)
+        for _, venue_map := range books {
+            for _, book := range venue_map {
+                poll_book(book)
+            }
+        }
+
+        if Options.Affinity {
+            place_backends()
+        }
+    }
+}
+
+func poll_book(book * Book) {
+
+    metrics := &book.Metrics
+    seconds := METRICS_INTERVAL.Seconds()
+
+    var memory MemoryResponse
+
+    book.Backend_MUTEX.RLock()
+    if book.Backend != nil {
+        response := send_to_backend(book.Backend, book.BookId, Command{Venue: book.Venue, Symbol: book.Symbol, Command: "__MEMORY__"})
+        json.Unmarshal(response, &memory)
+    }
+    book.Backend_MUTEX.RUnlock()
+
+    metrics.Polled_MUTEX.Lock()
+    defer metrics.Polled_MUTEX.Unlock()
+
+    for n := 0; n < METRIC_TYPES; n++ {
+        count := atomic.LoadInt64(&metrics.Commands[n])
+        metrics.Polled.Rates[n] = float64(count - metrics.LastCommands[n]) / seconds
+        metrics.LastCommands[n] = count
+    }
+
+    latency_ns := atomic.LoadInt64(&metrics.LatencyNs)
+    responses := atomic.LoadInt64(&metrics.Responses)
+    if responses > metrics.LastResponses {
+        metrics.Polled.LatencyUs = float64(latency_ns - metrics.LastLatencyNs) / float64(responses - metrics.LastResponses) / 1000
+    } else {
+        metrics.Polled.LatencyUs = 0
+    }
+    metrics.LastLatencyNs = latency_ns
+    metrics.LastResponses = responses
+
+    if memory.Ok {
+        metrics.Polled.RestingOrders = memory.Types["ordernodes"].Live
+        metrics.Polled.LiveBytes = memory.LiveBytes
+        metrics.Polled.PolledAt = time.Now().UnixNano()
+    }
+}
+
+type BookMetricsReport struct {
+    Venue string                        `json:"venue"`
+    Symbol string                       `json:"symbol"`
+    State string                        `json:"state"`
+    CommandsPerSec map[string]float64   `json:"commandsPerSec"`
+    InFlight int64                      `json:"inFlight"`
+    BackendQueue int                    `json:"backendQueue"`
+    LatencyUs float64                   `json:"latencyUs"`
+    WsSubscribers int                   `json:"wsSubscribers"`
+    WsSent int64                        `json:"wsSent"`
+    WsCoalesced int64                   `json:"wsCoalesced"`
+    WsDropped int64                     `json:"wsDropped"`
+    RestingOrders int64                 `json:"restingOrders"`
+    LiveBytes int64                     `json:"liveBytes"`
+    PollAgeSeconds int                  `json:"pollAgeSeconds"`
+}
+
+func metrics_report() []byte {
+
+    // Clients subscribed to a whole venue get every book's messages, so they count for each book...
+
+    subscribers := make(map[string]int)
+
+    WebSocketClients_MUTEX.RLock()
+    for key, list := range WebSocketIndex {
+        subscribers[key.Venue + " " + key.Symbol] += len(list)
+    }
+    WebSocketClients_MUTEX.RUnlock()
+
+    now := time.Now().UnixNano()
+    books := Books.Load().(map[string]map[string]*Book)
+
+    report := struct {
+        Ok bool                         `json:"ok"`
+        IntervalSeconds int             `json:"intervalSeconds"`
+        Books []BookMetricsReport       `json:"books"`
+    }{Ok: true, IntervalSeconds: int(METRICS_INTERVAL.Seconds()), Books: []BookMetricsReport{}}
+
+    for _, venue_map := range books {
+        for _, book := range venue_map {
+            metrics := &book.Metrics
+
+            book.Backend_MUTEX.RLock()
+            state := "awake"
+            backend_queue := 0
+            if book.Backend == nil {
+                state = "hibernating"
+            } else {
+                backend_queue = len(book.Backend.CommandChan)
+            }
+            book.Backend_MUTEX.RUnlock()
+
+            metrics.Polled_MUTEX.Lock()
+            polled := metrics.Polled
+            metrics.Polled_MUTEX.Unlock()
+
+            rates := make(map[string]float64)
+            for n := 0; n < METRIC_TYPES; n++ {
+                rates[MetricNames[n]] = tenths(polled.Rates[n])
+            }
+
+            poll_age := -1
+            if polled.PolledAt > 0 {
+                poll_age = int((now - polled.PolledAt) / 1e9)
+            }
+
+            report.Books = append(report.Books, BookMetricsReport{
+                Venue: book.Venue,
+                Symbol: book.Symbol,
+                State: state,
+                CommandsPerSec: rates,
+                InFlight: atomic.LoadInt64(&metrics.InFlight),
+                BackendQueue: backend_queue,
+                LatencyUs: tenths(polled.LatencyUs),
+                WsSubscribers: subscribers[book.Venue + " " + book.Symbol] + subscribers[book.Venue + " "],
+                WsSent: atomic.LoadInt64(&metrics.WsSent),
+                WsCoalesced: atomic.LoadInt64(&metrics.WsCoalesced),
+                WsDropped: atomic.LoadInt64(&metrics.WsDropped),
+                RestingOrders: polled.RestingOrders,
+                LiveBytes: polled.LiveBytes,
+                PollAgeSeconds: poll_age,
+            })
+        }
+    }
+
+    ret, _ := json.MarshalIndent(report, "", "  ")
+    return ret
+}
+
+// CPU placement (-affinity, Linux only). Every backend starts pinned to the shared cores (all
+// of them but any -reservecores, which the frontend keeps). After each metrics poll, backends
+// are ranked by their books' commands per second: any doing at least -hotcmds gets a core to
+// itself, busiest first, for as long as there are cores to spare (at least one is always left
+// to share). It keeps that core until its rate falls below half of -hotcmds, so that books
+// near the threshold don't keep moving. Backends are pinned with __AFFINITY__, which in turn
+// pins all of their threads (or, with -inprocess, the engine's thread).
+
+func allowed_cpus() []int {
+
+    // The cores we may run on, from /proc so that running under taskset is respected.
+
+    var cpus []int
+
+    status, err := ioutil.ReadFile("/proc/self/status")
+    if err == nil {
+        for _, line := range strings.Split(string(status), "\n") {
+            if strings.HasPrefix(line, "Cpus_allowed_list:") == false {
+                continue
+            }
+            for _, part := range strings.Split(strings.TrimSpace(line[len("Cpus_allowed_list:"):]), ",") {
+                var lo, hi int
+                if n, _ := fmt.Sscanf(part, "%d-%d", &lo, &hi); n == 1 {
+                    hi = lo
+                } else if n == 0 {
+                    continue
+                }
+                for cpu := lo; cpu <= hi; cpu++ {
+                    cpus = append(cpus, cpu)
+                }
+            }
+        }
+    }
+
+    if len(cpus) == 0 {
+        for cpu := 0; cpu < runtime.NumCPU(); cpu++ {
+            cpus = append(cpus, cpu)
+        }
+    }
+
+    return cpus
+}
+
+func cpu_list(cpus []int) string {
+
+    parts := make([]string, len(cpus))
+    for n, cpu := range cpus {
+        parts[n] = strconv.Itoa(cpu)
+    }
+    return strings.Join(parts, ",")
+}
+
+func pin_backend(backend * Backend, cpus string) bool {
+
+    var result struct {
+        Ok bool                 `json:"ok"`
+    }
+
+    response := send_to_backend(backend, 0, Command{Command: "__AFFINITY__ " + cpus})
+    json.Unmarshal(response, &result)
+
+    if result.Ok == false {
+        fmt.Printf("Couldn't pin backend (%s) to cores %s: %s\n", backend.Name, cpus, strings.TrimSpace(string(response)))
+    }
+    return result.Ok
+}
+
+func place_new_backend(backend * Backend) {
+
+    // Onto the shared cores: for a backend that's just started, or one coming out of the pool
+    // (place_backends() only sees backends with books, so it may have changed them since).
+
+    Placement_MUTEX.Lock()
+    cpus := Placement.Shared
+    current := backend.Cpus
+    Placement_MUTEX.Unlock()
+
+    if cpus == current {
+        return
+    }
+
+    pinned := pin_backend(backend, cpus)
+
+    Placement_MUTEX.Lock()
+    backend.Cpus = cpus
+    backend.Pinned = pinned
+    Placement_MUTEX.Unlock()
+}
+
+func place_backends() {
+
+    type Placed struct {
+        Backend * Backend
+        Book * Book             // Any of its books; pinning holds its Backend_MUTEX, so it can't hibernate meanwhile
+        Books []string
+        Load float64            // Commands per second, over all its books
+        Cpus string             // Where it should be
+    }
+
+    var list []*Placed
+    index := make(map[*Backend]*Placed)
+
+    books := Books.Load().(map[string]map[string]*Book)
+    for _, venue_map := range books {
+        for _, book := range venue_map {
+            book.Backend_MUTEX.RLock()
+            backend := book.Backend
+            book.Backend_MUTEX.RUnlock()
+
+            if backend == nil {
+                continue
+            }
+
+            book.Metrics.Polled_MUTEX.Lock()
+            load := 0.0
+            for n := 0; n < METRIC_TYPES; n++ {
+                load += book.Metrics.Polled.Rates[n]
+            }
+            book.Metrics.Polled_MUTEX.Unlock()
+
+            p := index[backend]
+            if p == nil {
+                p = &Placed{Backend: backend, Book: book}
+                index[backend] = p
+                list = append(list, p)
+            }
+            p.Books = append(p.Books, book.Venue + " " + book.Symbol)
+            p.Load += load
+        }
+    }
+
+    sort.Slice(list, func(i, j int) bool { return list[i].Load > list[j].Load })
+
+    hot := float64(Options.HotCmds)
+
+    // Decide everything under the mutex, but pin without it (pinning waits on the backends)...
+
+    Placement_MUTEX.Lock()
+
+    taken := make(map[int]bool)
+    for _, p := range list {
+        if p.Backend.Core >= 0 {
+            if p.Load >= hot / 2 {
+                taken[p.Backend.Core] = true
+            } else {
+                fmt.Printf("Placement: %s (%.0f commands/s) back on the shared cores\n", p.Backend.Name, p.Load)
+                p.Backend.Core = -1
+                Placement.Moves += 1
+            }
+        }
+    }
+
+    var free []int
+    for _, cpu := range BackendCpus {
+        if taken[cpu] == false {
+            free = append(free, cpu)
+        }
+    }
+
+    for _, p := range list {
+        if p.Backend.Core < 0 && p.Load >= hot && len(free) > 1 {
+            p.Backend.Core = free[len(free) - 1]
+            free = free[:len(free) - 1]
+            fmt.Printf("Placement: %s (%.0f commands/s) gets core %d to itself\n", p.Backend.Name, p.Load, p.Backend.Core)
+            Placement.Moves += 1
+        }
+    }
+
+    Placement.Shared = cpu_list(free)
+
+    for _, p := range list {
+        if p.Backend.Core >= 0 {
+            p.Cpus = strconv.Itoa(p.Backend.Core)
+        } else {
+            p.Cpus = Placement.Shared
+        }
+    }
+
+    Placement_MUTEX.Unlock()
+
+    for _, p := range list {
+
+        Placement_MUTEX.Lock()
+        current := p.Backend.Cpus
+        Placement_MUTEX.Unlock()
+
+        if current == p.Cpus {
+            continue
+        }
+
+        pinned := false
+
+        p.Book.Backend_MUTEX.RLock()
+        if p.Book.Backend == p.Backend {
+            pinned = pin_backend(p.Backend, p.Cpus)
+        }
+        p.Book.Backend_MUTEX.RUnlock()
+
+        Placement_MUTEX.Lock()
+        p.Backend.Cpus = p.Cpus
+        p.Backend.Pinned = pinned
+        Placement_MUTEX.Unlock()
+    }
+
+    // And keep the backends part of the report, as of now...
+
+    Placement_MUTEX.Lock()
+    defer Placement_MUTEX.Unlock()
+
+    Placement.Report = make([]BackendPlacement, 0, len(list))
+    for _, p := range list {
+        Placement.Report = append(Placement.Report, BackendPlacement{
+            Backend: p.Backend.Name,
+            Books: p.Books,
+            CommandsPerSec: tenths(p.Load),
+            OwnCore: p.Backend.Core >= 0,
+            Cpus: p.Backend.Cpus,
+            Pinned: p.Backend.Pinned,
+        })
+    }
+}
+
+func placement_report() []byte {
+
+    Placement_MUTEX.Lock()
+    defer Placement_MUTEX.Unlock()
+
+    report := struct {
+        Ok bool                     `json:"ok"`
+        FrontendCpus string         `json:"frontendCpus"`
+        FrontendPinned bool         `json:"frontendPinned"`
+        BackendCpus string          `json:"backendCpus"`
+        SharedCpus string           `json:"sharedCpus"`
+        HotCmdsPerSec int           `json:"hotCmdsPerSec"`
+        Moves int                   `json:"moves"`
+        Backends []BackendPlacement `json:"backends"`
+    }{true, cpu_list(FrontendCpus), FrontendPinned, cpu_list(BackendCpus), Placement.Shared, Options.HotCmds, Placement.Moves, Placement.Report}
+
+    if report.Backends == nil {
+        report.Backends = []BackendPlacement{}         // Before the first pass
+    }
+
+    ret, _ := json.MarshalIndent(report, "", "  ")
+    return ret
+}
+
+// Tracing (-trace N). One request in N gets a Trace, which is stamped as the request passes
+// each stage: main_handler(), relay(), the backend's CommandChan, controller() and the pipe, the
+// backend itself (which reports its parse, match and serialise times on a line of its own), and
+// response_reader(). If the whole thing took at least -traceslowms, the breakdown is logged.
+
+func sample_trace(received time.Time) * Trace {
+
+    if Options.Trace == 0 || atomic.AddInt64(&TraceCounter, 1) % int64(Options.Trace) != 0 {
+        return nil
+    }
+    return &Trace{Received: received, Relayed: time.Now()}
+}
+
+func report_trace(msg Command) {
+
+    t := msg.Trace
+
+    if t.Queued.IsZero() || t.Returned.IsZero() {
+        return                  // Never got as far as a book
+    }
+
+    total := t.Written.Sub(t.Received)
+    if total < time.Duration(Options.TraceSlowMs) * time.Millisecond {
+        return
+    }
+
+    ms := func(d time.Duration) float64 {
+        return float64(d.Nanoseconds()) / 1e6
+    }
+
+    command := msg.Command
+    if i := strings.IndexByte(command, ' '); i >= 0 {
+        command = command[:i]           // The rest can include account names
+    }
+
+    // The backend's figures are part of the round trip, but needn't add up to less than it:
+    // the output thread can send the response while the matching is still finishing off.
+
+    fmt.Printf("Slow request: %s %s %s took %.3f ms -- handler %.3f, lookup %.3f, channel %.3f, write %.3f, " +
+               "round trip %.3f (backend parse %.3f, match %.3f, serialise %.3f), scan %.3f, return %.3f, http %.3f\n",
+               msg.Venue, msg.Symbol, command, ms(total),
+               ms(t.Relayed.Sub(t.Received)),
+               ms(t.Queued.Sub(t.Relayed)),
+               ms(t.Dequeued.Sub(t.Queued)),
+               ms(t.Flushed.Sub(t.Dequeued)),
+               ms(t.HeaderRead.Sub(t.Flushed)),
+               float64(t.ParseNs) / 1e6, float64(t.MatchNs) / 1e6, float64(t.SerialiseNs) / 1e6,
+               ms(t.BodyRead.Sub(t.HeaderRead)),
+               ms(t.Returned.Sub(t.BodyRead)),
+               ms(t.Written.Sub(t.Returned)))
+}
+
+func handle_hub_command(msg Command) []byte {
+
+    // Some commands aren't dealt with by passing them to a book but rather are queries of global state.
+
+    var buffer bytes.Buffer
+
+    venue_symbol_map := Books.Load().(map[string]map[string]*Book)
+
+    switch msg.HubCommand {
+
+        case VENUES_LIST:
+
+            commaflag := false
+            buffer.WriteString("{\n  \"ok\": true,\n  \"venues\": [")
+            for v := range venue_symbol_map {
+                name := v + " Exchange"
+                if commaflag {
+                    buffer.WriteString(",")
+                }
+                line := fmt.Sprintf("\n    {\"name\": \"%s\", \"state\": \"open\", \"venue\": \"%s\"}", name, v)
+                buffer.WriteString(line)
+                commaflag = true
+            }
+            buffer.WriteString("\n  ]\n}")
+
+        case VENUE_HEARTBEAT:
+
+            if venue_symbol_map[msg.Venue] == nil {
+                buffer.Write(NO_VENUE_HEART)
+            } else {
+                line := fmt.Sprintf(`{"ok": true, "venue": "%s"}`, msg.Venue)
+                buffer.WriteString(line)
+            }
+
+        case STOCK_LIST:
+
+            if venue_symbol_map[msg.Venue] == nil {
+                buffer.Write(NO_VENUE_HEART)
+            } else {
+                commaflag := false
+                buffer.WriteString("{\n  \"ok\": true,\n  \"symbols\": [")
+                for s := range venue_symbol_map[msg.Venue] {
+                    name := s + " Inc"
+                    if commaflag {
+                        buffer.WriteString(",")
+                    }
+                    line := fmt.Sprintf("\n    {\"name\": \"%s\", \"symbol\": \"%s\"}", name, s)
+                    buffer.WriteString(line)
+                    commaflag = true
+                }
+                buffer.WriteString("\n  ]\n}")
+            }
+
+        default:
+
+            buffer.Write(MYSTERY_HUB_CMD)
+    }
+
+    return buffer.Bytes()
+}
+
+func controller(backend * Backend, pipes PipesStruct)  {
+
+    // This goroutine controls the stdin for a single backend. Each command is tagged
+    // with a request id (and the id of the book within the backend) and we don't wait
+    // for the response before sending the next; a second goroutine reads the responses
+    // from stdout and matches them up by id. (stderr (for WebSockets) is handled by yet
+    // another goroutine.)
+
+    pending := make(map[int]*Pending)
+    var pending_mutex sync.Mutex
+    in_flight := make(chan bool, Options.Pipeline)      // Limits how many commands are in flight
+    gone := make(chan bool)                             // Closed (holding pending_mutex) once the reader has quit
+
+    go response_reader(bufio.NewReader(pipes.Stdout), backend, pending, &pending_mutex, in_flight, gone)
+
+    writer := bufio.NewWriter(pipes.Stdin)
+    next_id := 0
+    var unflushed []*Trace          // Traced commands still in the writer's buffer
+
+    flush := func() {
+        if len(unflushed) > 0 {
+            now := time.Now()
+            pending_mutex.Lock()            // So that response_reader() sees the stamps
+            for _, t := range unflushed {
+                t.Flushed = now
+            }
+            pending_mutex.Unlock()
+            unflushed = unflushed[:0]
+        }
+        writer.Flush()
+    }
+
+    send := func(book_id int, clock int64, command string, p * Pending) {
+
+        select {
+            case in_flight <- true:
+            default:
+                flush()                 // Must not sit on unsent commands while we wait
+                select {
+                    case in_flight <- true:
+                    case <- gone:       // Nobody will ever free a slot now
+                }
+        }
+
+        pending_mutex.Lock()
+        select {
+            case <- gone:
+                pending_mutex.Unlock()
+                p.ResponseChan <- BACKEND_DIED
+                return
+            default:
+        }
+        pending[next_id] = p
+        pending_mutex.Unlock()
+
+        if p.Trace == nil && clock == 0 {
+            fmt.Fprintf(writer, "#%d @%d %s", next_id, book_id, command)
+        } else {
+            fmt.Fprintf(writer, "#%d", next_id)
+            if p.Trace != nil {
+                writer.WriteByte('~')           // The backend sends its timings too
+                unflushed = append(unflushed, p.Trace)
+            }
+            fmt.Fprintf(writer, " @%d ", book_id)
+            if clock > 0 {
+                fmt.Fprintf(writer, "$%d ", clock)
+            }
+            writer.WriteString(command)
+        }
+        next_id += 1
+    }
+
+    command_chan := backend.CommandChan
+
+    for {
+        msg, ok := <- command_chan
+
+        if ok == false {                // Hibernating: the backend exits when it sees EOF
+            writer.Flush()
+            pipes.Stdin.Close()
+            return
+        }
+
+        if msg.Trace != nil {
+            msg.Trace.Dequeued = time.Now()
+        }
+
+        command := msg.Command
+
+        if len(command) == 0 || command[len(command) - 1] != '\n' {
+            command = command + "\n"
+        }
+
+        send(msg.BookId, msg.Clock, command, &Pending{
+            Venue: msg.Venue,
+            Symbol: msg.Symbol,
+            Binary: command == "ORDERBOOK_BINARY\n",     // This is a special case since the response is binary
+            ResponseChan: msg.ResponseChan,
+            Trace: msg.Trace,
+        })
+
+        // Only actually write to the pipe once nobody else is waiting to send...
+
+        if len(command_chan) == 0 {
+            flush()
+        }
+    }
+}
+
+func response_reader(reader * bufio.Reader, backend * Backend, pending map[int]*Pending, pending_mutex * sync.Mutex, in_flight chan bool, gone chan bool) {
+
+    // Each response from the backend begins with a line holding the request id. A traced
+    // response is held back until the line with the backend's timings for it comes too
+    // (which, with -workers, needn't be straight after it). If the backend dies, everyone
+    // still waiting (and anyone who sends it something later) gets BACKEND_DIED.
+
+    name := backend.Name
+    awaiting_timings := make(map[int]*Pending)
+
+    for {
+        header, err := reader.ReadString('\n')
+        if err != nil {
+            if atomic.LoadInt32(&backend.Stopping) == 0 {
+                fmt.Printf("Backend (%s) closed its stdout!\n", name)
+            }
+            for _, p := range awaiting_timings {
+                p.ResponseChan <- p.Response
+            }
+            pending_mutex.Lock()
+            close(gone)
+            waiting := make([]*Pending, 0, len(pending))
+            for id, p := range pending {
+                waiting = append(waiting, p)
+                delete(pending, id)
+            }
+            pending_mutex.Unlock()
+            for _, p := range waiting {
+                p.ResponseChan <- BACKEND_DIED
+            }
+            backend.Readers.Done()
+            return
+        }
+
+        if strings.HasPrefix(header, "%") {
+            var id int
+            var t Trace
+            fmt.Sscanf(header, "%%%d %d %d %d", &id, &t.ParseNs, &t.MatchNs, &t.SerialiseNs)
+            if p, ok := awaiting_timings[id]; ok {
+                delete(awaiting_timings, id)
+                p.Trace.ParseNs, p.Trace.MatchNs, p.Trace.SerialiseNs = t.ParseNs, t.MatchNs, t.SerialiseNs
+                p.ResponseChan <- p.Response
+                <- in_flight
+            }
+            continue
+        }
+
+        id, err := strconv.Atoi(strings.TrimLeft(strings.TrimSpace(header), "#"))
+
+        pending_mutex.Lock()
+        p, ok := pending[id]
+        delete(pending, id)
+        pending_mutex.Unlock()
+
+        if err != nil || !ok {
+            if atomic.LoadInt32(&backend.Stopping) == 0 {     // If we closed it, its parting message is expected
+                fmt.Printf("Backend (%s) sent a response we weren't expecting: %q\n", name, header)
+            }
+            continue
+        }
+
+        if p.Trace != nil {
+            p.Trace.HeaderRead = time.Now()
+            if p.Binary {
+                p.Response = read_binary_orderbook_response(reader, p.Venue, p.Symbol)
+            } else {
+                p.Response = read_text_response(reader)
+            }
+            p.Trace.BodyRead = time.Now()
+            awaiting_timings[id] = p
+            continue
+        }
+
+        if p.Binary {
+            p.ResponseChan <- read_binary_orderbook_response(reader, p.Venue, p.Symbol)
+        } else {
+            p.ResponseChan <- read_text_response(reader)
+        }
+
+        <- in_flight
+    }
+}
+
+func read_text_response(reader * bufio.Reader) []byte {
+
+    var buffer bytes.Buffer
+
+    for {
+        str_piece, err := reader.ReadBytes('\n')
+        str_piece = bytes.TrimRight(str_piece, "\r\n")
+        if bytes.Equal(str_piece, []byte("END")) || err != nil {
+            break
+        } else {
+            buffer.Write(str_piece)
+            buffer.WriteByte('\n')
+        }
+    }
+
+    return buffer.Bytes()
+}
+
+func read_binary_orderbook_response(reader * bufio.Reader, venue string, symbol string) []byte {
+
+    // The orderbook is the only thing the C backend sends in a binary format (this is
+    // done for speed reasons, as it's potentially a large amount of data, frequently
+    // requested in normal usage). See comments in the C file for format info.
+
+    var qty uint32
+    var price uint32
+    var commaflag bool
+
+    var buffer bytes.Buffer
+
+    buffer.WriteString("{\n  \"ok\": true,\n  \"venue\": \"")
+    buffer.WriteString(venue)
+    buffer.WriteString("\",\n  \"symbol\": \"")
+    buffer.WriteString(symbol)
+    buffer.WriteString("\",\n  \"bids\": [")
+
+    wrote_any_bids := false
+    wrote_any_asks := false
+
+    commaflag = false
     for {
         binary.Read(reader, binary.BigEndian, &qty)
         binary.Read(reader, binary.BigEndian, &price)
@@ -891,7 +2319,14 @@ func handle_binary_orderbook_response(backend_stdout io.ReadCloser, venue string
         }
     }
 
-    ts, _ := time.Now().UTC().MarshalJSON()
+    var ts []byte
+
+    if Options.VirtualClock > 0 {
+        line, _ := reader.ReadString('\n')         // The time by the book's clock, not ours
+        ts = []byte("\"" + strings.TrimSpace(line) + "\"")
+    } else {
+        ts, _ = time.Now().UTC().MarshalJSON()
+    }
 
     if wrote_any_asks {
         buffer.WriteString("\n  ")
@@ -900,19 +2335,20 @@ func handle_binary_orderbook_response(backend_stdout io.ReadCloser, venue string
     buffer.Write(ts)                        // Already has quotes around it
     buffer.WriteString("\n}")
 
-    result_chan <- buffer.Bytes()
-    return
+    return buffer.Bytes()
 }
 
 // WebSocket strategy:  http://www.gorillatoolkit.org/pkg/websocket
 //
 // For each incoming WS connection, the goroutine ws_handler() puts an entry
-// in a global struct, storing account, venue, and symbol (some of which
-// are optional). It also stores a channel used for communication.
+// in a global list, storing account, venue, and symbol (some of which
+// are optional). It also stores a channel used for communication. The
+// entry is also put in an index keyed by what the client subscribed to.
 //
 // Each C backend sends messages to stderr. There is one goroutine per
 // backend -- ws_controller() -- that reads these messages and passes them
-// on via the channels (only sending to the correct clients).
+// on via the channels (only sending to the correct clients, which it finds
+// through the index). Each message is encoded as a frame only once.
 
 func ws_handler(writer http.ResponseWriter, request * http.Request) {
 
@@ -933,41 +2369,35 @@ func ws_handler(writer http.ResponseWriter, request * http.Request) {
     var account string
     var venue string
     var symbol string
-    var info WsInfo
-
-    message_channel := make(chan string, 128)        // Dunno what buffer is appropriate
+    var conn_type int
 
     //ob/api/ws/:trading_account/venues/:venue/tickertape/stocks/:stock
     if len(pathlist) == 9 && pathlist[4] == "venues" && pathlist[6] == "tickertape" && pathlist[7] == "stocks" {
         account = ""
         venue = pathlist[5]
         symbol = pathlist[8]
-        info = WsInfo{account, venue, symbol, TICKER, message_channel}
-        append_to_ws_client_list(&info)
+        conn_type = TICKER
 
     //ob/api/ws/:trading_account/venues/:venue/tickertape
     } else if len(pathlist) == 7 && pathlist[4] == "venues" && pathlist[6] == "tickertape" {
         account = ""
         venue = pathlist[5]
         symbol = ""
-        info = WsInfo{account, venue, symbol, TICKER, message_channel}
-        append_to_ws_client_list(&info)
+        conn_type = TICKER
 
     //ob/api/ws/:trading_account/venues/:venue/executions/stocks/:symbol
     } else if len(pathlist) == 9 && pathlist[4] == "venues" && pathlist[6] == "executions" && pathlist[7] == "stocks" {
         account = pathlist[3]
         venue = pathlist[5]
         symbol = pathlist[8]
-        info = WsInfo{account, venue, symbol, EXECUTION, message_channel}
-        append_to_ws_client_list(&info)
+        conn_type = EXECUTION
 
     //ob/api/ws/:trading_account/venues/:venue/executions
     } else if len(pathlist) == 7 && pathlist[4] == "venues" && pathlist[6] == "executions" {
         account = pathlist[3]
         venue = pathlist[5]
         symbol = ""
-        info = WsInfo{account, venue, symbol, EXECUTION, message_channel}
-        append_to_ws_client_list(&info)
+        conn_type = EXECUTION
 
     // invalid URL
     } else {
@@ -975,34 +2405,131 @@ func ws_handler(writer http.ResponseWriter, request * http.Request) {
         return
     }
 
-    go ws_null_reader(conn, &info)     // This handles reading and discarding incoming messages
+    info := &WsInfo{
+        Account: account,
+        Venue: venue,
+        Symbol: symbol,
+        ConnType: conn_type,
+        MessageChannel: make(chan *websocket.PreparedMessage, 128),     // Dunno what buffer is appropriate
+        TickerSlots: make(map[string]*websocket.PreparedMessage),
+        Wake: make(chan bool, 1),
+        Kick: make(chan bool, 1),
+    }
+    append_to_ws_client_list(info)
+
+    go ws_null_reader(conn, info)     // This handles reading and discarding incoming messages
 
     for {
-        msg := <- message_channel
-        err = conn.WriteMessage(websocket.TextMessage, []byte(msg))
+        select {
+            case msg := <- info.MessageChannel:
+                err = conn.WritePreparedMessage(msg)
+                if err == nil {
+                    atomic.AddInt64(&info.Sent, 1)
+                }
+
+            case <- info.Wake:
+                for _, msg := range info.take_tickers() {
+                    err = conn.WritePreparedMessage(msg)
+                    if err != nil {
+                        break
+                    }
+                    atomic.AddInt64(&info.Sent, 1)
+                }
+
+            case <- info.Kick:
+                fmt.Printf("WebSocket KICKED (too slow) ... %s %s %s\n", info.Account, info.Venue, info.Symbol)
+                remove_from_ws_client_list(info)
+                conn.Close()
+                return
+        }
+
         if err != nil {
-            remove_from_ws_client_list(&info)
+            remove_from_ws_client_list(info)
             return      // The function ws_null_reader() will likely close the connection.
         }
     }
 }
 
-func ws_controller(venue string, symbol string, backend_stderr io.ReadCloser) {
+func (info * WsInfo) put_ticker(symbol string, msg * websocket.PreparedMessage) bool {
+
+    // A slow reader only ever has one pending ticker per symbol: the newest.
+    // Returns true if that replaced one, which will now never be sent.
+
+    info.TickerSlots_MUTEX.Lock()
+    _, coalesced := info.TickerSlots[symbol]
+    if coalesced {
+        atomic.AddInt64(&info.Coalesced, 1)
+    } else {
+        info.TickerOrder = append(info.TickerOrder, symbol)
+    }
+    info.TickerSlots[symbol] = msg
+    info.TickerSlots_MUTEX.Unlock()
+
+    select {
+        case info.Wake <- true:
+        default:                    // Already poked, the writer will see our slot
+    }
+    return coalesced
+}
+
+func (info * WsInfo) take_tickers() []*websocket.PreparedMessage {
+
+    info.TickerSlots_MUTEX.Lock()
+    defer info.TickerSlots_MUTEX.Unlock()
+
+    // In the order the symbols first came in, so that a venue-wide client sees them in a
+    // steady order rather than the map's...
+
+    ret := make([]*websocket.PreparedMessage, 0, len(info.TickerOrder))
+    for _, symbol := range info.TickerOrder {
+        ret = append(ret, info.TickerSlots[symbol])
+        delete(info.TickerSlots, symbol)
+    }
+    info.TickerOrder = info.TickerOrder[:0]
+    return ret
+}
+
+func (info * WsInfo) put_execution(msg * websocket.PreparedMessage) bool {
+
+    // Executions must not be lost silently. If the queue is full, the client is
+    // hopelessly behind and we disconnect it (it can reconnect and query status).
+    // Returns false in that case.
+
+    select {
+        case info.MessageChannel <- msg:
+            return true
+        default:
+            atomic.AddInt64(&info.Dropped, 1)
+            select {
+                case info.Kick <- true:
+                default:
+            }
+            return false
+    }
+}
+
+func ws_controller(backend_stderr io.ReadCloser) {
 
     // See comments above for WebSocket strategy. This goroutine is responsible
-    // for reading the stderr of a single C backend (i.e. a single book). It
-    // then passes WebSocket messages on to the relevant connections.
+    // for reading the stderr of a single C backend (which may host many books).
+    // It then passes WebSocket messages on to the relevant connections.
 
     scanner := bufio.NewScanner(backend_stderr)
 
     for {
-        scanner.Scan()
+        if scanner.Scan() == false {
+            return              // Backend has gone away
+        }
         headers := strings.Split(scanner.Text(), " ")
 
         var msg_type int
 
         // The backend sends a header line in format TYPE ACCOUNT VENUE SYMBOL
-        // (the last 2 pieces aren't needed as we know what they are already).
+
+        if len(headers) < 4 {
+            headers = append(headers, "", "", "")
+        }
+        venue, symbol := headers[2], headers[3]
 
         if headers[0] == "TICKER" {
             msg_type = TICKER
@@ -1017,7 +2544,9 @@ func ws_controller(venue string, symbol string, backend_stderr io.ReadCloser) {
         var buffer bytes.Buffer
 
         for {
-            scanner.Scan()
+            if scanner.Scan() == false {
+                return          // Gone mid-message (or a line too long to scan), as above
+            }
             str_piece := scanner.Text()
             if str_piece != "END" {
                 buffer.WriteString(str_piece)
@@ -1027,38 +2556,63 @@ func ws_controller(venue string, symbol string, backend_stderr io.ReadCloser) {
             }
         }
 
-        WebSocketClients_MUTEX.RLock()
+        // Only the clients subscribed to this exact (venue, symbol, type, account) or to
+        // the whole venue can want this. The frame is encoded once and shared by all of them.
 
-        for _, client := range WebSocketClients {
+        account := ""
+        if msg_type == EXECUTION {
+            account = headers[1]
+        }
 
-            if client.ConnType != msg_type {
-                continue
-            }
-            if client.Account != headers[1] && client.ConnType == EXECUTION {
-                continue
-            }
-            if client.Venue != venue {
-                continue
-            }
-            if client.Symbol != symbol && client.Symbol != "" {
-                continue
-            }
-            select {
-                case client.MessageChannel <- buffer.String() :         // Send message unless buffer is full
-                default:
+        var prepared * websocket.PreparedMessage
+        var sent, coalesced, dropped int64
+
+        WebSocketClients_MUTEX.RLock()
+
+        for _, key := range [2]WsKey{{venue, symbol, msg_type, account}, {venue, "", msg_type, account}} {
+            for _, client := range WebSocketIndex[key] {
+                if prepared == nil {
+                    prepared, _ = websocket.NewPreparedMessage(websocket.TextMessage, buffer.Bytes())
+                }
+                if msg_type == TICKER {
+                    if client.put_ticker(symbol, prepared) {
+                        coalesced += 1
+                    } else {
+                        sent += 1
+                    }
+                } else if client.put_execution(prepared) {
+                    sent += 1
+                } else {
+                    dropped += 1
+                }
             }
         }
 
         WebSocketClients_MUTEX.RUnlock()
+
+        if sent > 0 || coalesced > 0 || dropped > 0 {
+            books := Books.Load().(map[string]map[string]*Book)
+            if book := books[venue][symbol]; book != nil {
+                atomic.AddInt64(&book.Metrics.WsSent, sent)
+                atomic.AddInt64(&book.Metrics.WsCoalesced, coalesced)
+                atomic.AddInt64(&book.Metrics.WsDropped, dropped)
+            }
+        }
     }
 }
 
+func (info * WsInfo) key() WsKey {
+    return WsKey{info.Venue, info.Symbol, info.ConnType, info.Account}
+}
+
 func append_to_ws_client_list(info_ptr * WsInfo) {
 
     WebSocketClients_MUTEX.Lock()
     defer WebSocketClients_MUTEX.Unlock()
 
     WebSocketClients = append(WebSocketClients, info_ptr)
+    key := info_ptr.key()
+    WebSocketIndex[key] = append(WebSocketIndex[key], info_ptr)
     fmt.Printf("WebSocket -OPEN- ... Active == %d\n", len(WebSocketClients))
     return
 }
@@ -1076,6 +2630,7 @@ func remove_from_ws_client_list(info_ptr * WsInfo) {
             // pointer in the list, then shorten the list by 1.
             WebSocketClients[i] = WebSocketClients[len(WebSocketClients) - 1]
             WebSocketClients = WebSocketClients[:len(WebSocketClients) - 1]
+            remove_from_ws_index(info_ptr)
             fmt.Printf("WebSocket CLOSED ... Active == %d\n", len(WebSocketClients))
             break
         }
@@ -1083,6 +2638,68 @@ func remove_from_ws_client_list(info_ptr * WsInfo) {
     return
 }
 
+func remove_from_ws_index(info_ptr * WsInfo) {
+
+    // Caller must hold WebSocketClients_MUTEX for writing
+
+    key := info_ptr.key()
+    list := WebSocketIndex[key]
+
+    for i, client_ptr := range list {
+        if client_ptr == info_ptr {
+            list[i] = list[len(list) - 1]
+            list = list[:len(list) - 1]
+            break
+        }
+    }
+
+    if len(list) == 0 {
+        delete(WebSocketIndex, key)
+    } else {
+        WebSocketIndex[key] = list
+    }
+    return
+}
+
+type WsClientReport struct {
+    Account string              `json:"account"`
+    Venue string                `json:"venue"`
+    Symbol string               `json:"symbol"`
+    Type string                 `json:"type"`
+    Sent int64                  `json:"sent"`
+    Coalesced int64             `json:"coalesced"`
+    Dropped int64               `json:"dropped"`
+}
+
+func ws_client_report() []byte {
+
+    report := struct {
+        Ok bool                     `json:"ok"`
+        Clients []WsClientReport    `json:"clients"`
+    }{Ok: true, Clients: []WsClientReport{}}
+
+    WebSocketClients_MUTEX.RLock()
+    for _, client := range WebSocketClients {
+        conn_type := "tickertape"
+        if client.ConnType == EXECUTION {
+            conn_type = "executions"
+        }
+        report.Clients = append(report.Clients, WsClientReport{
+            Account: client.Account,
+            Venue: client.Venue,
+            Symbol: client.Symbol,
+            Type: conn_type,
+            Sent: atomic.LoadInt64(&client.Sent),
+            Coalesced: atomic.LoadInt64(&client.Coalesced),
+            Dropped: atomic.LoadInt64(&client.Dropped),
+        })
+    }
+    WebSocketClients_MUTEX.RUnlock()
+
+    ret, _ := json.MarshalIndent(report, "", "  ")
+    return ret
+}
+
 func ws_null_reader(conn * websocket.Conn, info_ptr * WsInfo) {
 
     // Apparently reading WebSocket messages from clients is mandatory.
@@ -1130,6 +2747,107 @@ func load_auth() {
     return
 }
 
+// The backends know accounts only by the ints we give them, and with -journal those ints are
+// in the journals and snapshots too. So they're kept in JournalDir/accounts, a "name int" line
+// each, and a restarted frontend hands out the same ones. A new account's line is synced before
+// its first order goes anywhere near a backend.
+
+func load_account_ints() {
+
+    filename := Options.JournalDir + "/accounts"
+
+    file, err := ioutil.ReadFile(filename)
+    if err != nil && os.IsNotExist(err) == false {
+        fmt.Printf("Couldn't read %s: %v\n\n", filename, err)
+        os.Exit(1)
+    }
+
+    // Only whole lines count (a crash can leave half of one, for an account that never got
+    // to place its order) and the ints must run 0, 1, 2...
+
+    good := 0
+
+    for good < len(file) {
+        nl := bytes.IndexByte(file[good:], '\n')
+        if nl < 0 {
+            break
+        }
+        fields := strings.Fields(string(file[good:good + nl]))
+        if len(fields) != 2 || bad_name(fields[0]) || fields[1] != strconv.Itoa(len(AccountInts)) {
+            break
+        }
+        AccountInts[fields[0]] = len(AccountInts)
+        good += nl + 1
+    }
+
+    if err == nil && good < len(file) {
+        fmt.Printf("Ignoring the end of %s (from byte %d)\n", filename, good)
+    }
+
+    if os.IsNotExist(err) {
+        matches, _ := filepath.Glob(Options.JournalDir + "/*.journal")
+        if len(matches) > 0 {
+            fmt.Printf("\n-----> Warning: journals but no accounts file; accounts in them may not match their names <-----\n\n")
+        }
+    }
+
+    AccountsFile, err = os.OpenFile(filename, os.O_RDWR | os.O_CREATE, 0644)
+    if err == nil {
+        err = AccountsFile.Truncate(int64(good))
+    }
+    if err == nil {
+        _, err = AccountsFile.Seek(int64(good), io.SeekStart)
+    }
+    if err != nil {
+        fmt.Printf("Couldn't open %s: %v\n\n", filename, err)
+        os.Exit(1)
+    }
+
+    if len(AccountInts) > 0 {
+        fmt.Printf("Loaded %d account(s)\n", len(AccountInts))
+    }
+    return
+}
+
+func account_int(name string) int {
+
+    AccountInts_MUTEX.RLock()
+    acc_id, ok := AccountInts[name]
+    AccountInts_MUTEX.RUnlock()
+
+    if ok {
+        return acc_id
+    }
+
+    AccountInts_MUTEX.Lock()
+    defer AccountInts_MUTEX.Unlock()
+
+    acc_id, ok = AccountInts[name]      // Someone may have added it while we waited for the lock
+    if ok {
+        return acc_id
+    }
+
+    acc_id = len(AccountInts)
+
+    if AccountsFile != nil {
+        _, err := fmt.Fprintf(AccountsFile, "%s %d\n", name, acc_id)
+        if err == nil {
+            err = AccountsFile.Sync()
+        }
+        if err != nil {
+            fmt.Printf("Couldn't write to the accounts file: %v\n", err)     // Like a backend that can't journal
+            os.Exit(1)
+        }
+    }
+
+    AccountInts[name] = acc_id
+    return acc_id
+}
+
+func tenths(x float64) float64 {         // For reports, where more digits are just noise
+    return math.Round(x * 10) / 10
+}
+
 func bad_name(name string) bool {
 
     if len(name) < 1 || len(name) > 20 {
@@ -0,0 +1,486 @@
+//go:build ignore
+// +build ignore
+
+package main
+
+// Load generator for the whole disorderBook stack (frontend, pipes, backends, WebSockets):
+//
+//     go run disorderBook_loadgen.go -bots 50 -books 4 -ws 20 -seconds 30
+//
+// N bots each trade on one of M books (round robin) with a mix of orders, cancels, status
+// checks, orderbooks and quotes, back to back (or with -thinkms between requests). K WebSocket
+// subscribers listen alongside: odd ones to a bot's executions, even ones to a book's ticker.
+// At the end we report requests per second and latency percentiles per endpoint, plus how long
+// executions took to arrive: from sending the order that caused them to receiving the message.
+//
+// It only ever talks to the local machine, since pointing it at somebody's server would be rude.
+
+import (
+    "bytes"
+    "encoding/json"
+    "flag"
+    "fmt"
+    "io"
+    "io/ioutil"
+    "math/rand"
+    "net"
+    "net/http"
+    "net/url"
+    "os"
+    "sort"
+    "strconv"
+    "strings"
+    "sync"
+    "sync/atomic"
+    "time"
+
+    "github.com/gorilla/websocket"      // go get github.com/gorilla/websocket
+)
+
+const (
+    EP_ORDER = iota
+    EP_CANCEL
+    EP_STATUS
+    EP_ORDERBOOK
+    EP_QUOTE
+    EP_COUNT
+)
+
+var EndpointNames = [EP_COUNT]string{"order", "cancel", "status", "orderbook", "quote"}
+
+var Options struct {
+    URL                 string
+    Venue               string
+    Bots                int
+    Books               int
+    Subscribers         int
+    Seconds             int
+    ThinkMs             int
+    Mix                 string
+    Seed                int64
+}
+
+type Bot struct {
+    Index               int
+    Account             string
+    Symbol              string
+    Random              * rand.Rand
+    Open                []int                               // Ids of our orders that may still be open
+    Latencies           [EP_COUNT][]time.Duration
+    Errors              [EP_COUNT]int
+}
+
+type LagTracker struct {
+    MUTEX               sync.Mutex
+    Sent                map[string]time.Time                // "symbol id" -> when that order was sent
+    Early               map[string][]time.Time              // Executions that beat the order's HTTP response
+    Lags                []time.Duration
+}
+
+type ExecutionMessage struct {
+    Symbol              string      `json:"symbol"`
+    IncomingId          int         `json:"incomingId"`
+}
+
+var Lags = LagTracker{Sent: make(map[string]time.Time), Early: make(map[string][]time.Time)}
+var TickersReceived int64
+var ExecutionsReceived int64
+var WsErrors int64
+
+var Client * http.Client
+var Weights [EP_COUNT]int
+var TotalWeight int
+
+func main() {
+
+    flag.StringVar(&Options.URL, "url", "http://127.0.0.1:8000", "Base URL of the frontend (must be on this machine)")
+    flag.StringVar(&Options.Venue, "venue", "LOADEX", "Venue to trade on (books are LOAD0, LOAD1, ...)")
+    flag.IntVar(&Options.Bots, "bots", 20, "Number of bots")
+    flag.IntVar(&Options.Books, "books", 4, "Number of books")
+    flag.IntVar(&Options.Subscribers, "ws", 10, "Number of WebSocket subscribers")
+    flag.IntVar(&Options.Seconds, "seconds", 10, "How long to run for")
+    flag.IntVar(&Options.ThinkMs, "thinkms", 0, "Pause between each bot's requests (0 = none)")
+    flag.StringVar(&Options.Mix, "mix", "order=50,cancel=20,status=15,orderbook=10,quote=5", "Relative weights of each request type")
+    flag.Int64Var(&Options.Seed, "seed", 1, "Random seed")
+    flag.Parse()
+
+    if Options.Bots < 1 || Options.Books < 1 || Options.Seconds < 1 || Options.Subscribers < 0 {
+        fmt.Printf("-bots, -books and -seconds must be positive\n")
+        os.Exit(1)
+    }
+
+    base, err := url.Parse(Options.URL)
+    if err != nil || (base.Scheme != "http" && base.Scheme != "https") {
+        fmt.Printf("Couldn't understand -url %q\n", Options.URL)
+        os.Exit(1)
+    }
+    if is_local(base.Hostname()) == false {
+        fmt.Printf("-url must be on this machine (localhost, 127.0.0.1 or ::1), not %q\n", base.Hostname())
+        os.Exit(1)
+    }
+    Options.URL = strings.TrimRight(Options.URL, "/")
+
+    parse_mix()
+
+    Client = &http.Client{
+        Transport: &http.Transport{MaxIdleConns: Options.Bots * 2, MaxIdleConnsPerHost: Options.Bots * 2},
+        Timeout: 30 * time.Second,
+    }
+
+    deadline := time.Now().Add(time.Duration(Options.Seconds) * time.Second)
+
+    // Subscribers first, so they see the start of the run...
+
+    var ws_conns []*websocket.Conn
+    var ws_wg sync.WaitGroup
+
+    for n := 0; n < Options.Subscribers; n++ {
+        conn := subscribe(n)
+        if conn != nil {
+            ws_conns = append(ws_conns, conn)
+            ws_wg.Add(1)
+            go func() {
+                ws_reader(conn)
+                ws_wg.Done()
+            }()
+        }
+    }
+
+    fmt.Printf("%d bots on %d books, %d WebSocket subscribers, %d seconds...\n", Options.Bots, Options.Books, len(ws_conns), Options.Seconds)
+
+    bots := make([]*Bot, Options.Bots)
+    var bot_wg sync.WaitGroup
+
+    start := time.Now()
+
+    for n := 0; n < Options.Bots; n++ {
+        bots[n] = &Bot{
+            Index: n,
+            Account: fmt.Sprintf("LOADBOT%d", n),
+            Symbol: fmt.Sprintf("LOAD%d", n % Options.Books),
+            Random: rand.New(rand.NewSource(Options.Seed * 1000003 + int64(n))),
+        }
+        bot_wg.Add(1)
+        go func(bot * Bot) {
+            run_bot(bot, deadline)
+            bot_wg.Done()
+        }(bots[n])
+    }
+
+    bot_wg.Wait()
+    elapsed := time.Since(start)
+
+    time.Sleep(500 * time.Millisecond)     // Let the last WebSocket messages arrive
+    for _, conn := range ws_conns {
+        conn.Close()
+    }
+    ws_wg.Wait()
+
+    report(bots, elapsed)
+}
+
+func is_local(host string) bool {
+
+    if host == "localhost" {
+        return true
+    }
+
+    ip := net.ParseIP(host)
+    return ip != nil && ip.IsLoopback()
+}
+
+func parse_mix() {
+
+    for _, part := range strings.Split(Options.Mix, ",") {
+
+        kv := strings.SplitN(strings.TrimSpace(part), "=", 2)
+        found := false
+
+        for ep := 0; ep < EP_COUNT; ep++ {
+            if len(kv) == 2 && kv[0] == EndpointNames[ep] {
+                weight, err := strconv.Atoi(kv[1])
+                if err != nil || weight < 0 {
+                    break
+                }
+                Weights[ep] = weight
+                found = true
+            }
+        }
+
+        if found == false {
+            fmt.Printf("Bad -mix entry %q (use e.g. order=50,cancel=20)\n", part)
+            os.Exit(1)
+        }
+    }
+
+    for ep := 0; ep < EP_COUNT; ep++ {
+        TotalWeight += Weights[ep]
+    }
+
+    if TotalWeight == 0 || Weights[EP_ORDER] == 0 {
+        fmt.Printf("-mix must include some orders\n")
+        os.Exit(1)
+    }
+}
+
+// ---------------------------------- BOTS ---------------------------------------------------
+
+func run_bot(bot * Bot, deadline time.Time) {
+
+    for time.Now().Before(deadline) {
+
+        ep := pick_endpoint(bot)
+
+        if (ep == EP_CANCEL || ep == EP_STATUS) && len(bot.Open) == 0 {
+            ep = EP_ORDER
+        }
+
+        switch ep {
+        case EP_ORDER:
+            send_order(bot)
+        case EP_CANCEL:
+            i := bot.Random.Intn(len(bot.Open))
+            id := bot.Open[i]
+            bot.Open[i] = bot.Open[len(bot.Open) - 1]
+            bot.Open = bot.Open[:len(bot.Open) - 1]
+            request(bot, EP_CANCEL, "DELETE", fmt.Sprintf("/ob/api/venues/%s/stocks/%s/orders/%d", Options.Venue, bot.Symbol, id), nil)
+        case EP_STATUS:
+            id := bot.Open[bot.Random.Intn(len(bot.Open))]
+            request(bot, EP_STATUS, "GET", fmt.Sprintf("/ob/api/venues/%s/stocks/%s/orders/%d", Options.Venue, bot.Symbol, id), nil)
+        case EP_ORDERBOOK:
+            request(bot, EP_ORDERBOOK, "GET", fmt.Sprintf("/ob/api/venues/%s/stocks/%s", Options.Venue, bot.Symbol), nil)
+        case EP_QUOTE:
+            request(bot, EP_QUOTE, "GET", fmt.Sprintf("/ob/api/venues/%s/stocks/%s/quote", Options.Venue, bot.Symbol), nil)
+        }
+
+        if Options.ThinkMs > 0 {
+            time.Sleep(time.Duration(Options.ThinkMs) * time.Millisecond)
+        }
+    }
+}
+
+func pick_endpoint(bot * Bot) int {
+
+    r := bot.Random.Intn(TotalWeight)
+
+    for ep := 0; ep < EP_COUNT; ep++ {
+        if r < Weights[ep] {
+            return ep
+        }
+        r -= Weights[ep]
+    }
+    return EP_ORDER
+}
+
+func send_order(bot * Bot) {
+
+    // Limit orders either side of a fixed mid, so that around half of them cross. One
+    // in ten is an IOC instead, which crosses or dies.
+
+    direction := "buy"
+    price := 5000 - 20 + bot.Random.Intn(30)
+    if bot.Random.Intn(2) == 0 {
+        direction = "sell"
+        price = 5000 + 20 - bot.Random.Intn(30)
+    }
+
+    order_type := "limit"
+    if bot.Random.Intn(10) == 0 {
+        order_type = "immediate-or-cancel"
+    }
+
+    body := fmt.Sprintf(`{"account": "%s", "venue": "%s", "stock": "%s", "qty": %d, "price": %d, "direction": "%s", "orderType": "%s"}`,
+                        bot.Account, Options.Venue, bot.Symbol, 1 + bot.Random.Intn(100), price, direction, order_type)
+
+    sent := time.Now()
+
+    response := request(bot, EP_ORDER, "POST", fmt.Sprintf("/ob/api/venues/%s/stocks/%s/orders", Options.Venue, bot.Symbol), []byte(body))
+    if response == nil {
+        return
+    }
+
+    var result struct {
+        Id int                  `json:"id"`
+        Open bool               `json:"open"`
+    }
+    if json.Unmarshal(response, &result) != nil {
+        return
+    }
+
+    if result.Open {
+        bot.Open = append(bot.Open, result.Id)
+    }
+
+    Lags.order_sent(bot.Symbol, result.Id, sent)
+}
+
+func request(bot * Bot, ep int, method string, path string, body []byte) []byte {
+
+    // Returns the response body, or nil if the request failed in any way (which is counted).
+
+    var reader io.Reader
+    if body != nil {
+        reader = bytes.NewReader(body)
+    }
+
+    req, err := http.NewRequest(method, Options.URL + path, reader)
+    if err != nil {
+        bot.Errors[ep] += 1
+        return nil
+    }
+
+    start := time.Now()
+
+    resp, err := Client.Do(req)
+    if err != nil {
+        bot.Errors[ep] += 1
+        return nil
+    }
+    response, err := ioutil.ReadAll(resp.Body)
+    resp.Body.Close()
+
+    bot.Latencies[ep] = append(bot.Latencies[ep], time.Since(start))
+
+    if err != nil || resp.StatusCode != 200 || bytes.Contains(response, []byte(`"ok": false`)) {
+        bot.Errors[ep] += 1
+        return nil
+    }
+    return response
+}
+
+// ---------------------------------- WEBSOCKETS ---------------------------------------------
+
+func subscribe(n int) * websocket.Conn {
+
+    ws_base := "ws" + strings.TrimPrefix(Options.URL, "http")     // https -> wss too
+
+    var path string
+    if n % 2 == 1 {
+        path = fmt.Sprintf("/ob/api/ws/LOADBOT%d/venues/%s/executions", (n / 2) % Options.Bots, Options.Venue)
+    } else {
+        path = fmt.Sprintf("/ob/api/ws/LOADBOT%d/venues/%s/tickertape/stocks/LOAD%d", (n / 2) % Options.Bots, Options.Venue, (n / 2) % Options.Books)
+    }
+
+    conn, _, err := websocket.DefaultDialer.Dial(ws_base + path, nil)
+    if err != nil {
+        fmt.Printf("WebSocket %s failed: %v\n", path, err)
+        atomic.AddInt64(&WsErrors, 1)
+        return nil
+    }
+    return conn
+}
+
+func ws_reader(conn * websocket.Conn) {
+
+    for {
+        _, message, err := conn.ReadMessage()
+        if err != nil {
+            return              // Including when we close it at the end
+        }
+
+        received := time.Now()
+
+        if bytes.Contains(message, []byte(`"incomingId"`)) {
+            atomic.AddInt64(&ExecutionsReceived, 1)
+            var execution ExecutionMessage
+            if json.Unmarshal(message, &execution) == nil {
+                Lags.execution_received(execution.Symbol, execution.IncomingId, received)
+            }
+        } else {
+            atomic.AddInt64(&TickersReceived, 1)
+        }
+    }
+}
+
+func (lags * LagTracker) order_sent(symbol string, id int, sent time.Time) {
+
+    key := symbol + " " + strconv.Itoa(id)
+
+    lags.MUTEX.Lock()
+    defer lags.MUTEX.Unlock()
+
+    lags.Sent[key] = sent
+
+    for _, received := range lags.Early[key] {
+        lags.Lags = append(lags.Lags, received.Sub(sent))
+    }
+    delete(lags.Early, key)
+}
+
+func (lags * LagTracker) execution_received(symbol string, id int, received time.Time) {
+
+    // The execution can arrive before the HTTP response that tells us the order's id,
+    // in which case it waits in Early until order_sent() sees it.
+
+    key := symbol + " " + strconv.Itoa(id)
+
+    lags.MUTEX.Lock()
+    defer lags.MUTEX.Unlock()
+
+    sent, ok := lags.Sent[key]
+    if ok {
+        lags.Lags = append(lags.Lags, received.Sub(sent))
+    } else {
+        lags.Early[key] = append(lags.Early[key], received)
+    }
+}
+
+// ---------------------------------- REPORTING ----------------------------------------------
+
+func percentile(sorted []time.Duration, p float64) float64 {
+    index := int(p * float64(len(sorted) - 1) + 0.5)
+    return float64(sorted[index].Nanoseconds()) / 1e6
+}
+
+func print_latency_line(name string, sorted []time.Duration, errors int, error_name string, seconds float64) {
+
+    if len(sorted) == 0 {
+        fmt.Printf("    %-10s %8d   (%s %d)\n", name, 0, error_name, errors)
+        return
+    }
+
+    fmt.Printf("    %-10s %8d  %8.0f/s   p50 %7.2f ms   p99 %7.2f ms   p99.9 %7.2f ms   max %8.2f ms   %s %d\n",
+               name, len(sorted), float64(len(sorted)) / seconds,
+               percentile(sorted, 0.5), percentile(sorted, 0.99), percentile(sorted, 0.999),
+               float64(sorted[len(sorted) - 1].Nanoseconds()) / 1e6, error_name, errors)
+}
+
+func report(bots []*Bot, elapsed time.Duration) {
+
+    seconds := elapsed.Seconds()
+    total := 0
+
+    fmt.Printf("\nHTTP:\n")
+
+    for ep := 0; ep < EP_COUNT; ep++ {
+
+        var all []time.Duration
+        errors := 0
+
+        for _, bot := range bots {
+            all = append(all, bot.Latencies[ep]...)
+            errors += bot.Errors[ep]
+        }
+
+        sort.Slice(all, func(i, j int) bool {return all[i] < all[j]})
+        total += len(all)
+
+        print_latency_line(EndpointNames[ep], all, errors, "errors", seconds)
+    }
+
+    fmt.Printf("    %-10s %8d  %8.0f/s\n", "total", total, float64(total) / seconds)
+
+    fmt.Printf("\nWebSockets: %d tickers, %d executions received, %d failed to connect\n",
+               atomic.LoadInt64(&TickersReceived), atomic.LoadInt64(&ExecutionsReceived), atomic.LoadInt64(&WsErrors))
+
+    Lags.MUTEX.Lock()
+    lags := Lags.Lags
+    unmatched := 0
+    for _, early := range Lags.Early {
+        unmatched += len(early)
+    }
+    Lags.MUTEX.Unlock()
+
+    sort.Slice(lags, func(i, j int) bool {return lags[i] < lags[j]})
+    print_latency_line("exec lag", lags, unmatched, "unmatched", seconds)      // Executions for orders we never heard back about
+}
@@ -0,0 +1,229 @@
+//go:build !windows
+// +build !windows
+
+package main
+
+// Shared memory transport between the frontend and a backend (see -shm), built with
+//
+//     go build disorderBook_front.go disorderBook_shm.go
+//
+// Three rings live in one shared file: commands (us -> backend), then responses and
+// WebSocket messages (backend -> us). They carry exactly the bytes the pipes would have,
+// so everything else is unchanged. Each ring has a single producer and single consumer,
+// who just busy-poll while there is traffic. A consumer with nothing to read sets its
+// sleeping flag and blocks on a pipe (its doorbell); a producer that sees the flag rings
+// the doorbell with a single byte. So the pipes are only touched when one side is idle.
+//
+// The layout must match the C file. The backend gets the file as fd 3, and the doorbells
+// for the three rings as fds 4, 5, 6.
+
+import (
+    "fmt"
+    "io"
+    "io/ioutil"
+    "os"
+    "os/exec"
+    "runtime"
+    "sync/atomic"
+    "syscall"
+    "time"
+    "unsafe"
+)
+
+const (
+    SHM_RING_SIZE = 1 << 20
+    SHM_HEADER_SIZE = 256
+    SHM_TAIL = 0                // Offsets within each ring's header (separate cache lines)
+    SHM_HEAD = 64
+    SHM_SLEEPING = 128
+    SHM_SPINS = 20000           // How long a reader busy-polls before sleeping on its doorbell
+)
+
+type ShmRing struct {
+    Tail                * uint64        // Bytes ever written, only written by the producer
+    Head                * uint64        // Bytes ever read, only written by the consumer
+    Sleeping            * uint32        // Set by the consumer before it blocks on the doorbell
+    Data                []byte
+    Doorbell            * os.File       // Our end: read end if we consume, write end if we produce
+    Gone                * int32         // Shared by all three rings; set once a consumer's doorbell hits EOF
+}
+
+func init() {
+    ShmTransport = start_shm_transport
+}
+
+func new_shm_ring(mem []byte, doorbell * os.File, gone * int32) * ShmRing {
+    return &ShmRing{
+        Tail: (*uint64)(unsafe.Pointer(&mem[SHM_TAIL])),
+        Head: (*uint64)(unsafe.Pointer(&mem[SHM_HEAD])),
+        Sleeping: (*uint32)(unsafe.Pointer(&mem[SHM_SLEEPING])),
+        Data: mem[SHM_HEADER_SIZE : SHM_HEADER_SIZE + SHM_RING_SIZE],
+        Doorbell: doorbell,
+        Gone: gone,
+    }
+}
+
+func start_shm_transport(exec_command * exec.Cmd) PipesStruct {
+
+    // The file is unlinked straight away; our mapping and the backend's fd keep it alive.
+
+    dir := "/dev/shm"
+    if info, err := os.Stat(dir); err != nil || !info.IsDir() {
+        dir = os.TempDir()
+    }
+
+    file, err := ioutil.TempFile(dir, "disorderBook-")
+    if err != nil {
+        fmt.Printf("Couldn't create shared memory file: %v\n\n", err)
+        os.Exit(1)
+    }
+    os.Remove(file.Name())
+
+    ring_bytes := SHM_HEADER_SIZE + SHM_RING_SIZE
+
+    err = file.Truncate(int64(3 * ring_bytes))
+    if err != nil {
+        fmt.Printf("Couldn't size shared memory file: %v\n\n", err)
+        os.Exit(1)
+    }
+
+    mem, err := syscall.Mmap(int(file.Fd()), 0, 3 * ring_bytes, syscall.PROT_READ | syscall.PROT_WRITE, syscall.MAP_SHARED)
+    if err != nil {
+        fmt.Printf("Couldn't map shared memory file: %v\n\n", err)
+        os.Exit(1)
+    }
+
+    command_r, command_w, _ := os.Pipe()
+    response_r, response_w, _ := os.Pipe()
+    event_r, event_w, _ := os.Pipe()
+
+    // Should maybe handle errors from the above.
+
+    exec_command.Args = append(exec_command.Args, "-shm")
+    exec_command.ExtraFiles = []*os.File{file, command_r, response_w, event_w}     // Closed by start_backend()
+    exec_command.Stdout = os.Stdout         // Only used if the backend has a fatal error
+    exec_command.Stderr = os.Stderr
+
+    // The backend holds the only write ends of the response and event doorbells, so one of
+    // those hitting EOF means it has gone, which is how a full command ring finds out.
+
+    gone := new(int32)
+
+    return PipesStruct{
+        Stdin: new_shm_ring(mem[0 : ring_bytes], command_w, gone),
+        Stdout: new_shm_ring(mem[ring_bytes : 2 * ring_bytes], response_r, gone),
+        Stderr: new_shm_ring(mem[2 * ring_bytes : 3 * ring_bytes], event_r, gone),
+        Release: func() {
+            syscall.Munmap(mem)         // Only called once both readers have hit EOF
+            response_r.Close()
+            event_r.Close()
+        },
+    }
+}
+
+func (ring * ShmRing) readable() bool {
+    return atomic.LoadUint64(ring.Tail) != atomic.LoadUint64(ring.Head)
+}
+
+func (ring * ShmRing) wait() error {
+
+    for n := 0; n < SHM_SPINS; n++ {
+        if ring.readable() {
+            return nil
+        }
+        if n % 256 == 255 {
+            runtime.Gosched()
+        }
+    }
+
+    atomic.StoreUint32(ring.Sleeping, 1)
+
+    // Checked after setting the flag, so that a producer which missed the flag must have
+    // published its data before we looked. (A stale doorbell byte just means a spurious
+    // wakeup later.)
+
+    var err error
+    var junk [64]byte
+
+    if ring.readable() == false {
+        _, err = ring.Doorbell.Read(junk[:])
+    }
+
+    atomic.StoreUint32(ring.Sleeping, 0)
+
+    if err != nil {
+        atomic.StoreInt32(ring.Gone, 1)
+    }
+    return err                  // io.EOF if the backend has gone
+}
+
+func (ring * ShmRing) Read(p []byte) (int, error) {
+
+    for ring.readable() == false {
+        err := ring.wait()
+        if err != nil {
+            return 0, err
+        }
+    }
+
+    head := atomic.LoadUint64(ring.Head)
+    avail := atomic.LoadUint64(ring.Tail) - head
+    offset := head % SHM_RING_SIZE
+
+    n := uint64(len(p))
+    if n > avail {
+        n = avail
+    }
+    if n > SHM_RING_SIZE - offset {
+        n = SHM_RING_SIZE - offset      // Rest will come next time
+    }
+
+    copy(p, ring.Data[offset : offset + n])
+    atomic.StoreUint64(ring.Head, head + n)
+    return int(n), nil
+}
+
+func (ring * ShmRing) Write(p []byte) (int, error) {
+
+    total := len(p)
+    tail := atomic.LoadUint64(ring.Tail)
+
+    for len(p) > 0 {
+
+        space := SHM_RING_SIZE - (tail - atomic.LoadUint64(ring.Head))
+        if space == 0 {
+            if atomic.LoadInt32(ring.Gone) == 1 {
+                return total - len(p), io.ErrClosedPipe       // Where a pipe would have given EPIPE
+            }
+            time.Sleep(50 * time.Microsecond)      // Backend is behind; same as a full pipe, really
+            continue
+        }
+
+        offset := tail % SHM_RING_SIZE
+        n := uint64(len(p))
+        if n > space {
+            n = space
+        }
+        if n > SHM_RING_SIZE - offset {
+            n = SHM_RING_SIZE - offset
+        }
+
+        copy(ring.Data[offset : offset + n], p[:n])
+        tail += n
+        atomic.StoreUint64(ring.Tail, tail)
+        p = p[n:]
+
+        if atomic.SwapUint32(ring.Sleeping, 0) == 1 {
+            _, err := ring.Doorbell.Write([]byte{'!'})
+            if err != nil {
+                return total - len(p), io.ErrClosedPipe       // Backend has gone
+            }
+        }
+    }
+
+    return total, nil
+}
+
+func (ring * ShmRing) Close() error {
+    return ring.Doorbell.Close()            // For the command ring, the backend sees this as EOF
+}